@@ -19,12 +19,23 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #define DEFAULT_ARENA_SIZE_OF_MB 16
+#define DEFAULT_ARENA_POOL_SIZE 8
+#define DEFAULT_NETWORK_CACHE_SIZE_OF_MB 64
 #define ETHOSU_PMU_EVENT_MAX 4
 
 /*
@@ -43,6 +54,8 @@
 
 namespace EthosU {
 
+struct ethosu_uapi_inference_create;
+
 class Exception : public std::exception {
 public:
     Exception(const char *msg);
@@ -53,6 +66,21 @@ private:
     std::string msg;
 };
 
+/**
+ * Log level
+ *
+ * The initial level is read from the ETHOSU_LOG_LEVEL environment variable.
+ * Levels below ETHOSU_LOG_MIN_LEVEL, set when the library is built, are
+ * compiled out, and the arguments of disabled log statements are not
+ * evaluated. Log records are written by a background thread, flushLog()
+ * waits until all records logged so far have been written.
+ */
+enum class LogLevel { Error, Warning, Info, Debug };
+
+void setLogLevel(LogLevel level);
+LogLevel getLogLevel();
+void flushLog();
+
 /**
  * Sematic Version : major.minor.patch
  */
@@ -129,6 +157,105 @@ public:
     SemanticVersion driver;
 };
 
+/**
+ * Latency stage
+ * @BufferCreate:              Creating and mapping a buffer
+ * @NetworkCreate:             Creating a network and reading its info
+ * @InferenceSetup:            Preparing the inference request
+ * @InferenceSubmit:           Creating or resubmitting the kernel inference
+ * @InferenceWait:             From submit until the completion was observed,
+ *                             which covers queueing, NPU execution and wakeup
+ * @InferenceResult:           Reading back the status and counters
+ * @InferenceTotal:            From submit until the result was read back
+ */
+enum class LatencyStage {
+    BufferCreate,
+    NetworkCreate,
+    InferenceSetup,
+    InferenceSubmit,
+    InferenceWait,
+    InferenceResult,
+    InferenceTotal,
+};
+
+#define ETHOSU_LATENCY_STAGE_COUNT 7
+
+std::ostream &operator<<(std::ostream &out, const LatencyStage &stage);
+
+/**
+ * Latency histogram
+ *
+ * Log-linear histogram of latencies in nanoseconds, in the style of HDR
+ * histograms. Every power of two is split into 16 linear sub-buckets, which
+ * keeps recorded values with a relative precision of 1/16. Values may be
+ * recorded concurrently from several threads without locking.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(uint64_t nanos);
+    void reset();
+
+    uint64_t getCount() const;
+    uint64_t getMin() const;
+    uint64_t getMax() const;
+    double getMean() const;
+    uint64_t getPercentile(double percentile) const;
+
+private:
+    static size_t bucketIndex(uint64_t nanos);
+    static uint64_t bucketLimit(size_t index);
+
+    std::atomic<uint64_t> buckets[976];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+};
+
+/**
+ * Latency profile
+ *
+ * One histogram per latency stage. Every device and network owns a profile,
+ * devices record buffer creation and networks the stages of their
+ * inferences.
+ */
+class LatencyProfile {
+public:
+    LatencyProfile(const std::string &name);
+
+    const std::string &getName() const;
+    void record(LatencyStage stage, uint64_t nanos);
+    const LatencyHistogram &getHistogram(LatencyStage stage) const;
+    void reset();
+
+private:
+    std::string name;
+    LatencyHistogram histograms[ETHOSU_LATENCY_STAGE_COUNT];
+};
+
+/**
+ * Latency profiler
+ *
+ * Latency instrumentation is disabled unless enabled with setEnabled(), or by
+ * setting the ETHOSU_LATENCY_STATS environment variable. While disabled no
+ * timestamps are taken. getProfiles() and dumpJson() cover the profiles of
+ * the devices and networks that are alive.
+ */
+class LatencyProfiler {
+public:
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+
+    static std::shared_ptr<LatencyProfile> createProfile(const std::string &name);
+    static std::vector<std::shared_ptr<LatencyProfile>> getProfiles();
+    static void dumpJson(std::ostream &out);
+    static void reset();
+};
+
+class ArenaPool;
+
 class Device {
 public:
     Device(const char *device = "/dev/ethosu0");
@@ -136,11 +263,24 @@ public:
 
     int ioctl(unsigned long cmd, void *data = nullptr) const;
     Capabilities capabilities() const;
+    ArenaPool &getArenaPool() const;
+    const std::shared_ptr<LatencyProfile> &getLatencyProfile() const;
 
 private:
     int fd;
+    std::unique_ptr<ArenaPool> arenaPool;
+    std::shared_ptr<LatencyProfile> latencyProfile;
 };
 
+/**
+ * Buffer shared with the kernel driver
+ *
+ * The offset and size of the buffer are shadowed in user space, which makes
+ * data(), offset() and size() free of system calls. The shadow is updated by
+ * resize() and clear(). If the kernel driver may have changed the buffer, for
+ * example an OFM buffer after the inference has completed, then refresh()
+ * must be called to resynchronize the shadow.
+ */
 class Buffer {
 public:
     Buffer(const Device &device, const size_t capacity);
@@ -152,16 +292,85 @@ public:
     void resize(size_t size, size_t offset = 0) const;
     size_t offset() const;
     size_t size() const;
+    void refresh() const;
 
     int getFd() const;
 
 private:
+    friend class Inference;
+
+    int tryResize(size_t size, size_t offset = 0) const;
+
     int fd;
     char *dataPtr;
     const size_t dataCapacity;
+    mutable size_t dataOffset;
+    mutable size_t dataSize;
+};
+
+/**
+ * Arena pool
+ *
+ * Hands out tensor arena buffers allocated from a device and recycles them
+ * when the last reference to an arena is dropped. An arena is reused if its
+ * capacity is large enough for the requested size, picking the smallest one
+ * that fits. At most maxCached idle arenas are kept, any arena released
+ * beyond that is freed. An arena that is discarded is freed instead of
+ * recycled, as the NPU may still be writing to it.
+ *
+ * @hits:                      Requests served from an idle arena
+ * @misses:                    Requests that allocated a new arena
+ * @inUse:                     Arenas currently handed out
+ * @cached:                    Idle arenas kept for reuse
+ * @highWaterMark:             Maximum number of arenas allocated at once
+ */
+class ArenaPool {
+public:
+    struct Statistics {
+        size_t hits;
+        size_t misses;
+        size_t inUse;
+        size_t cached;
+        size_t highWaterMark;
+    };
+
+    ArenaPool(const Device &device, size_t maxCached = DEFAULT_ARENA_POOL_SIZE);
+    virtual ~ArenaPool() noexcept(false);
+
+    std::shared_ptr<Buffer> acquire(size_t size);
+    void setMaxCached(size_t maxCached);
+    size_t getMaxCached() const;
+    Statistics getStatistics() const;
+    void trim();
+    void discard(const std::shared_ptr<Buffer> &arena);
+
+private:
+    struct State;
+
+    struct Releaser {
+        void operator()(Buffer *buffer) const;
+
+        std::weak_ptr<State> state;
+        bool recycle;
+    };
+
+    const Device &device;
+    std::shared_ptr<State> state;
+};
+
+/**
+ * Batch item
+ * @ifm:                       IFM buffers
+ * @ofm:                       OFM buffers
+ */
+struct BatchItem {
+    std::vector<std::shared_ptr<Buffer>> ifm;
+    std::vector<std::shared_ptr<Buffer>> ofm;
 };
 
-class Network {
+class InferenceBatch;
+
+class Network : public std::enable_shared_from_this<Network> {
 public:
     Network(const Device &device, std::shared_ptr<Buffer> &buffer);
     Network(const Device &device, const unsigned index);
@@ -184,8 +393,17 @@ public:
     const std::vector<int> &getOfmTypes() const;
     const Device &getDevice() const;
     bool isVelaModel() const;
+    size_t getArenaSize() const;
+    void setArenaSize(size_t size);
+    const std::shared_ptr<LatencyProfile> &getLatencyProfile() const;
+
+    InferenceBatch submitBatch(const std::vector<BatchItem> &items,
+                               const std::vector<uint32_t> &counters = std::vector<uint32_t>(),
+                               bool enableCycleCounter                = false);
 
 private:
+    friend class Inference;
+
     void collectNetworkInfo();
 
     int fd;
@@ -200,6 +418,9 @@ private:
     std::vector<int> ofmTypes;
     const Device &device;
     bool _isVelaModel;
+    size_t arenaSize;
+    bool batchSupported;
+    std::shared_ptr<LatencyProfile> latencyProfile;
 };
 
 enum class InferenceStatus {
@@ -213,6 +434,132 @@ enum class InferenceStatus {
 
 std::ostream &operator<<(std::ostream &out, const InferenceStatus &v);
 
+/**
+ * Inference result
+ * @status:                    Inference status
+ * @pmuEvents:                 Configured PMU events, zero if not configured
+ * @pmuCounters:               PMU counter values, zero for unconfigured events
+ * @cycleCounter:              Cycle counter value
+ */
+class InferenceResult {
+public:
+    InferenceResult(InferenceStatus _status = InferenceStatus::RUNNING) :
+        status(_status), pmuEvents(ETHOSU_PMU_EVENT_MAX, 0), pmuCounters(ETHOSU_PMU_EVENT_MAX, 0), cycleCounter(0) {}
+
+    bool isTerminal() const;
+
+    InferenceStatus status;
+    std::vector<uint32_t> pmuEvents;
+    std::vector<uint32_t> pmuCounters;
+    uint64_t cycleCounter;
+};
+
+/**
+ * Expected
+ *
+ * Result of the non-throwing try* calls, holding either a value or the reason
+ * the call failed. A failed call carries the errno of the failing system
+ * call, or zero when the call itself succeeded but the inference did not
+ * complete with OK. The inference status is ERROR for failed system calls.
+ * value() throws if the call failed.
+ */
+template <typename T>
+class Expected {
+public:
+    Expected(const T &_value, InferenceStatus _status = InferenceStatus::OK) :
+        val(_value), err(0), stat(_status), valid(true) {}
+
+    static Expected failure(int error, InferenceStatus status = InferenceStatus::ERROR) {
+        return Expected(Failure(), error, status);
+    }
+
+    bool ok() const {
+        return valid;
+    }
+
+    explicit operator bool() const {
+        return valid;
+    }
+
+    int error() const {
+        return err;
+    }
+
+    InferenceStatus status() const {
+        return stat;
+    }
+
+    const T &value() const {
+        if (!valid) {
+            throw Exception("Expected holds no value");
+        }
+
+        return val;
+    }
+
+private:
+    struct Failure {};
+
+    Expected(Failure, int _error, InferenceStatus _status) : val(), err(_error), stat(_status), valid(false) {}
+
+    T val;
+    int err;
+    InferenceStatus stat;
+    bool valid;
+};
+
+template <>
+class Expected<void> {
+public:
+    Expected(InferenceStatus _status = InferenceStatus::OK) : err(0), stat(_status), valid(true) {}
+
+    static Expected failure(int error, InferenceStatus status = InferenceStatus::ERROR) {
+        Expected expected(status);
+        expected.err   = error;
+        expected.valid = false;
+        return expected;
+    }
+
+    bool ok() const {
+        return valid;
+    }
+
+    explicit operator bool() const {
+        return valid;
+    }
+
+    int error() const {
+        return err;
+    }
+
+    InferenceStatus status() const {
+        return stat;
+    }
+
+private:
+    int err;
+    InferenceStatus stat;
+    bool valid;
+};
+
+/**
+ * Inference
+ *
+ * An inference is bound to a network, its IFM/OFM buffers and a PMU
+ * configuration when it is created. Once it has completed it can be queued
+ * again with resubmit(), which reuses the request prepared at creation
+ * instead of creating a new inference. Resubmitting an inference that has
+ * not completed fails with EBUSY, as the previous run still owns the arena
+ * and the OFM buffers.
+ *
+ * wait() returns true if the timeout expired before the inference completed,
+ * and false once it has completed. A negative timeout waits until completion
+ * and therefore always returns false.
+ *
+ * The try* functions are the non-throwing counterparts of the submit, wait,
+ * status and cancel calls. They report failures through Expected, which keeps
+ * overload situations such as rejected inferences off the exception path.
+ */
 class Inference {
 public:
     template <typename T>
@@ -227,9 +574,7 @@ public:
         std::vector<uint32_t> counterConfigs = initializeCounterConfig();
 
         // Init tensor arena buffer
-        size_t arena_buffer_size = DEFAULT_ARENA_SIZE_OF_MB << 20;
-        arenaBuffer = std::make_shared<Buffer>(network->getDevice(), arena_buffer_size);
-        arenaBuffer->resize(arena_buffer_size);
+        arenaBuffer = network->getDevice().getArenaPool().acquire(network->getArenaSize());
 
         create(counterConfigs, false);
     }
@@ -250,9 +595,7 @@ public:
             throw EthosU::Exception("PMU Counters argument to large.");
 
         // Init tensor arena buffer
-        size_t arena_buffer_size = DEFAULT_ARENA_SIZE_OF_MB << 20;
-        arenaBuffer = std::make_shared<Buffer>(network->getDevice(), arena_buffer_size);
-        arenaBuffer->resize(arena_buffer_size);
+        arenaBuffer = network->getDevice().getArenaPool().acquire(network->getArenaSize());
 
         std::copy(counters.begin(), counters.end(), counterConfigs.begin());
         create(counterConfigs, enableCycleCounter);
@@ -278,29 +621,546 @@ public:
     virtual ~Inference() noexcept(false);
 
     bool wait(int64_t timeoutNanos = -1) const;
+    void resubmit();
     const std::vector<uint32_t> getPmuCounters() const;
     uint64_t getCycleCounter() const;
     bool cancel() const;
+    InferenceResult result() const;
     InferenceStatus status() const;
     int getFd() const;
     const std::shared_ptr<Network> getNetwork() const;
     std::vector<std::shared_ptr<Buffer>> &getIfmBuffers();
     std::vector<std::shared_ptr<Buffer>> &getOfmBuffers();
 
+    static Expected<std::shared_ptr<Inference>>
+    tryCreate(const std::shared_ptr<Network> &network,
+              const std::vector<std::shared_ptr<Buffer>> &ifmBuffers,
+              const std::vector<std::shared_ptr<Buffer>> &ofmBuffers,
+              const std::vector<uint32_t> &counters = std::vector<uint32_t>(),
+              bool enableCycleCounter               = false);
+    static Expected<std::shared_ptr<Inference>> tryCreate(const std::shared_ptr<Network> &network,
+                                                          const std::shared_ptr<Buffer> &arenaBuffer,
+                                                          const std::vector<uint32_t> &counters,
+                                                          bool enableCycleCounter);
+    Expected<bool> tryWait(int64_t timeoutNanos = -1) const;
+    Expected<void> tryResubmit();
+    Expected<bool> tryCancel() const;
+    Expected<InferenceResult> tryResult() const;
+    Expected<InferenceStatus> tryStatus() const;
+
     static uint32_t getMaxPmuEventCounters();
 
+    /*
+     * Wait for several inferences with a single ppoll. waitAny returns as soon
+     * as at least one inference has completed, waitAll when all of them have.
+     * Both return the indices of the completed inferences, which is empty if
+     * the timeout expired before any inference completed.
+     */
+    static std::vector<size_t> waitAny(const std::vector<Inference *> &inferences, int64_t timeoutNanos = -1);
+    static std::vector<size_t> waitAll(const std::vector<Inference *> &inferences, int64_t timeoutNanos = -1);
+
     char* getInputData(int index = 0);
     char* getOutputData(int index = 0);
 
 private:
+    friend class CompletionReactor;
+    friend class Network;
+
+    Inference(const std::shared_ptr<Network> &network);
+
+    void prepare(std::vector<uint32_t> &counterConfigs, bool enableCycleCounter);
     void create(std::vector<uint32_t> &counterConfigs, bool enableCycleCounter);
+    int submit(const std::vector<uint32_t> &counters, bool enableCycleCounter);
     std::vector<uint32_t> initializeCounterConfig();
+    void complete() const;
+    void refreshOfmBuffers() const;
+    void submitted(int64_t startNanos);
+    bool hasCompleted() const;
 
     int fd;
     const std::shared_ptr<Network> network;
     std::vector<std::shared_ptr<Buffer>> ifmBuffers;
     std::vector<std::shared_ptr<Buffer>> ofmBuffers;
     std::shared_ptr<Buffer> arenaBuffer;
+    std::shared_ptr<ethosu_uapi_inference_create> request;
+    bool resubmitSupported = true;
+    // Guards the cached result and the submission timestamps, which the reactor thread updates as well
+    mutable std::mutex resultLock;
+    mutable InferenceResult cachedResult;
+    mutable int64_t submitStartNanos = 0;
+    mutable int64_t submitEndNanos   = 0;
+};
+
+/**
+ * Inference batch
+ *
+ * Inferences submitted together with Network::submitBatch(). An item that
+ * could not be submitted has no inference and reports the ERROR status.
+ */
+class InferenceBatch {
+public:
+    InferenceBatch(const std::vector<std::shared_ptr<Inference>> &inferences);
+
+    size_t size() const;
+    bool isSubmitted(size_t index) const;
+    std::shared_ptr<Inference> at(size_t index) const;
+    std::vector<size_t> wait(int64_t timeoutNanos = -1) const;
+    std::vector<InferenceStatus> status() const;
+
+private:
+    std::vector<std::shared_ptr<Inference>> inferences;
+};
+
+/**
+ * Completion reactor
+ *
+ * Waits for any number of inferences with a single epoll instance and calls
+ * the callback registered for each inference when it completes. The callback
+ * receives the status, the PMU counters and the cycle counter of the
+ * inference.
+ *
+ * With a background thread the callbacks are called from that thread. Without
+ * it the application drives the reactor by calling poll(), for example when
+ * getFd() becomes readable in its own event loop. Tasks handed to post() are
+ * run the same way, after the completions of the same poll.
+ *
+ * Each registered callback is called exactly once. If the result cannot be
+ * fetched, or the reactor thread can no longer wait for completions, the
+ * callback receives ERROR. Inferences still registered when the reactor is
+ * destroyed are delivered from the destructor, with ERROR unless they have
+ * completed.
+ *
+ * An inference must not be resubmitted while it is registered with a reactor.
+ */
+class CompletionReactor {
+public:
+    typedef std::function<
+        void(Inference &inference, InferenceStatus status, const std::vector<uint32_t> &pmuCounters, uint64_t cycles)>
+        Callback;
+
+    CompletionReactor(bool background = true);
+    virtual ~CompletionReactor() noexcept(false);
+
+    void submit(const std::shared_ptr<Inference> &inference, Callback callback);
+    void post(std::function<void()> task);
+    size_t poll(int64_t timeoutNanos = 0);
+    size_t getInFlight() const;
+    int getFd() const;
+
+private:
+    struct Entry {
+        std::shared_ptr<Inference> inference;
+        Callback callback;
+    };
+
+    size_t dispatch(int timeoutMillis);
+    void deliver(Entry &entry, bool fetch);
+    void runTasks(std::deque<std::function<void()>> &tasks);
+    void run();
+
+    int epollFd;
+    int wakeFd;
+    bool background;
+    bool stopping;
+    mutable std::mutex lock;
+    std::map<int, Entry> entries;
+    std::deque<std::function<void()>> posted;
+    std::thread thread;
+};
+
+/**
+ * Inference priority
+ * @CRITICAL:                  Safety critical jobs
+ * @HIGH:                      Interactive jobs
+ * @NORMAL:                    Default priority
+ * @LOW:                       Background jobs
+ */
+enum class InferencePriority {
+    CRITICAL,
+    HIGH,
+    NORMAL,
+    LOW,
+};
+
+#define ETHOSU_PRIORITY_COUNT 4
+
+std::ostream &operator<<(std::ostream &out, const InferencePriority &priority);
+
+/**
+ * Inference scheduler
+ *
+ * Holds at most maxInFlight inferences on the device and queues further jobs
+ * in user space. Whenever there is room on the device the next job is taken
+ * from the most urgent priority class with queued jobs, earliest deadline
+ * first within the class. Jobs without a deadline come after all jobs with
+ * one, in submission order.
+ *
+ * A job that has waited for the aging period in its class is promoted to the
+ * next more urgent class, where it goes ahead of the jobs submitted to that
+ * class, so that a steady stream of urgent jobs can delay but never starve
+ * less urgent ones. An aging period of zero disables promotion.
+ * With maxQueued set to zero the queue is unbounded.
+ *
+ * The inference of a job is created by its factory only when the job is
+ * dispatched, so that no inference is queued in the kernel ahead of more
+ * urgent ones. Completion is observed by a CompletionReactor, and the callback
+ * of the job is called from the reactor thread with the inference and its
+ * final status, also when the job could not be started, but never from
+ * within submit(). The inference is null if the factory failed, the status
+ * is then ERROR, or if the job was still queued when the scheduler was
+ * destroyed, the status is then ABORTED and the callback is called from the
+ * destructor.
+ *
+ * Statistics are kept per priority class the jobs were submitted with.
+ *
+ * @queued:                    Jobs currently waiting to be dispatched
+ * @maxQueued:                 Highest number of waiting jobs
+ * @submitted:                 Jobs accepted by submit()
+ * @rejected:                  Jobs rejected because the queue was full
+ * @dispatched:                Jobs handed to their factory
+ * @completed:                 Jobs completed with status OK
+ * @failed:                    Jobs completed with any other status
+ * @deadlineMisses:            Jobs completed after their deadline
+ * @promotions:                Times a job was promoted by aging
+ * @waitMeanNanos:             Mean time from submit to dispatch
+ * @waitP99Nanos:              99th percentile of the time to dispatch
+ * @waitMaxNanos:              Longest time to dispatch
+ * @latencyP99Nanos:           99th percentile of the time from submit to
+ *                             completion
+ */
+class InferenceScheduler {
+public:
+    typedef std::function<std::shared_ptr<Inference>()> Factory;
+    typedef std::function<void(const std::shared_ptr<Inference> &inference, InferenceStatus status)> Callback;
+
+    struct ClassStatistics {
+        InferencePriority priority;
+        size_t queued;
+        size_t maxQueued;
+        size_t submitted;
+        size_t rejected;
+        size_t dispatched;
+        size_t completed;
+        size_t failed;
+        size_t deadlineMisses;
+        size_t promotions;
+        double waitMeanNanos;
+        uint64_t waitP99Nanos;
+        uint64_t waitMaxNanos;
+        uint64_t latencyP99Nanos;
+    };
+
+    InferenceScheduler(size_t maxInFlight = 2, int64_t agingNanos = 100000000, size_t maxQueued = 1024);
+    virtual ~InferenceScheduler() noexcept(false);
+
+    Expected<void> submit(InferencePriority priority, int64_t deadlineNanos, Factory factory, Callback callback);
+    bool waitIdle(int64_t timeoutNanos = -1);
+
+    size_t getInFlight() const;
+    size_t getQueued() const;
+    std::vector<ClassStatistics> getStatistics() const;
+
+private:
+    struct Job {
+        uint64_t sequence;
+        InferencePriority priority;
+        int64_t submitted;
+        int64_t promoted;
+        int64_t deadline;
+        Factory factory;
+        Callback callback;
+    };
+
+    struct Class {
+        Class();
+
+        std::deque<Job> queue;
+        size_t waiting;
+        size_t maxQueued;
+        size_t submitted;
+        size_t rejected;
+        size_t dispatched;
+        size_t completed;
+        size_t failed;
+        size_t deadlineMisses;
+        size_t promotions;
+        LatencyHistogram wait;
+        LatencyHistogram latency;
+    };
+
+    void dispatch();
+    bool next(Job &job);
+    void fail(const Job &job, const std::shared_ptr<Inference> &inference);
+    void finish(const Job &job, const std::shared_ptr<Inference> &inference, InferenceStatus status);
+
+    const size_t maxInFlight;
+    const int64_t agingNanos;
+    const size_t maxQueued;
+
+    mutable std::mutex lock;
+    std::condition_variable idle;
+    Class classes[ETHOSU_PRIORITY_COUNT];
+    size_t queued;
+    size_t inFlight;
+    uint64_t sequence;
+    bool stopping;
+
+    // Declared last, so that the reactor thread is joined before the queues are destroyed
+    std::unique_ptr<CompletionReactor> reactor;
+};
+
+/**
+ * Watchdog
+ *
+ * Cancels inferences that are still running when their deadline expires.
+ * Deadlines are kept on a hashed timer wheel that a background thread
+ * advances once per tick, so watching and unwatching an inference is cheap
+ * regardless of how many are in flight. The thread only runs while there is
+ * something to watch.
+ *
+ * An expired inference is cancelled with ETHOSU_IOCTL_INFERENCE_CANCEL, and
+ * the watchdog then follows it from ABORTING until it completes. The time
+ * from issuing the cancel until the inference has completed is recorded as
+ * the cancel latency. The callback, if any, is called from the watchdog
+ * thread with the final status, or with ABORTING if the inference did not
+ * complete within the abort timeout. The thread sleeps until the next
+ * deadline is due, and while an inference is aborting it polls it once per
+ * tick.
+ *
+ * The watchdog holds weak references, an inference that is destroyed is no
+ * longer watched. An inference that is resubmitted must be watched again.
+ * Unwatching an inference that is being aborted settles the abort right
+ * away, and the callback is then called from the unwatching thread.
+ * Watching it again drops the abort of the previous run unreported, as its
+ * outcome can no longer be read once the inference has been resubmitted.
+ *
+ * @watched:                   Calls to watch()
+ * @expired:                   Inferences still running at their deadline
+ * @aborted:                   Cancelled inferences that reached ABORTED
+ * @failed:                    Inferences that could not be cancelled, or did
+ *                             not complete within the abort timeout
+ * @pending:                   Inferences currently watched
+ * @aborting:                  Cancelled inferences not yet completed
+ * @cancelMeanNanos:           Mean cancel latency
+ * @cancelP99Nanos:            99th percentile of the cancel latency
+ * @cancelMaxNanos:            Longest cancel latency
+ */
+class Watchdog {
+public:
+    typedef std::function<void(const std::shared_ptr<Inference> &inference, InferenceStatus status)> Callback;
+
+    struct Statistics {
+        size_t watched;
+        size_t expired;
+        size_t aborted;
+        size_t failed;
+        size_t pending;
+        size_t aborting;
+        double cancelMeanNanos;
+        uint64_t cancelP99Nanos;
+        uint64_t cancelMaxNanos;
+    };
+
+    Watchdog(int64_t tickNanos = 1000000, size_t wheelSize = 1024, int64_t abortTimeoutNanos = 1000000000);
+    virtual ~Watchdog() noexcept(false);
+
+    static Watchdog &instance();
+
+    void watch(const std::shared_ptr<Inference> &inference, int64_t timeoutNanos, Callback callback = nullptr);
+    void unwatch(const Inference &inference);
+    int64_t getAbortTimeout() const;
+    Statistics getStatistics() const;
+
+private:
+    struct Timer {
+        uint64_t id;
+        uint64_t tick;
+        const Inference *key;
+        std::weak_ptr<Inference> inference;
+        Callback callback;
+    };
+
+    struct Abort {
+        int64_t start;
+        const Inference *key;
+        std::weak_ptr<Inference> inference;
+        Callback callback;
+    };
+
+    struct Settled {
+        std::shared_ptr<Inference> inference;
+        Callback callback;
+        InferenceStatus status;
+    };
+
+    void run();
+    uint64_t currentTick(int64_t now) const;
+    int64_t nextWakeup(int64_t now) const;
+    void expire(Timer &timer, std::vector<Settled> &settled);
+    void follow(int64_t now, std::vector<Settled> &settled);
+    void settle(const Inference *key, bool resubmitted, std::vector<Settled> &settled);
+    static void notify(std::vector<Settled> &settled);
+
+    const int64_t tickNanos;
+    const int64_t abortTimeoutNanos;
+    const int64_t epoch;
+
+    mutable std::mutex lock;
+    std::condition_variable wakeup;
+    std::vector<std::list<Timer>> wheel;
+    std::map<const Inference *, std::list<Timer>::iterator> active;
+    std::list<Abort> aborting;
+    uint64_t nextId;
+    uint64_t tick;
+    int64_t nextWake;
+    size_t watched;
+    size_t expired;
+    size_t aborted;
+    size_t failed;
+    LatencyHistogram cancelLatency;
+    bool stopping;
+    std::thread thread;
+};
+
+/**
+ * Device pool
+ *
+ * Opens a set of Ethos-U devices, by default every /dev/ethosu<nr> node, and
+ * loads the same network on each of them. Inferences are dispatched to the
+ * device with the lowest expected completion time, estimated from the number
+ * of inferences in flight on the device and a moving average of the latency
+ * observed on it.
+ *
+ * Buffers are bound to a device, so inferences are created by a factory that
+ * is given the network of the selected device. The pool should be told when
+ * an inference has completed, either by waiting through wait() or by calling
+ * complete(), which also records its latency. Submissions the pool was not
+ * told about are settled when the next inference is submitted, once they
+ * have completed or have been destroyed.
+ *
+ * @path:                      Device node
+ * @inFlight:                  Inferences submitted but not yet completed
+ * @completed:                 Inferences completed
+ * @averageLatencyNanos:       Moving average of the inference latency
+ */
+class DevicePool {
+public:
+    typedef std::function<std::shared_ptr<Inference>(const std::shared_ptr<Network> &network)> Factory;
+
+    struct DeviceStatistics {
+        std::string path;
+        size_t inFlight;
+        size_t completed;
+        uint64_t averageLatencyNanos;
+    };
+
+    DevicePool();
+    DevicePool(const std::vector<std::string> &devices);
+    virtual ~DevicePool() noexcept(false);
+
+    static std::vector<std::string> discover(const std::string &directory = "/dev");
+
+    void loadNetwork(const std::string &model);
+    void loadNetwork(const unsigned index);
+
+    size_t size() const;
+    const Device &getDevice(size_t index) const;
+    std::shared_ptr<Network> getNetwork(size_t index) const;
+
+    std::shared_ptr<Inference> submit(const Factory &factory);
+    bool wait(const std::shared_ptr<Inference> &inference, int64_t timeoutNanos = -1);
+    void complete(const std::shared_ptr<Inference> &inference);
+    std::vector<DeviceStatistics> getStatistics() const;
+
+private:
+    struct Slot {
+        std::string path;
+        std::unique_ptr<Device> device;
+        std::shared_ptr<Network> network;
+        size_t inFlight;
+        size_t completed;
+        uint64_t averageLatencyNanos;
+    };
+
+    struct Submission {
+        size_t index;
+        int64_t start;
+    };
+
+    size_t select() const;
+    void sweep();
+
+    mutable std::mutex lock;
+    std::vector<Slot> slots;
+    std::map<std::weak_ptr<Inference>, Submission, std::owner_less<std::weak_ptr<Inference>>> submissions;
+};
+
+/**
+ * Network cache
+ *
+ * Process wide cache of networks created from model files. Models are keyed
+ * by device and content hash, so loading the same model again, also through
+ * another path, returns the network that already exists. A file that has
+ * already been hashed is recognized by path, modification time and size
+ * without reading it again.
+ *
+ * The cache keeps the least recently used networks as long as the total size
+ * of their model buffers fits in the budget. Evicting a network only drops
+ * the reference held by the cache.
+ *
+ * Devices are shared through the cache as well, so that networks loaded for
+ * the same device node can be reused. A cached network keeps its device open.
+ *
+ * @hits:                      Requests served by a cached network
+ * @misses:                    Requests that created a new network
+ * @evictions:                 Networks evicted to stay within the budget
+ * @entries:                   Networks currently cached
+ * @bytes:                     Total size of the cached model buffers
+ */
+class NetworkCache {
+public:
+    struct Statistics {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t entries;
+        size_t bytes;
+    };
+
+    static NetworkCache &instance();
+
+    std::shared_ptr<Device> getDevice(const std::string &device);
+    std::shared_ptr<Network> getNetwork(const std::string &device, const std::string &model);
+
+    void setBudget(size_t bytes);
+    size_t getBudget() const;
+    Statistics getStatistics() const;
+    void clear();
+
+private:
+    struct Entry {
+        std::string key;
+        size_t size;
+        std::shared_ptr<Network> network;
+    };
+
+    NetworkCache();
+    NetworkCache(const NetworkCache &) = delete;
+    NetworkCache &operator=(const NetworkCache &) = delete;
+
+    std::shared_ptr<Network> lookup(const std::string &key);
+    void evict(std::vector<std::shared_ptr<Network>> &evicted);
+
+    mutable std::mutex lock;
+    std::map<std::string, std::weak_ptr<Device>> devices;
+    std::list<Entry> entries;
+    std::map<std::string, std::list<Entry>::iterator> index;
+    std::map<std::string, std::string> files;
+    size_t budget;
+    size_t bytes;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
 };
 
 struct TensorInfo{
@@ -326,43 +1186,286 @@ enum TensorType{
 
 };
 
+/**
+ * Interpreter arena allocation
+ * @EAGER:                     Allocate the arenas in the constructor
+ * @LAZY:                      Allocate the arena of a slot when it is first used
+ * @BACKGROUND:                Allocate the arenas on a background thread, the
+ *                             first use of an arena waits for it
+ */
+enum class ArenaAllocation { EAGER, LAZY, BACKGROUND };
+
+/**
+ * Interpreter options
+ * @printCapabilities:         Query and print the device capabilities
+ * @parallelLoad:              Read the model and create the network on a
+ *                             background thread while the device is set up
+ * @arenaAllocation:           When the arenas are allocated
+ *
+ * The defaults match the original interpreter. fastStart() returns the options
+ * that minimize the time spent in the constructor.
+ */
+struct InterpreterOptions {
+    InterpreterOptions() :
+        printCapabilities(true), parallelLoad(false), arenaAllocation(ArenaAllocation::EAGER) {}
+
+    static InterpreterOptions fastStart();
+
+    bool printCapabilities;
+    bool parallelLoad;
+    ArenaAllocation arenaAllocation;
+};
+
+/**
+ * Interpreter startup timing, in nanoseconds
+ * @device:                    Opening the device
+ * @capabilities:              Querying and printing the capabilities
+ * @network:                   Reading the model and creating the network
+ * @arena:                     Allocating arenas, also when done later
+ * @constructor:               Total time spent in the constructor
+ */
+struct InterpreterStartup {
+    int64_t device;
+    int64_t capabilities;
+    int64_t network;
+    int64_t arena;
+    int64_t constructor;
+};
+
+std::ostream &operator<<(std::ostream &out, const InterpreterStartup &startup);
+
+/**
+ * Interpreter
+ *
+ * Invoke() runs the network synchronously on the arena of slot 0, which is
+ * what typed_input_buffer() and typed_output_buffer() refer to without a slot
+ * argument.
+ *
+ * In pipelined mode SetPipelineDepth() gives the interpreter several arena
+ * slots that rotate through the fill, run and drain stages, so the input of
+ * the next frame can be prepared while the NPU runs the current one:
+ *
+ *   slot = BeginFill()    Take a free slot and write its input tensors
+ *   Submit(slot)          Queue the slot on the NPU
+ *   slot = Collect()      Wait for the oldest submitted slot
+ *   Release(slot)         Return the slot once its outputs have been read
+ *
+ * GetPmuCounters() and GetCycleCounter() report the most recently completed
+ * inference.
+ */
 class Interpreter {
 public:
     Interpreter(const char *model, const char *device = "/dev/ethosu0",
                 int64_t arenaSizeOfMB = DEFAULT_ARENA_SIZE_OF_MB);
+    Interpreter(const char *model, const char *device, int64_t arenaSizeOfMB, const InterpreterOptions &options);
     Interpreter(const std::string &model) : Interpreter(model.c_str()) {}
 
+    InterpreterStartup GetStartupTiming();
+
     void SetPmuCycleCounters(std::vector<uint8_t> counters, bool enableCycleCounter = true);
     std::vector<uint32_t> GetPmuCounters();
     uint64_t GetCycleCounter();
 
     void Invoke(int64_t timeoutNanos = 60000000000);
+    Expected<void> TryInvoke(int64_t timeoutNanos = 60000000000);
+
+    void SetPipelineDepth(size_t depth);
+    size_t GetPipelineDepth() const;
+    size_t BeginFill();
+    void Submit(size_t slot);
+    size_t Collect(int64_t timeoutNanos = 60000000000);
+    void Release(size_t slot);
 
     template <typename T>
-    T* typed_input_buffer(int index) {
+    T* typed_input_buffer(int index, size_t slot = 0) {
         int32_t offset = network->getInputDataOffset(index);
-        return (T*)(arenaBuffer->data() + offset);
+        return (T*)(arena(slot).data() + offset);
     }
 
     template <typename T>
-    T* typed_output_buffer(int index) {
+    T* typed_output_buffer(int index, size_t slot = 0) {
         int32_t offset = network->getOutputDataOffset(index);
-        return (T*)(arenaBuffer->data() + offset);
+        return (T*)(arena(slot).data() + offset);
     }
 
     std::vector<TensorInfo> GetInputInfo();
     std::vector<TensorInfo> GetOutputInfo();
 
 private:
-    Device device;
-    std::shared_ptr<Buffer> networkBuffer;
-    std::shared_ptr<Buffer> arenaBuffer;
+    friend class PmuProfiler;
+
+    enum class SlotState { FREE, FILLING, RUNNING, DRAINING };
+
+    struct Slot {
+        std::shared_ptr<Buffer> arena;
+        std::shared_ptr<Inference> inference;
+        SlotState state;
+        bool pmuConfigChanged;
+    };
+
+    Expected<void> start(size_t slot);
+    Buffer &arena(size_t slot);
+    void waitForArenas();
+
+    std::shared_ptr<Device> device;
     std::shared_ptr<Network> network;
     std::shared_ptr<Inference> inference;
+    std::vector<Slot> slots;
+    std::deque<size_t> running;
 
     int64_t arenaSizeOfMB;
     std::vector<uint8_t> pmuCounters;
     bool enableCycleCounter;
+    InterpreterOptions options;
+    InterpreterStartup startup;
+
+    // Declared last, so that a background allocation is joined before the slots are destroyed
+    std::future<void> arenasReady;
 };
 
+/**
+ * Interpreter pool
+ *
+ * Loads a network once and hands out execution contexts to worker threads.
+ * Each context has its own arena and inference, so several contexts can be
+ * invoked concurrently while sharing the network and its model buffer. A
+ * context must only be used by one thread at a time.
+ *
+ * Checkout() waits until a context is free. A context goes back to the pool
+ * with Checkin(), or when the last reference to it is dropped.
+ */
+class InterpreterPool {
+public:
+    class Context {
+    public:
+        void SetPmuCycleCounters(std::vector<uint8_t> counters, bool enableCycleCounter = true);
+        std::vector<uint32_t> GetPmuCounters();
+        uint64_t GetCycleCounter();
+
+        void Invoke(int64_t timeoutNanos = 60000000000);
+        Expected<void> TryInvoke(int64_t timeoutNanos = 60000000000);
+
+        template <typename T>
+        T *typed_input_buffer(int index) {
+            int32_t offset = network->getInputDataOffset(index);
+            return (T *)(arena->data() + offset);
+        }
+
+        template <typename T>
+        T *typed_output_buffer(int index) {
+            int32_t offset = network->getOutputDataOffset(index);
+            return (T *)(arena->data() + offset);
+        }
+
+    private:
+        friend class InterpreterPool;
+
+        Context(const std::shared_ptr<Device> &device,
+                const std::shared_ptr<Network> &network,
+                const std::shared_ptr<Buffer> &arena);
+
+        std::shared_ptr<Device> device;
+        std::shared_ptr<Network> network;
+        std::shared_ptr<Buffer> arena;
+        std::shared_ptr<Inference> inference;
+        std::vector<uint8_t> pmuCounters;
+        bool enableCycleCounter;
+        bool pmuConfigChanged;
+    };
+
+    InterpreterPool(const char *model,
+                    size_t size,
+                    const char *device    = "/dev/ethosu0",
+                    int64_t arenaSizeOfMB = DEFAULT_ARENA_SIZE_OF_MB);
+    virtual ~InterpreterPool() noexcept(false);
+
+    std::shared_ptr<Context> Checkout(int64_t timeoutNanos = -1);
+    void Checkin(std::shared_ptr<Context> &context);
+    size_t GetSize() const;
+    size_t GetAvailable() const;
+
+    std::vector<TensorInfo> GetInputInfo();
+    std::vector<TensorInfo> GetOutputInfo();
+
+private:
+    struct State;
+
+    static void release(const std::weak_ptr<State> &state, Context *context);
+
+    std::shared_ptr<Device> device;
+    std::shared_ptr<Network> network;
+    size_t size;
+    std::shared_ptr<State> state;
+};
+
+/**
+ * PMU profiler
+ *
+ * The NPU counts at most ETHOSU_PMU_EVENT_MAX events per inference. The
+ * profiler splits any number of events into groups of that size, and runs
+ * the same inference once per group and repeat with the cycle counter
+ * enabled. The groups are rotated within every repeat. Each count is divided
+ * by the cycle count of its own run, which makes counts from different runs
+ * comparable in a single report.
+ *
+ * @event:                     PMU event
+ * @runs:                      Runs that counted the event
+ * @mean:                      Mean count per run
+ * @perCycle:                  Mean count per NPU cycle
+ * @normalized:                Count per cycle scaled to the mean cycle count
+ *                             of all runs
+ */
+class PmuProfiler {
+public:
+    struct EventStatistics {
+        uint32_t event;
+        size_t runs;
+        double mean;
+        double perCycle;
+        double normalized;
+    };
+
+    struct Report {
+        size_t groups;
+        size_t repeats;
+        size_t runs;
+        double meanCycles;
+        uint64_t minCycles;
+        uint64_t maxCycles;
+        std::vector<EventStatistics> events;
+    };
+
+    typedef std::function<InferenceResult(const std::vector<uint32_t> &events)> Runner;
+
+    PmuProfiler(const std::vector<uint32_t> &events, size_t repeats = 1);
+
+    static std::vector<uint32_t> parseEvents(const std::string &list);
+
+    size_t getRunCount() const;
+    std::vector<uint32_t> getRunEvents(size_t run) const;
+    void record(size_t run, const std::vector<uint32_t> &counters, uint64_t cycles);
+    Report getReport() const;
+
+    Report run(const Runner &runner);
+    Report run(Interpreter &interpreter, int64_t timeoutNanos = 60000000000);
+
+private:
+    struct Sample {
+        size_t runs;
+        uint64_t sum;
+        double perCycleSum;
+        size_t perCycleRuns;
+    };
+
+    std::vector<uint32_t> events;
+    size_t repeats;
+    std::vector<Sample> samples;
+    size_t runs;
+    uint64_t cycleSum;
+    uint64_t minCycles;
+    uint64_t maxCycles;
+};
+
+std::ostream &operator<<(std::ostream &out, const PmuProfiler::Report &report);
+
 } // namespace EthosU
@@ -20,50 +20,255 @@
 #include <uapi/ethosu.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <type_traits>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 using namespace std;
 
+#ifndef ETHOSU_LOG_MIN_LEVEL
+#define ETHOSU_LOG_MIN_LEVEL Debug
+#endif
+
 namespace {
 
-enum class Severity { Error, Warning, Info, Debug };
+using Severity = EthosU::LogLevel;
 
-class Log {
+/*
+ * Log records are encoded on the calling thread into a per-thread single
+ * producer, single consumer ring, and formatted and written to stdout by a
+ * background thread. Arguments are stored as tagged binary values together
+ * with the base, width and fill set by preceding manipulators, so a log
+ * statement costs a few copies rather than a formatted stream write. Types
+ * without a binary encoding are formatted to a string on the calling thread.
+ *
+ * A record that does not fit in the ring of its thread is dropped and counted
+ * instead of blocking the caller. Error records are written before the log
+ * statement returns.
+ *
+ * The background thread is started by the first record and sleeps on a
+ * condition variable while the rings are empty. It is joined by an exit
+ * handler, which also runs when the library is unloaded, after which records
+ * are written synchronously. Across fork() the rings are drained in the
+ * parent, and the child starts a new thread when it first logs.
+ */
+class Logger {
 public:
-    Log(const Severity _severity = Severity::Error) : severity(_severity) {}
+    enum Tag : uint8_t { String, Signed, Unsigned, Float, Pointer, Char, Bool, Newline };
 
-    ~Log() = default;
+    static Logger &instance() {
+        // Never destroyed, log statements may run during static destruction
+        static Logger *logger = new Logger();
+        return *logger;
+    }
 
-    template <typename T>
-    const Log &operator<<(const T &d) const {
-        if (level >= severity) {
-            cout << d;
-        }
+    static Severity getLevel() {
+        return static_cast<Severity>(level().load(memory_order_relaxed));
+    }
 
-        return *this;
+    static void setLevel(Severity severity) {
+        level().store(static_cast<int>(severity), memory_order_relaxed);
     }
 
-    const Log &operator<<(ostream &(*manip)(ostream &)) const {
-        if (level >= severity) {
-            manip(cout);
+    void commit(Severity severity, const char *data, size_t size) {
+        Ring &ring = threadRing();
+
+        Header header;
+        header.size     = sizeof(header) + size;
+        header.sequence = sequence.fetch_add(1, memory_order_relaxed);
+        header.severity = static_cast<uint8_t>(severity);
+
+        size_t head = ring.head.load(memory_order_relaxed);
+        size_t tail = ring.tail.load(memory_order_acquire);
+
+        if (Ring::capacity - (head - tail) < header.size) {
+            ring.dropped.fetch_add(1, memory_order_relaxed);
+        } else {
+            ring.write(head, reinterpret_cast<const char *>(&header), sizeof(header));
+            ring.write(head + sizeof(header), data, size);
+            ring.head.store(head + header.size, memory_order_release);
         }
 
-        return *this;
+        if (severity == Severity::Error || (!started.load(memory_order_acquire) && !start())) {
+            flush();
+            return;
+        }
+
+        // Pairs with the fence in run(), either the thread sees the record or it is woken
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping.load(memory_order_relaxed)) {
+            lock_guard<mutex> guard(wakeLock);
+            wakeup->notify_one();
+        }
+    }
+
+    void flush() {
+        lock_guard<mutex> guard(drainLock);
+        drain();
     }
 
 private:
-    static Severity getLogLevel() {
+    struct Header {
+        uint32_t size;
+        uint32_t severity;
+        uint64_t sequence;
+    };
+
+    struct Ring {
+        static const size_t capacity = 64 * 1024;
+
+        Ring() : buffer(capacity), head(0), tail(0), dropped(0), abandoned(false) {}
+
+        void write(size_t position, const char *data, size_t size) {
+            size_t offset = position % capacity;
+            size_t first  = min(size, capacity - offset);
+
+            memcpy(&buffer[offset], data, first);
+            memcpy(&buffer[0], data + first, size - first);
+        }
+
+        void read(size_t position, char *data, size_t size) const {
+            size_t offset = position % capacity;
+            size_t first  = min(size, capacity - offset);
+
+            memcpy(data, &buffer[offset], first);
+            memcpy(data + first, &buffer[0], size - first);
+        }
+
+        vector<char> buffer;
+        atomic<size_t> head;
+        atomic<size_t> tail;
+        atomic<uint64_t> dropped;
+        atomic<bool> abandoned;
+    };
+
+    struct Record {
+        uint64_t sequence;
+        string payload;
+
+        bool operator<(const Record &other) const {
+            return sequence < other.sequence;
+        }
+    };
+
+    // Marks the ring of a thread as abandoned when the thread exits
+    struct RingHandle {
+        shared_ptr<Ring> ring;
+
+        ~RingHandle() {
+            if (ring) {
+                ring->abandoned.store(true, memory_order_release);
+            }
+        }
+    };
+
+    enum class State { Idle, Running, Stopped };
+
+    Logger() : sequence(0), wakeup(new condition_variable()), started(false), sleeping(false), state(State::Idle) {
+        atexit([]() { Logger::instance().stop(); });
+        pthread_atfork([]() { Logger::instance().prepareFork(); },
+                       []() { Logger::instance().parentFork(); },
+                       []() { Logger::instance().childFork(); });
+    }
+
+    // Returns false if the thread has been stopped and records must be written synchronously
+    bool start() {
+        lock_guard<mutex> guard(wakeLock);
+
+        if (state == State::Idle) {
+            worker.reset(new thread(&Logger::run, this));
+            state = State::Running;
+            started.store(true, memory_order_release);
+        }
+
+        return state == State::Running;
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> guard(wakeLock);
+            state = State::Stopped;
+            started.store(false, memory_order_release);
+            wakeup->notify_one();
+        }
+
+        if (worker && worker->joinable()) {
+            worker->join();
+        }
+
+        flush();
+    }
+
+    void prepareFork() {
+        // Written in the parent, so the child does not write the same records again
+        drainLock.lock();
+        drain();
+        wakeLock.lock();
+        registryLock.lock();
+    }
+
+    void parentFork() {
+        registryLock.unlock();
+        wakeLock.unlock();
+        drainLock.unlock();
+    }
+
+    void childFork() {
+        // Only the forking thread exists in the child, the rings of the other threads are abandoned
+        for (auto &ring : rings) {
+            if (ring != ringHandle().ring) {
+                ring->abandoned.store(true, memory_order_release);
+            }
+        }
+
+        // The thread and condition variable objects refer to the thread of the parent, they are
+        // abandoned rather than joined or destroyed
+        worker.release();
+        wakeup.release();
+        wakeup.reset(new condition_variable());
+        if (state == State::Running) {
+            state = State::Idle;
+            started.store(false, memory_order_release);
+        }
+
+        sleeping.store(false, memory_order_relaxed);
+
+        registryLock.unlock();
+        wakeLock.unlock();
+        drainLock.unlock();
+    }
+
+    static atomic<int> &level() {
+        static atomic<int> value(static_cast<int>(levelFromEnvironment()));
+        return value;
+    }
+
+    static Severity levelFromEnvironment() {
         if (const char *e = getenv("ETHOSU_LOG_LEVEL")) {
             const string env(e);
 
@@ -80,650 +285,4094 @@ private:
             }
         }
 
-        return Severity::Warning;
+        return Severity::Warning;
+    }
+
+    static RingHandle &ringHandle() {
+        static thread_local RingHandle handle;
+        return handle;
+    }
+
+    Ring &threadRing() {
+        RingHandle &handle = ringHandle();
+
+        if (!handle.ring) {
+            handle.ring = make_shared<Ring>();
+
+            lock_guard<mutex> guard(registryLock);
+            rings.push_back(handle.ring);
+        }
+
+        return *handle.ring;
+    }
+
+    void run() {
+        unique_lock<mutex> guard(wakeLock);
+
+        while (state == State::Running) {
+            guard.unlock();
+            flush();
+            guard.lock();
+
+            // Pairs with the fence in commit(), either a new record is seen here or the producer wakes us
+            sleeping.store(true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+
+            if (state == State::Running && !pending()) {
+                wakeup->wait(guard);
+            }
+
+            sleeping.store(false, memory_order_relaxed);
+        }
+    }
+
+    bool pending() {
+        lock_guard<mutex> guard(registryLock);
+
+        for (auto &ring : rings) {
+            if (ring->head.load(memory_order_relaxed) != ring->tail.load(memory_order_relaxed) ||
+                ring->dropped.load(memory_order_relaxed) != 0 || ring->abandoned.load(memory_order_relaxed)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Must be called with drainLock held
+    size_t drain() {
+        vector<shared_ptr<Ring>> snapshot;
+
+        {
+            lock_guard<mutex> guard(registryLock);
+            snapshot = rings;
+        }
+
+        vector<Record> records;
+        uint64_t dropped = 0;
+
+        for (auto &ring : snapshot) {
+            // Read the abandoned flag first, so records written before the thread exited are drained
+            bool abandoned = ring->abandoned.load(memory_order_acquire);
+            size_t tail    = ring->tail.load(memory_order_relaxed);
+            size_t head    = ring->head.load(memory_order_acquire);
+
+            while (tail != head) {
+                Header header;
+                ring->read(tail, reinterpret_cast<char *>(&header), sizeof(header));
+
+                Record record;
+                record.sequence = header.sequence;
+                record.payload.resize(header.size - sizeof(header));
+                ring->read(tail + sizeof(header), &record.payload[0], record.payload.size());
+                records.push_back(std::move(record));
+
+                tail += header.size;
+            }
+
+            ring->tail.store(tail, memory_order_release);
+            dropped += ring->dropped.exchange(0, memory_order_relaxed);
+
+            if (abandoned) {
+                lock_guard<mutex> guard(registryLock);
+                rings.erase(remove(rings.begin(), rings.end(), ring), rings.end());
+            }
+        }
+
+        if (records.empty() && dropped == 0) {
+            return 0;
+        }
+
+        // Records of different threads are written in the order they were logged
+        sort(records.begin(), records.end());
+
+        ostringstream out;
+        for (auto &record : records) {
+            format(out, record.payload);
+        }
+
+        if (dropped > 0) {
+            out << "Log overflow, dropped " << dropped << " records" << endl;
+        }
+
+        cout << out.str();
+        cout.flush();
+
+        return records.size();
+    }
+
+    template <typename T>
+    static T take(const char *&data) {
+        T value;
+        memcpy(&value, data, sizeof(value));
+        data += sizeof(value);
+        return value;
+    }
+
+    static void format(ostream &out, const string &payload) {
+        const char *data = payload.data();
+        const char *end  = data + payload.size();
+
+        while (data < end) {
+            Tag tag = static_cast<Tag>(take<uint8_t>(data));
+
+            if (tag == String) {
+                uint32_t size = take<uint32_t>(data);
+                out.write(data, size);
+                data += size;
+                continue;
+            }
+
+            if (tag == Newline) {
+                out << '\n';
+                continue;
+            }
+
+            // All other values are preceded by the stream format
+            out.flags(static_cast<ios_base::fmtflags>(take<uint32_t>(data)));
+            out.width(take<uint8_t>(data));
+            out.fill(take<char>(data));
+
+            switch (tag) {
+            case Signed:
+                out << take<int64_t>(data);
+                break;
+            case Unsigned:
+                out << take<uint64_t>(data);
+                break;
+            case Float:
+                out << take<double>(data);
+                break;
+            case Pointer:
+                out << reinterpret_cast<const void *>(take<uintptr_t>(data));
+                break;
+            case Char:
+                out << take<char>(data);
+                break;
+            case Bool:
+                out << take<bool>(data);
+                break;
+            default:
+                return;
+            }
+        }
+
+        out.flags(ios_base::dec | ios_base::skipws);
+        out.width(0);
+        out.fill(' ');
+    }
+
+    atomic<uint64_t> sequence;
+    mutex drainLock;
+    mutex registryLock;
+    vector<shared_ptr<Ring>> rings;
+
+    // Lock order is drainLock, wakeLock, registryLock
+    mutex wakeLock;
+    unique_ptr<condition_variable> wakeup;
+    atomic<bool> started;
+    atomic<bool> sleeping;
+    State state;
+    unique_ptr<thread> worker;
+};
+
+class Log {
+public:
+    Log(const Severity _severity = Severity::Error) :
+        severity(_severity), active(enabled(_severity)), start(0), savedFlags(), savedWidth(0), savedPrecision(0),
+        savedFill(' ') {
+        if (active) {
+            string &record = buffer();
+            start          = record.size();
+
+            // A statement logged while the arguments of another are evaluated starts from the default
+            // format, and the format of the enclosing statement is restored when it ends
+            ostringstream &state = formatState();
+            savedFlags           = state.flags();
+            savedWidth           = state.width();
+            savedPrecision       = state.precision();
+            savedFill            = state.fill();
+
+            state.clear();
+            state.flags(ios_base::dec | ios_base::skipws);
+            state.width(0);
+            state.precision(6);
+            state.fill(' ');
+        }
+    }
+
+    ~Log() {
+        if (active) {
+            if (buffer().size() > start) {
+                commit();
+            }
+
+            ostringstream &state = formatState();
+            state.flags(savedFlags);
+            state.width(savedWidth);
+            state.precision(savedPrecision);
+            state.fill(savedFill);
+        }
+    }
+
+    // Statements below the compiled in minimum level are removed by the optimizer
+    static constexpr bool compiled(Severity severity) {
+        return severity <= Severity::ETHOSU_LOG_MIN_LEVEL;
+    }
+
+    static bool enabled(Severity severity) {
+        return compiled(severity) && severity <= Logger::getLevel();
+    }
+
+    const Log &operator<<(const char *d) const {
+        if (active) {
+            appendString(d, strlen(d));
+        }
+
+        return *this;
+    }
+
+    const Log &operator<<(const string &d) const {
+        if (active) {
+            appendString(d.data(), d.size());
+        }
+
+        return *this;
+    }
+
+    const Log &operator<<(char d) const {
+        if (active) {
+            append(Logger::Char, d);
+        }
+
+        return *this;
+    }
+
+    // Like a stream, the character types are written as characters rather than as numbers
+    const Log &operator<<(signed char d) const {
+        if (active) {
+            append(Logger::Char, static_cast<char>(d));
+        }
+
+        return *this;
+    }
+
+    const Log &operator<<(unsigned char d) const {
+        if (active) {
+            append(Logger::Char, static_cast<char>(d));
+        }
+
+        return *this;
+    }
+
+    const Log &operator<<(const signed char *d) const {
+        return *this << reinterpret_cast<const char *>(d);
+    }
+
+    const Log &operator<<(const unsigned char *d) const {
+        return *this << reinterpret_cast<const char *>(d);
+    }
+
+    const Log &operator<<(bool d) const {
+        if (active) {
+            append(Logger::Bool, d);
+        }
+
+        return *this;
+    }
+
+    template <typename T>
+    typename enable_if<is_integral<T>::value && is_signed<T>::value, const Log &>::type
+    operator<<(const T &d) const {
+        if (active) {
+            append(Logger::Signed, static_cast<int64_t>(d));
+        }
+
+        return *this;
+    }
+
+    template <typename T>
+    typename enable_if<is_integral<T>::value && !is_signed<T>::value, const Log &>::type
+    operator<<(const T &d) const {
+        if (active) {
+            append(Logger::Unsigned, static_cast<uint64_t>(d));
+        }
+
+        return *this;
+    }
+
+    template <typename T>
+    typename enable_if<is_floating_point<T>::value, const Log &>::type operator<<(const T &d) const {
+        if (active) {
+            append(Logger::Float, static_cast<double>(d));
+        }
+
+        return *this;
+    }
+
+    template <typename T>
+    typename enable_if<!is_same<typename remove_cv<T>::type, char>::value &&
+                           !is_same<typename remove_cv<T>::type, signed char>::value &&
+                           !is_same<typename remove_cv<T>::type, unsigned char>::value,
+                       const Log &>::type
+    operator<<(T *d) const {
+        if (active) {
+            append(Logger::Pointer, reinterpret_cast<uintptr_t>(d));
+        }
+
+        return *this;
+    }
+
+    // Other types, including setw() and setfill(), go through a stream holding the format state
+    template <typename T>
+    typename enable_if<!is_arithmetic<T>::value, const Log &>::type operator<<(const T &d) const {
+        if (active) {
+            ostringstream &state = formatState();
+            state << d;
+
+            if (state.tellp() > 0) {
+                string text = state.str();
+                appendString(text.data(), text.size());
+                state.str("");
+            }
+        }
+
+        return *this;
+    }
+
+    const Log &operator<<(ios_base &(*manip)(ios_base &)) const {
+        if (active) {
+            manip(formatState());
+        }
+
+        return *this;
+    }
+
+    const Log &operator<<(ostream &(*manip)(ostream &)) const {
+        if (active) {
+            // Only line endings are recorded, flushing is done by the logger thread
+            if (manip == static_cast<ostream &(*)(ostream &)>(endl)) {
+                buffer().push_back(static_cast<char>(Logger::Newline));
+                commit();
+            } else {
+                manip(formatState());
+            }
+        }
+
+        return *this;
+    }
+
+private:
+    static string &buffer() {
+        static thread_local string record;
+        return record;
+    }
+
+    static ostringstream &formatState() {
+        static thread_local ostringstream state;
+        return state;
+    }
+
+    void appendString(const char *data, size_t size) const {
+        string &record = buffer();
+        uint32_t length = size;
+
+        record.push_back(static_cast<char>(Logger::String));
+        record.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        record.append(data, size);
+    }
+
+    template <typename T>
+    void append(Logger::Tag tag, const T &value) const {
+        string &record       = buffer();
+        ostringstream &state = formatState();
+        uint32_t flags       = state.flags();
+        uint8_t width        = min<streamsize>(state.width(), 255);
+        char fill            = state.fill();
+
+        // Like a stream, the width only applies to the next value
+        state.width(0);
+
+        record.push_back(static_cast<char>(tag));
+        record.append(reinterpret_cast<const char *>(&flags), sizeof(flags));
+        record.append(reinterpret_cast<const char *>(&width), sizeof(width));
+        record.push_back(fill);
+        record.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    // Hands the bytes appended by this statement to the logger, nested statements have their own range
+    void commit() const {
+        string &record = buffer();
+
+        Logger::instance().commit(severity, record.data() + start, record.size() - start);
+        record.resize(start);
+    }
+
+    const Severity severity;
+    const bool active;
+    size_t start;
+    ios_base::fmtflags savedFlags;
+    streamsize savedWidth;
+    streamsize savedPrecision;
+    char savedFill;
+};
+
+// Turns a log statement into an expression of type void, so that it fits the conditional operator of LOG
+struct LogVoidify {
+    void operator&(const Log &) const {}
+};
+
+} // namespace
+
+/*
+ * Log statements are written as LOG(severity) << ... so that the arguments are
+ * only evaluated if the severity is enabled.
+ */
+#define LOG(severity) !Log::enabled(severity) ? (void)0 : LogVoidify() & Log(severity)
+
+namespace EthosU {
+
+void setLogLevel(LogLevel level) {
+    Logger::setLevel(level);
+}
+
+LogLevel getLogLevel() {
+    return Logger::getLevel();
+}
+
+void flushLog() {
+    Logger::instance().flush();
+}
+
+} // namespace EthosU
+
+namespace EthosU {
+namespace {
+string errorMessage(const char *message, int error) {
+    if (error == 0) {
+        return message;
+    }
+
+    return string(message) + ": " + strerror(error);
+}
+} // namespace
+
+/*
+ * The n-prefixed hooks report failures by returning the negative errno
+ * instead of throwing, and are used by the non-throwing try* API. The
+ * throwing e-prefixed hooks are layered on top of them.
+ */
+__attribute__((weak)) int nioctl(int fd, unsigned long cmd, void *data = nullptr) {
+    int ret = ::ioctl(fd, cmd, data);
+    if (ret < 0) {
+        ret = -errno;
+    }
+
+    LOG(Severity::Debug) << "ioctl. fd=" << fd << ", cmd=" << setw(8) << setfill('0') << hex << cmd << ", ret=" << dec
+                         << ret << endl;
+
+    return ret;
+}
+
+__attribute__((weak)) int
+nppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask) {
+    int result = ::ppoll(fds, nfds, tmo_p, sigmask);
+    if (result < 0) {
+        result = -errno;
+    }
+
+    return result;
+}
+
+__attribute__((weak)) int nclose(int fd) {
+    LOG(Severity::Debug) << "close. fd=" << fd << endl;
+
+    int result = ::close(fd);
+    if (result < 0) {
+        result = -errno;
+    }
+
+    return result;
+}
+
+__attribute__((weak)) int eioctl(int fd, unsigned long cmd, void *data = nullptr) {
+    int ret = nioctl(fd, cmd, data);
+    if (ret < 0) {
+        throw EthosU::Exception(errorMessage("IOCTL failed", -ret).c_str());
+    }
+
+    return ret;
+}
+
+__attribute__((weak)) int eopen(const char *pathname, int flags) {
+    int fd = ::open(pathname, flags);
+    if (fd < 0) {
+        throw Exception("Failed to open device");
+    }
+
+    LOG(Severity::Debug) << "open. fd=" << fd << ", path='" << pathname << "', flags=" << flags << endl;
+
+    return fd;
+}
+
+__attribute__((weak)) int
+eppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask) {
+    int result = nppoll(fds, nfds, tmo_p, sigmask);
+    if (result < 0) {
+        throw Exception(errorMessage("Failed to wait for ppoll event or signal", -result).c_str());
+    }
+
+    return result;
+}
+
+__attribute__((weak)) int eclose(int fd) {
+    int result = nclose(fd);
+    if (result < 0) {
+        throw Exception(errorMessage("Failed to close file", -result).c_str());
+    }
+
+    return result;
+}
+
+__attribute((weak)) void *emmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    void *ptr = ::mmap(addr, length, prot, flags, fd, offset);
+    if (ptr == MAP_FAILED) {
+        throw Exception("Failed to mmap file");
+    }
+
+    LOG(Severity::Debug) << "map. fd=" << fd << ", addr=" << setfill('0') << addr << ", length=" << dec << length
+                         << ", ptr=" << hex << ptr << endl;
+
+    return ptr;
+}
+
+__attribute__((weak)) int emunmap(void *addr, size_t length) {
+    LOG(Severity::Debug) << "unmap. addr=" << setfill('0') << addr << ", length=" << dec << length << endl;
+
+    int result = ::munmap(addr, length);
+    if (result < 0) {
+        throw Exception("Failed to munmap file");
+    }
+
+    return result;
+}
+
+} // namespace EthosU
+
+namespace EthosU {
+
+/****************************************************************************
+ * Exception
+ ****************************************************************************/
+
+Exception::Exception(const char *msg) : msg(msg) {}
+
+Exception::~Exception() throw() {}
+
+const char *Exception::what() const throw() {
+    return msg.c_str();
+}
+
+/****************************************************************************
+ * Semantic Version
+ ****************************************************************************/
+
+bool SemanticVersion::operator==(const SemanticVersion &other) {
+    return other.major == major && other.minor == minor && other.patch == patch;
+}
+
+bool SemanticVersion::operator<(const SemanticVersion &other) {
+    if (other.major > major)
+        return true;
+    if (other.minor > minor)
+        return true;
+    return other.patch > patch;
+}
+
+bool SemanticVersion::operator<=(const SemanticVersion &other) {
+    return *this < other || *this == other;
+}
+
+bool SemanticVersion::operator!=(const SemanticVersion &other) {
+    return !(*this == other);
+}
+
+bool SemanticVersion::operator>(const SemanticVersion &other) {
+    return !(*this <= other);
+}
+
+bool SemanticVersion::operator>=(const SemanticVersion &other) {
+    return !(*this < other);
+}
+
+ostream &operator<<(ostream &out, const SemanticVersion &v) {
+    return out << "{ major=" << unsigned(v.major) << ", minor=" << unsigned(v.minor) << ", patch=" << unsigned(v.patch)
+               << " }";
+}
+
+/****************************************************************************
+ * Latency
+ ****************************************************************************/
+
+namespace {
+int64_t monotonicNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+atomic<bool> &latencyEnabled() {
+    static atomic<bool> enabled(getenv("ETHOSU_LATENCY_STATS") != nullptr);
+    return enabled;
+}
+
+// Returns the start of a stage, or zero if latency instrumentation is disabled
+int64_t stageStart() {
+    return latencyEnabled().load(memory_order_relaxed) ? monotonicNanos() : 0;
+}
+
+// Records a stage started with stageStart() and returns its end, or zero if the stage was not timed
+int64_t stageEnd(const shared_ptr<LatencyProfile> &profile, LatencyStage stage, int64_t start) {
+    if (start == 0) {
+        return 0;
+    }
+
+    int64_t end = monotonicNanos();
+    profile->record(stage, end - start);
+
+    return end;
+}
+
+struct LatencyRegistry {
+    mutex lock;
+    vector<weak_ptr<LatencyProfile>> profiles;
+};
+
+LatencyRegistry &latencyRegistry() {
+    static LatencyRegistry registry;
+    return registry;
+}
+
+string jsonEscape(const string &s) {
+    ostringstream out;
+
+    for (auto c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << "\\u" << setw(4) << setfill('0') << hex << static_cast<int>(c) << dec;
+        } else {
+            out << c;
+        }
+    }
+
+    return out.str();
+}
+} // namespace
+
+ostream &operator<<(ostream &out, const LatencyStage &stage) {
+    switch (stage) {
+    case LatencyStage::BufferCreate:
+        return out << "buffer_create";
+    case LatencyStage::NetworkCreate:
+        return out << "network_create";
+    case LatencyStage::InferenceSetup:
+        return out << "inference_setup";
+    case LatencyStage::InferenceSubmit:
+        return out << "inference_submit";
+    case LatencyStage::InferenceWait:
+        return out << "inference_wait";
+    case LatencyStage::InferenceResult:
+        return out << "inference_result";
+    case LatencyStage::InferenceTotal:
+        return out << "inference_total";
+    }
+    throw Exception("Unknown latency stage");
+}
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+/*
+ * Values below 16 have a bucket each. Above that, the 16 buckets of every
+ * power of two are indexed by the four bits following the most significant
+ * bit.
+ */
+size_t LatencyHistogram::bucketIndex(uint64_t nanos) {
+    if (nanos < 16) {
+        return nanos;
+    }
+
+    unsigned shift = 63 - __builtin_clzll(nanos) - 4;
+
+    return shift * 16 + (nanos >> shift);
+}
+
+uint64_t LatencyHistogram::bucketLimit(size_t index) {
+    if (index < 16) {
+        return index;
+    }
+
+    unsigned shift    = index / 16 - 1;
+    uint64_t mantissa = index % 16 + 16;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanos) {
+    buckets[bucketIndex(nanos)].fetch_add(1, memory_order_relaxed);
+    count.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(nanos, memory_order_relaxed);
+
+    uint64_t current = min.load(memory_order_relaxed);
+    while (nanos < current && !min.compare_exchange_weak(current, nanos, memory_order_relaxed)) {}
+
+    current = max.load(memory_order_relaxed);
+    while (nanos > current && !max.compare_exchange_weak(current, nanos, memory_order_relaxed)) {}
+}
+
+void LatencyHistogram::reset() {
+    for (auto &bucket : buckets) {
+        bucket.store(0, memory_order_relaxed);
+    }
+
+    count.store(0, memory_order_relaxed);
+    sum.store(0, memory_order_relaxed);
+    min.store(UINT64_MAX, memory_order_relaxed);
+    max.store(0, memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getCount() const {
+    return count.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getMin() const {
+    return getCount() == 0 ? 0 : min.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getMax() const {
+    return max.load(memory_order_relaxed);
+}
+
+double LatencyHistogram::getMean() const {
+    uint64_t n = getCount();
+    return n == 0 ? 0.0 : static_cast<double>(sum.load(memory_order_relaxed)) / n;
+}
+
+uint64_t LatencyHistogram::getPercentile(double percentile) const {
+    uint64_t n = getCount();
+    if (n == 0) {
+        return 0;
+    }
+
+    // The value of the bucket holding the requested rank, capped at the largest recorded value
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(percentile / 100.0 * n + 0.5));
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); i++) {
+        seen += buckets[i].load(memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(bucketLimit(i), getMax());
+        }
+    }
+
+    return getMax();
+}
+
+LatencyProfile::LatencyProfile(const string &name) : name(name) {}
+
+const string &LatencyProfile::getName() const {
+    return name;
+}
+
+void LatencyProfile::record(LatencyStage stage, uint64_t nanos) {
+    histograms[static_cast<int>(stage)].record(nanos);
+}
+
+const LatencyHistogram &LatencyProfile::getHistogram(LatencyStage stage) const {
+    return histograms[static_cast<int>(stage)];
+}
+
+void LatencyProfile::reset() {
+    for (auto &histogram : histograms) {
+        histogram.reset();
+    }
+}
+
+void LatencyProfiler::setEnabled(bool enabled) {
+    latencyEnabled().store(enabled, memory_order_relaxed);
+}
+
+bool LatencyProfiler::isEnabled() {
+    return latencyEnabled().load(memory_order_relaxed);
+}
+
+shared_ptr<LatencyProfile> LatencyProfiler::createProfile(const string &name) {
+    auto profile            = make_shared<LatencyProfile>(name);
+    LatencyRegistry &registry = latencyRegistry();
+
+    lock_guard<mutex> guard(registry.lock);
+
+    // Drop the entries of destroyed devices and networks
+    auto &profiles = registry.profiles;
+    profiles.erase(remove_if(profiles.begin(), profiles.end(),
+                             [](const weak_ptr<LatencyProfile> &p) { return p.expired(); }),
+                   profiles.end());
+    profiles.push_back(profile);
+
+    return profile;
+}
+
+vector<shared_ptr<LatencyProfile>> LatencyProfiler::getProfiles() {
+    LatencyRegistry &registry = latencyRegistry();
+    vector<shared_ptr<LatencyProfile>> profiles;
+
+    lock_guard<mutex> guard(registry.lock);
+    for (auto &weak : registry.profiles) {
+        if (auto profile = weak.lock()) {
+            profiles.push_back(profile);
+        }
+    }
+
+    return profiles;
+}
+
+void LatencyProfiler::dumpJson(ostream &out) {
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+    static const char *names[]        = {"p50", "p90", "p99", "p999"};
+
+    // JSON numbers are decimal, whatever format the caller left on the stream
+    ios_base::fmtflags flags = out.flags();
+    streamsize precision     = out.precision();
+    out.flags(ios_base::dec);
+
+    out << "{\n  \"unit\": \"ns\",\n  \"profiles\": [";
+
+    bool firstProfile = true;
+    for (auto &profile : getProfiles()) {
+        out << (firstProfile ? "\n" : ",\n") << "    {\n      \"name\": \"" << jsonEscape(profile->getName())
+            << "\",\n      \"stages\": {";
+        firstProfile = false;
+
+        bool firstStage = true;
+        for (int i = 0; i < ETHOSU_LATENCY_STAGE_COUNT; i++) {
+            LatencyStage stage                  = static_cast<LatencyStage>(i);
+            const LatencyHistogram &histogram = profile->getHistogram(stage);
+
+            if (histogram.getCount() == 0) {
+                continue;
+            }
+
+            out << (firstStage ? "\n" : ",\n") << "        \"" << stage << "\": { \"count\": " << histogram.getCount()
+                << ", \"min\": " << histogram.getMin() << ", \"mean\": " << fixed << setprecision(0)
+                << histogram.getMean();
+            out.unsetf(ios_base::floatfield);
+
+            for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+                out << ", \"" << names[p] << "\": " << histogram.getPercentile(percentiles[p]);
+            }
+
+            out << ", \"max\": " << histogram.getMax() << " }";
+            firstStage = false;
+        }
+
+        out << (firstStage ? "}\n    }" : "\n      }\n    }");
+    }
+
+    out << (firstProfile ? "]\n}\n" : "\n  ]\n}\n");
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+void LatencyProfiler::reset() {
+    for (auto &profile : getProfiles()) {
+        profile->reset();
+    }
+}
+
+/****************************************************************************
+ * Device
+ ****************************************************************************/
+Device::Device(const char *device) {
+    fd             = eopen(device, O_RDWR | O_NONBLOCK);
+    arenaPool      = unique_ptr<ArenaPool>(new ArenaPool(*this));
+    latencyProfile = LatencyProfiler::createProfile(string("device ") + device);
+    LOG(Severity::Info) << "Device(\"" << device << "\"). this=" << this << ", fd=" << fd << endl;
+}
+
+Device::~Device() noexcept(false) {
+    eclose(fd);
+    LOG(Severity::Info) << "~Device(). this=" << this << endl;
+}
+
+int Device::ioctl(unsigned long cmd, void *data) const {
+    return eioctl(fd, cmd, data);
+}
+
+const shared_ptr<LatencyProfile> &Device::getLatencyProfile() const {
+    return latencyProfile;
+}
+
+ArenaPool &Device::getArenaPool() const {
+    return *arenaPool;
+}
+
+Capabilities Device::capabilities() const {
+    ethosu_uapi_device_capabilities uapi;
+    (void)eioctl(fd, ETHOSU_IOCTL_CAPABILITIES_REQ, static_cast<void *>(&uapi));
+
+    Capabilities capabilities(
+        HardwareId(uapi.hw_id.version_status,
+                   SemanticVersion(uapi.hw_id.version_major, uapi.hw_id.version_minor),
+                   SemanticVersion(uapi.hw_id.product_major),
+                   SemanticVersion(uapi.hw_id.arch_major_rev, uapi.hw_id.arch_minor_rev, uapi.hw_id.arch_patch_rev)),
+        HardwareConfiguration(uapi.hw_cfg.macs_per_cc, uapi.hw_cfg.cmd_stream_version, bool(uapi.hw_cfg.custom_dma)),
+        SemanticVersion(uapi.driver_major_rev, uapi.driver_minor_rev, uapi.driver_patch_rev));
+    return capabilities;
+}
+
+/****************************************************************************
+ * Buffer
+ ****************************************************************************/
+
+Buffer::Buffer(const Device &device, const size_t capacity) :
+    fd(-1), dataPtr(nullptr), dataCapacity(capacity), dataOffset(0), dataSize(0) {
+    int64_t start                  = stageStart();
+    ethosu_uapi_buffer_create uapi = {static_cast<uint32_t>(dataCapacity)};
+    fd                             = device.ioctl(ETHOSU_IOCTL_BUFFER_CREATE, static_cast<void *>(&uapi));
+
+    void *d;
+    try {
+        d = emmap(nullptr, dataCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } catch (std::exception &e) {
+        try {
+            eclose(fd);
+        } catch (...) { std::throw_with_nested(e); }
+        throw;
+    }
+
+    dataPtr = reinterpret_cast<char *>(d);
+    stageEnd(device.getLatencyProfile(), LatencyStage::BufferCreate, start);
+
+    LOG(Severity::Info) << "Buffer(" << &device << ", " << dec << capacity << "), this=" << this << ", fd=" << fd
+                        << ", dataPtr=" << static_cast<void *>(dataPtr) << endl;
+}
+
+Buffer::~Buffer() noexcept(false) {
+    try {
+        emunmap(dataPtr, dataCapacity);
+    } catch (std::exception &e) {
+        try {
+            eclose(fd);
+        } catch (...) { std::throw_with_nested(e); }
+        throw;
+    }
+
+    eclose(fd);
+
+    LOG(Severity::Info) << "~Buffer(). this=" << this << endl;
+}
+
+size_t Buffer::capacity() const {
+    return dataCapacity;
+}
+
+void Buffer::clear() const {
+    resize(0, 0);
+}
+
+char *Buffer::data() const {
+    return dataPtr + dataOffset;
+}
+
+void Buffer::resize(size_t size, size_t offset) const {
+    int ret = tryResize(size, offset);
+    if (ret < 0) {
+        throw Exception(errorMessage("IOCTL failed", -ret).c_str());
+    }
+}
+
+int Buffer::tryResize(size_t size, size_t offset) const {
+    ethosu_uapi_buffer uapi;
+    uapi.offset = offset;
+    uapi.size   = size;
+
+    int ret = nioctl(fd, ETHOSU_IOCTL_BUFFER_SET, static_cast<void *>(&uapi));
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Only update the shadow once the kernel has accepted the new descriptor
+    dataOffset = offset;
+    dataSize   = size;
+
+    return 0;
+}
+
+size_t Buffer::offset() const {
+    return dataOffset;
+}
+
+size_t Buffer::size() const {
+    return dataSize;
+}
+
+void Buffer::refresh() const {
+    ethosu_uapi_buffer uapi;
+    eioctl(fd, ETHOSU_IOCTL_BUFFER_GET, static_cast<void *>(&uapi));
+    dataOffset = uapi.offset;
+    dataSize   = uapi.size;
+}
+
+int Buffer::getFd() const {
+    return fd;
+}
+
+/****************************************************************************
+ * Arena pool
+ ****************************************************************************/
+
+struct ArenaPool::State {
+    State(size_t _maxCached) : maxCached(_maxCached), hits(0), misses(0), inUse(0), highWaterMark(0) {}
+
+    mutex lock;
+    vector<unique_ptr<Buffer>> cached;
+    size_t maxCached;
+    size_t hits;
+    size_t misses;
+    size_t inUse;
+    size_t highWaterMark;
+};
+
+ArenaPool::ArenaPool(const Device &device, size_t maxCached) : device(device), state(make_shared<State>(maxCached)) {}
+
+ArenaPool::~ArenaPool() noexcept(false) {
+    // Arenas still handed out are freed when their last reference is dropped
+    trim();
+}
+
+shared_ptr<Buffer> ArenaPool::acquire(size_t size) {
+    unique_ptr<Buffer> buffer;
+
+    {
+        lock_guard<mutex> guard(state->lock);
+
+        // Pick the smallest idle arena that is large enough
+        auto best = state->cached.end();
+        for (auto it = state->cached.begin(); it != state->cached.end(); ++it) {
+            if ((*it)->capacity() >= size && (best == state->cached.end() || (*it)->capacity() < (*best)->capacity())) {
+                best = it;
+            }
+        }
+
+        if (best != state->cached.end()) {
+            buffer = std::move(*best);
+            state->cached.erase(best);
+            state->hits++;
+        } else {
+            state->misses++;
+        }
+
+        state->inUse++;
+        state->highWaterMark = max(state->highWaterMark, state->inUse + state->cached.size());
+    }
+
+    try {
+        if (!buffer) {
+            buffer.reset(new Buffer(device, size));
+        }
+
+        if (buffer->size() != size || buffer->offset() != 0) {
+            buffer->resize(size);
+        }
+    } catch (std::exception &) {
+        lock_guard<mutex> guard(state->lock);
+        state->inUse--;
+        throw;
+    }
+
+    LOG(Severity::Debug) << "ArenaPool acquire. this=" << this << ", size=" << dec << size
+                         << ", buffer=" << buffer.get() << endl;
+
+    return shared_ptr<Buffer>(buffer.release(), Releaser{state, true});
+}
+
+void ArenaPool::discard(const shared_ptr<Buffer> &arena) {
+    // Arenas not handed out by a pool have no releaser and are left as they are
+    Releaser *releaser = std::get_deleter<Releaser>(arena);
+    if (releaser != nullptr) {
+        releaser->recycle = false;
+    }
+}
+
+void ArenaPool::Releaser::operator()(Buffer *buffer) const {
+    unique_ptr<Buffer> owned(buffer);
+
+    if (auto pool = state.lock()) {
+        lock_guard<mutex> guard(pool->lock);
+        pool->inUse--;
+
+        if (recycle && pool->cached.size() < pool->maxCached) {
+            pool->cached.push_back(std::move(owned));
+            return;
+        }
+    }
+
+    // The buffer is freed outside of the lock. A deleter must not throw.
+    try {
+        owned.reset();
+    } catch (std::exception &e) { LOG(Severity::Error) << "Failed to free arena: " << e.what() << endl; }
+}
+
+void ArenaPool::setMaxCached(size_t maxCached) {
+    vector<unique_ptr<Buffer>> evicted;
+
+    {
+        lock_guard<mutex> guard(state->lock);
+        state->maxCached = maxCached;
+
+        while (state->cached.size() > maxCached) {
+            evicted.push_back(std::move(state->cached.back()));
+            state->cached.pop_back();
+        }
+    }
+}
+
+size_t ArenaPool::getMaxCached() const {
+    lock_guard<mutex> guard(state->lock);
+    return state->maxCached;
+}
+
+ArenaPool::Statistics ArenaPool::getStatistics() const {
+    lock_guard<mutex> guard(state->lock);
+    return Statistics{state->hits, state->misses, state->inUse, state->cached.size(), state->highWaterMark};
+}
+
+void ArenaPool::trim() {
+    vector<unique_ptr<Buffer>> evicted;
+
+    {
+        lock_guard<mutex> guard(state->lock);
+        evicted.swap(state->cached);
+    }
+}
+
+/****************************************************************************
+ * Network
+ ****************************************************************************/
+
+Network::Network(const Device &device, shared_ptr<Buffer> &buffer) :
+    device(device), fd(-1), buffer(buffer), arenaSize(DEFAULT_ARENA_SIZE_OF_MB << 20), batchSupported(true) {
+    int64_t start = stageStart();
+
+    // Create buffer handle
+    ethosu_uapi_network_create uapi;
+    uapi.type = ETHOSU_UAPI_NETWORK_BUFFER;
+    uapi.fd   = buffer->getFd();
+    fd        = device.ioctl(ETHOSU_IOCTL_NETWORK_CREATE, static_cast<void *>(&uapi));
+    try {
+        collectNetworkInfo();
+    } catch (std::exception &e) {
+        try {
+            eclose(fd);
+        } catch (...) { std::throw_with_nested(e); }
+        throw;
+    }
+
+    stageEnd(latencyProfile, LatencyStage::NetworkCreate, start);
+
+    LOG(Severity::Info) << "Network(" << &device << ", " << &*buffer << "), this=" << this << ", fd=" << fd << endl;
+}
+
+Network::Network(const Device &device, const unsigned index) :
+    device(device), fd(-1), arenaSize(DEFAULT_ARENA_SIZE_OF_MB << 20), batchSupported(true) {
+    int64_t start = stageStart();
+
+    // Create buffer handle
+    ethosu_uapi_network_create uapi;
+    uapi.type  = ETHOSU_UAPI_NETWORK_INDEX;
+    uapi.index = index;
+    fd         = device.ioctl(ETHOSU_IOCTL_NETWORK_CREATE, static_cast<void *>(&uapi));
+    try {
+        collectNetworkInfo();
+    } catch (std::exception &e) {
+        try {
+            eclose(fd);
+        } catch (...) { std::throw_with_nested(e); }
+        throw;
+    }
+
+    stageEnd(latencyProfile, LatencyStage::NetworkCreate, start);
+
+    LOG(Severity::Info) << "Network(" << &device << ", " << index << "), this=" << this << ", fd=" << fd << endl;
+}
+
+void Network::collectNetworkInfo() {
+    ethosu_uapi_network_info info;
+    ioctl(ETHOSU_IOCTL_NETWORK_INFO, static_cast<void *>(&info));
+
+    _isVelaModel = info.is_vela;
+
+    // The description is not necessarily null terminated
+    string desc(info.desc, strnlen(info.desc, sizeof(info.desc)));
+    ostringstream name;
+    name << "network " << (desc.empty() ? "" : desc + " ") << this;
+    latencyProfile = LatencyProfiler::createProfile(name.str());
+
+    for (uint32_t i = 0; i < info.ifm_count; i++) {
+        ifmDims.push_back(info.ifm_size[i]);
+        ifmTypes.push_back(info.ifm_types[i]);
+        ifmDataOffset.push_back(info.ifm_offset[i]);
+
+        std::vector<size_t> shape;
+        for (uint32_t j = 0; j < info.ifm_dims[i]; j++) {
+            shape.push_back(info.ifm_shapes[i][j]);
+        }
+        ifmShapes.push_back(shape);
+    }
+
+    for (uint32_t i = 0; i < info.ofm_count; i++) {
+        ofmDims.push_back(info.ofm_size[i]);
+        ofmTypes.push_back(info.ofm_types[i]);
+        ofmDataOffset.push_back(info.ofm_offset[i]);
+
+        std::vector<size_t> shape;
+        for (uint32_t j = 0; j < info.ofm_dims[i]; j++) {
+            shape.push_back(info.ofm_shapes[i][j]);
+        }
+        ofmShapes.push_back(shape);
+    }
+}
+
+Network::~Network() noexcept(false) {
+    eclose(fd);
+    LOG(Severity::Info) << "~Network(). this=" << this << endl;
+}
+
+int Network::ioctl(unsigned long cmd, void *data) {
+    return eioctl(fd, cmd, data);
+}
+
+shared_ptr<Buffer> Network::getBuffer() {
+    return buffer;
+}
+
+const std::vector<size_t> &Network::getIfmDims() const {
+    return ifmDims;
+}
+
+size_t Network::getIfmSize() const {
+    size_t size = 0;
+
+    for (auto s : ifmDims) {
+        size += s;
+    }
+
+    return size;
+}
+
+const std::vector<size_t> &Network::getOfmDims() const {
+    return ofmDims;
+}
+
+size_t Network::getOfmSize() const {
+    size_t size = 0;
+
+    for (auto s : ofmDims) {
+        size += s;
+    }
+
+    return size;
+}
+
+size_t Network::getInputCount() const {
+    return ifmTypes.size();
+}
+
+size_t Network::getOutputCount() const {
+    return ofmTypes.size();
+}
+
+int32_t Network::getInputDataOffset(int index){
+    if (index >= ifmDataOffset.size()){
+        throw Exception("Invalid input index or non vela model");
+    }
+    return ifmDataOffset[index];
+}
+
+int32_t Network::getOutputDataOffset(int index){
+    if (index >= ofmDataOffset.size()){
+        throw Exception("Invalid output index or non vela model");
+    }
+    return ofmDataOffset[index];
+}
+
+const std::vector<std::vector<size_t>> &Network::getIfmShapes() const {
+    return ifmShapes;
+}
+
+const std::vector<std::vector<size_t>> &Network::getOfmShapes() const {
+    return ofmShapes;
+}
+
+const std::vector<int> &Network::getIfmTypes() const {
+    return ifmTypes;
+}
+
+const std::vector<int> &Network::getOfmTypes() const {
+    return ofmTypes;
+}
+
+const Device &Network::getDevice() const {
+    return device;
+}
+
+bool Network::isVelaModel() const {
+    return _isVelaModel;
+}
+
+size_t Network::getArenaSize() const {
+    return arenaSize;
+}
+
+void Network::setArenaSize(size_t size) {
+    arenaSize = size;
+}
+
+const shared_ptr<LatencyProfile> &Network::getLatencyProfile() const {
+    return latencyProfile;
+}
+
+InferenceBatch
+Network::submitBatch(const vector<BatchItem> &items, const vector<uint32_t> &counters, bool cycleCounter) {
+    vector<uint32_t> counterConfigs(ETHOSU_PMU_EVENT_MAX, 0);
+
+    if (counters.size() > counterConfigs.size()) {
+        throw Exception("PMU Counters argument to large.");
+    }
+
+    copy(counters.begin(), counters.end(), counterConfigs.begin());
+
+    // Prepare all inferences and pack their requests into one array
+    shared_ptr<Network> self = shared_from_this();
+    vector<shared_ptr<Inference>> inferences;
+    vector<ethosu_uapi_inference_create> requests;
+
+    for (auto &item : items) {
+        shared_ptr<Inference> inference(new Inference(self));
+        inference->ifmBuffers  = item.ifm;
+        inference->ofmBuffers  = item.ofm;
+        inference->arenaBuffer = device.getArenaPool().acquire(arenaSize);
+
+        int64_t start = stageStart();
+        inference->prepare(counterConfigs, cycleCounter);
+        stageEnd(latencyProfile, LatencyStage::InferenceSetup, start);
+
+        requests.push_back(*inference->request);
+        inferences.push_back(inference);
+    }
+
+    vector<int32_t> fds(items.size(), -1);
+    bool submitted = false;
+    int64_t start  = stageStart();
+
+    if (batchSupported && !items.empty()) {
+        ethosu_uapi_inference_batch uapi;
+        uapi.count    = requests.size();
+        uapi.reserved = 0;
+        uapi.requests = reinterpret_cast<uintptr_t>(requests.data());
+        uapi.fds      = reinterpret_cast<uintptr_t>(fds.data());
+
+        int ret = nioctl(fd, ETHOSU_IOCTL_INFERENCE_BATCH, static_cast<void *>(&uapi));
+        if (ret >= 0) {
+            submitted = true;
+        } else if (ret == -ENOTTY || ret == -EINVAL) {
+            LOG(Severity::Info) << "Inference batch not supported, falling back to create. this=" << this << endl;
+            batchSupported = false;
+        } else {
+            LOG(Severity::Warning) << "Failed to create inference batch. errno=" << -ret << endl;
+            fill(fds.begin(), fds.end(), ret);
+            submitted = true;
+        }
+    }
+
+    if (!submitted) {
+        for (size_t i = 0; i < requests.size(); i++) {
+            fds[i] = nioctl(fd, ETHOSU_IOCTL_INFERENCE_CREATE, static_cast<void *>(&requests[i]));
+            if (fds[i] < 0) {
+                LOG(Severity::Warning) << "Failed to create batch inference " << i << ". errno=" << -fds[i] << endl;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < inferences.size(); i++) {
+        if (fds[i] >= 0) {
+            inferences[i]->fd = fds[i];
+            inferences[i]->submitted(start);
+        } else {
+            inferences[i].reset();
+        }
+    }
+
+    LOG(Severity::Info) << "Inference batch. network=" << this << ", count=" << items.size() << endl;
+
+    return InferenceBatch(inferences);
+}
+
+/****************************************************************************
+ * Inference
+ ****************************************************************************/
+
+bool InferenceResult::isTerminal() const {
+    return status != InferenceStatus::RUNNING && status != InferenceStatus::ABORTING;
+}
+
+ostream &operator<<(ostream &out, const InferenceStatus &status) {
+    switch (status) {
+    case InferenceStatus::OK:
+        return out << "ok";
+    case InferenceStatus::ERROR:
+        return out << "error";
+    case InferenceStatus::RUNNING:
+        return out << "running";
+    case InferenceStatus::REJECTED:
+        return out << "rejected";
+    case InferenceStatus::ABORTED:
+        return out << "aborted";
+    case InferenceStatus::ABORTING:
+        return out << "aborting";
+    }
+    throw Exception("Unknown inference status");
+}
+
+namespace {
+bool isCompleted(int fd) {
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = POLLIN | POLLERR;
+    pfd.revents = 0;
+
+    struct timespec tmo = {0, 0};
+
+    return nppoll(&pfd, 1, &tmo, NULL) > 0 && pfd.revents != 0;
+}
+
+InferenceStatus readStatus(int fd) {
+    ethosu_uapi_result_status uapi;
+
+    if (nioctl(fd, ETHOSU_IOCTL_INFERENCE_STATUS, static_cast<void *>(&uapi)) < 0 ||
+        uapi.status > ETHOSU_UAPI_STATUS_ABORTING) {
+        return InferenceStatus::ERROR;
+    }
+
+    // The library status enumeration follows the order of the UAPI
+    return static_cast<InferenceStatus>(uapi.status);
+}
+} // namespace
+
+Inference::~Inference() noexcept(false) {
+    if (fd >= 0) {
+        // The NPU may still write to the arena of an unfinished run, so it must not be recycled
+        if (arenaBuffer && !hasCompleted()) {
+            network->getDevice().getArenaPool().discard(arenaBuffer);
+        }
+
+        eclose(fd);
+    }
+
+    LOG(Severity::Info) << "~Inference(). this=" << this << endl;
+}
+
+Inference::Inference(const shared_ptr<Network> &network) : fd(-1), network(network) {}
+
+void Inference::create(std::vector<uint32_t> &counterConfigs, bool cycleCounterEnable = false) {
+    int64_t start = stageStart();
+    prepare(counterConfigs, cycleCounterEnable);
+    stageEnd(network->getLatencyProfile(), LatencyStage::InferenceSetup, start);
+
+    start = stageStart();
+    fd    = network->ioctl(ETHOSU_IOCTL_INFERENCE_CREATE, static_cast<void *>(request.get()));
+    submitted(start);
+
+    LOG(Severity::Info) << "Inference(" << &*network << "), this=" << this << ", fd=" << fd << endl;
+}
+
+int Inference::submit(const vector<uint32_t> &counters, bool cycleCounterEnable) {
+    // The arena takes the first IFM slot
+    if (counters.size() > ETHOSU_PMU_EVENT_MAX || ifmBuffers.size() >= ETHOSU_FD_MAX ||
+        ofmBuffers.size() > ETHOSU_FD_MAX) {
+        return -EINVAL;
+    }
+
+    int64_t start                   = stageStart();
+    vector<uint32_t> counterConfigs = initializeCounterConfig();
+    copy(counters.begin(), counters.end(), counterConfigs.begin());
+    prepare(counterConfigs, cycleCounterEnable);
+    stageEnd(network->getLatencyProfile(), LatencyStage::InferenceSetup, start);
+
+    start   = stageStart();
+    int ret = nioctl(network->fd, ETHOSU_IOCTL_INFERENCE_CREATE, static_cast<void *>(request.get()));
+    if (ret < 0) {
+        return ret;
+    }
+
+    fd = ret;
+    submitted(start);
+
+    LOG(Severity::Info) << "Inference(" << &*network << "), this=" << this << ", fd=" << fd << endl;
+
+    return 0;
+}
+
+Expected<shared_ptr<Inference>> Inference::tryCreate(const shared_ptr<Network> &network,
+                                                     const vector<shared_ptr<Buffer>> &ifmBuffers,
+                                                     const vector<shared_ptr<Buffer>> &ofmBuffers,
+                                                     const vector<uint32_t> &counters,
+                                                     bool cycleCounterEnable) {
+    shared_ptr<Inference> inference(new Inference(network));
+    inference->ifmBuffers = ifmBuffers;
+    inference->ofmBuffers = ofmBuffers;
+
+    // Only allocating a new arena can fail, the pool normally hands out a cached one
+    try {
+        inference->arenaBuffer = network->getDevice().getArenaPool().acquire(network->getArenaSize());
+    } catch (Exception &) {
+        return Expected<shared_ptr<Inference>>::failure(ENOMEM);
+    }
+
+    int ret = inference->submit(counters, cycleCounterEnable);
+    if (ret < 0) {
+        return Expected<shared_ptr<Inference>>::failure(-ret);
+    }
+
+    return inference;
+}
+
+Expected<shared_ptr<Inference>> Inference::tryCreate(const shared_ptr<Network> &network,
+                                                     const shared_ptr<Buffer> &arenaBuffer,
+                                                     const vector<uint32_t> &counters,
+                                                     bool cycleCounterEnable) {
+    if (!arenaBuffer) {
+        return Expected<shared_ptr<Inference>>::failure(EINVAL);
+    }
+
+    shared_ptr<Inference> inference(new Inference(network));
+    inference->arenaBuffer = arenaBuffer;
+
+    int ret = inference->submit(counters, cycleCounterEnable);
+    if (ret < 0) {
+        return Expected<shared_ptr<Inference>>::failure(-ret);
+    }
+
+    return inference;
+}
+
+void Inference::prepare(std::vector<uint32_t> &counterConfigs, bool cycleCounterEnable) {
+    request                            = make_shared<ethosu_uapi_inference_create>();
+    ethosu_uapi_inference_create &uapi = *request;
+
+    if (ifmBuffers.size() > ETHOSU_FD_MAX) {
+        throw Exception("IFM buffer overflow");
+    }
+
+    if (ofmBuffers.size() > ETHOSU_FD_MAX) {
+        throw Exception("OFM buffer overflow");
+    }
+
+    if (counterConfigs.size() != ETHOSU_PMU_EVENT_MAX) {
+        throw Exception("Wrong size of counter configurations");
+    }
+
+    uapi.ifm_count = 0;
+    uapi.ifm_fd[uapi.ifm_count++] = arenaBuffer->getFd();
+    for (auto it : ifmBuffers) {
+        uapi.ifm_fd[uapi.ifm_count++] = it->getFd();
+    }
+
+    uapi.ofm_count = 0;
+    for (auto it : ofmBuffers) {
+        uapi.ofm_fd[uapi.ofm_count++] = it->getFd();
+    }
+
+    for (int i = 0; i < ETHOSU_PMU_EVENT_MAX; i++) {
+        uapi.pmu_config.events[i] = counterConfigs[i];
+    }
+
+    uapi.pmu_config.cycle_count = cycleCounterEnable;
+}
+
+void Inference::resubmit() {
+    Expected<void> resubmitted = tryResubmit();
+    if (!resubmitted) {
+        throw Exception(errorMessage("Failed to resubmit inference", resubmitted.error()).c_str());
+    }
+}
+
+Expected<void> Inference::tryResubmit() {
+    // The previous run owns the arena and the OFM buffers until it has completed
+    if (!hasCompleted()) {
+        return Expected<void>::failure(EBUSY, InferenceStatus::RUNNING);
+    }
+
+    {
+        lock_guard<mutex> guard(resultLock);
+        cachedResult = InferenceResult();
+    }
+
+    // The kernel driver appends to the OFM buffers, so drop the previous result
+    for (auto &ofm : ofmBuffers) {
+        if (ofm->size() != 0) {
+            int ret = ofm->tryResize(0, 0);
+            if (ret < 0) {
+                return Expected<void>::failure(-ret);
+            }
+        }
+    }
+
+    int64_t start = stageStart();
+
+    if (resubmitSupported) {
+        int ret = nioctl(fd, ETHOSU_IOCTL_INFERENCE_RESUBMIT);
+        if (ret >= 0) {
+            submitted(start);
+            LOG(Severity::Info) << "Inference resubmit. this=" << this << ", fd=" << fd << endl;
+            return Expected<void>();
+        }
+
+        if (ret == -EBUSY) {
+            return Expected<void>::failure(EBUSY, InferenceStatus::RUNNING);
+        }
+
+        if (ret != -ENOTTY && ret != -EINVAL) {
+            return Expected<void>::failure(-ret);
+        }
+
+        LOG(Severity::Info) << "Inference resubmit not supported, falling back to create. this=" << this << endl;
+        resubmitSupported = false;
+    }
+
+    // Create a new kernel inference from the prepared request
+    int newFd = nioctl(network->fd, ETHOSU_IOCTL_INFERENCE_CREATE, static_cast<void *>(request.get()));
+    if (newFd < 0) {
+        return Expected<void>::failure(-newFd);
+    }
+
+    std::swap(fd, newFd);
+    submitted(start);
+
+    // The new inference is queued even if the old one fails to close, hence the RUNNING status
+    int ret = nclose(newFd);
+    if (ret < 0) {
+        return Expected<void>::failure(-ret, InferenceStatus::RUNNING);
+    }
+
+    LOG(Severity::Info) << "Inference recreate. this=" << this << ", fd=" << fd << endl;
+
+    return Expected<void>();
+}
+
+std::vector<uint32_t> Inference::initializeCounterConfig() {
+    return std::vector<uint32_t>(ETHOSU_PMU_EVENT_MAX, 0);
+}
+
+uint32_t Inference::getMaxPmuEventCounters() {
+    return ETHOSU_PMU_EVENT_MAX;
+}
+
+bool Inference::wait(int64_t timeoutNanos) const {
+    Expected<bool> timedOut = tryWait(timeoutNanos);
+    if (!timedOut) {
+        throw Exception(errorMessage("Failed to wait for ppoll event or signal", timedOut.error()).c_str());
+    }
+
+    return timedOut.value();
+}
+
+Expected<bool> Inference::tryWait(int64_t timeoutNanos) const {
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = POLLIN | POLLERR;
+    pfd.revents = 0;
+
+    // if timeout negative wait forever
+    struct timespec tmo_p;
+    const struct timespec *tmo = NULL;
+
+    if (timeoutNanos >= 0) {
+        int64_t nanosec = 1000000000;
+        tmo_p.tv_sec    = timeoutNanos / nanosec;
+        tmo_p.tv_nsec   = timeoutNanos % nanosec;
+        tmo             = &tmo_p;
+    }
+
+    int ret = nppoll(&pfd, 1, tmo, NULL);
+    if (ret < 0) {
+        return Expected<bool>::failure(-ret);
+    }
+
+    if (ret == 0) {
+        return Expected<bool>(true, InferenceStatus::RUNNING);
+    }
+
+    complete();
+    return Expected<bool>(false);
+}
+
+namespace {
+int pollInferences(vector<struct pollfd> &pfds, int64_t timeoutNanos) {
+    // if timeout negative wait forever
+    if (timeoutNanos < 0) {
+        return eppoll(pfds.data(), pfds.size(), NULL, NULL);
+    }
+
+    struct timespec tmo_p;
+    int64_t nanosec = 1000000000;
+    tmo_p.tv_sec    = timeoutNanos / nanosec;
+    tmo_p.tv_nsec   = timeoutNanos % nanosec;
+
+    return eppoll(pfds.data(), pfds.size(), &tmo_p, NULL);
+}
+} // namespace
+
+vector<size_t> Inference::waitAny(const vector<Inference *> &inferences, int64_t timeoutNanos) {
+    vector<struct pollfd> pfds(inferences.size());
+    for (size_t i = 0; i < inferences.size(); i++) {
+        pfds[i].fd      = inferences[i]->fd;
+        pfds[i].events  = POLLIN | POLLERR;
+        pfds[i].revents = 0;
+    }
+
+    vector<size_t> completed;
+    if (pollInferences(pfds, timeoutNanos) == 0) {
+        return completed;
+    }
+
+    for (size_t i = 0; i < pfds.size(); i++) {
+        if (pfds[i].revents) {
+            inferences[i]->complete();
+            completed.push_back(i);
+        }
+    }
+
+    return completed;
+}
+
+vector<size_t> Inference::waitAll(const vector<Inference *> &inferences, int64_t timeoutNanos) {
+    const int64_t deadline = timeoutNanos < 0 ? -1 : monotonicNanos() + timeoutNanos;
+    vector<size_t> completed;
+    vector<size_t> pending(inferences.size());
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        pending[i] = i;
+    }
+
+    while (!pending.empty()) {
+        int64_t remaining = -1;
+        if (deadline >= 0) {
+            remaining = max<int64_t>(deadline - monotonicNanos(), 0);
+        }
+
+        vector<Inference *> subset;
+        for (auto i : pending) {
+            subset.push_back(inferences[i]);
+        }
+
+        vector<size_t> done = waitAny(subset, remaining);
+        if (done.empty()) {
+            break;
+        }
+
+        // Remove from the back so the remaining positions stay valid
+        for (auto it = done.rbegin(); it != done.rend(); ++it) {
+            completed.push_back(pending[*it]);
+            pending.erase(pending.begin() + *it);
+        }
+    }
+
+    sort(completed.begin(), completed.end());
+
+    return completed;
+}
+
+void Inference::submitted(int64_t startNanos) {
+    int64_t endNanos = stageEnd(network->getLatencyProfile(), LatencyStage::InferenceSubmit, startNanos);
+
+    lock_guard<mutex> guard(resultLock);
+    submitStartNanos = startNanos;
+    submitEndNanos   = endNanos;
+}
+
+void Inference::complete() const {
+    refreshOfmBuffers();
+
+    // The wait stage is recorded once per submission, however many times the completion is observed
+    int64_t endNanos;
+
+    {
+        lock_guard<mutex> guard(resultLock);
+        endNanos       = submitEndNanos;
+        submitEndNanos = 0;
+    }
+
+    if (endNanos != 0) {
+        stageEnd(network->getLatencyProfile(), LatencyStage::InferenceWait, endNanos);
+    }
+}
+
+bool Inference::hasCompleted() const {
+    {
+        lock_guard<mutex> guard(resultLock);
+        if (cachedResult.isTerminal()) {
+            return true;
+        }
+    }
+
+    return isCompleted(fd);
+}
+
+void Inference::refreshOfmBuffers() const {
+    // The kernel driver updates the size of the OFM buffers on completion
+    for (auto &ofm : ofmBuffers) {
+        ofm->refresh();
+    }
+}
+
+bool Inference::cancel() const {
+    Expected<bool> cancelled = tryCancel();
+    if (!cancelled) {
+        throw Exception(errorMessage("IOCTL failed", cancelled.error()).c_str());
+    }
+
+    return cancelled.value();
+}
+
+Expected<bool> Inference::tryCancel() const {
+    ethosu_uapi_cancel_inference_status uapi;
+
+    int ret = nioctl(fd, ETHOSU_IOCTL_INFERENCE_CANCEL, static_cast<void *>(&uapi));
+    if (ret < 0) {
+        return Expected<bool>::failure(-ret);
+    }
+
+    return Expected<bool>(uapi.status == ETHOSU_UAPI_STATUS_OK);
+}
+
+InferenceResult Inference::result() const {
+    Expected<InferenceResult> result = tryResult();
+    if (!result) {
+        if (result.error() == EPROTO) {
+            throw Exception("Unknown inference status");
+        }
+
+        throw Exception(errorMessage("IOCTL failed", result.error()).c_str());
+    }
+
+    return result.value();
+}
+
+Expected<InferenceResult> Inference::tryResult() const {
+    // A terminal result never changes, so it is only read once from the kernel
+    {
+        lock_guard<mutex> guard(resultLock);
+        if (cachedResult.isTerminal()) {
+            return Expected<InferenceResult>(cachedResult, cachedResult.status);
+        }
+    }
+
+    ethosu_uapi_result_status uapi;
+
+    int64_t start = stageStart();
+    int ret       = nioctl(fd, ETHOSU_IOCTL_INFERENCE_STATUS, static_cast<void *>(&uapi));
+    if (ret < 0) {
+        return Expected<InferenceResult>::failure(-ret);
+    }
+
+    stageEnd(network->getLatencyProfile(), LatencyStage::InferenceResult, start);
+
+    InferenceResult result;
+
+    switch (uapi.status) {
+    case ETHOSU_UAPI_STATUS_OK:
+        result.status = InferenceStatus::OK;
+        break;
+    case ETHOSU_UAPI_STATUS_ERROR:
+        result.status = InferenceStatus::ERROR;
+        break;
+    case ETHOSU_UAPI_STATUS_RUNNING:
+        result.status = InferenceStatus::RUNNING;
+        break;
+    case ETHOSU_UAPI_STATUS_REJECTED:
+        result.status = InferenceStatus::REJECTED;
+        break;
+    case ETHOSU_UAPI_STATUS_ABORTED:
+        result.status = InferenceStatus::ABORTED;
+        break;
+    case ETHOSU_UAPI_STATUS_ABORTING:
+        result.status = InferenceStatus::ABORTING;
+        break;
+    default:
+        return Expected<InferenceResult>::failure(EPROTO);
+    }
+
+    for (int i = 0; i < ETHOSU_PMU_EVENT_MAX; i++) {
+        result.pmuEvents[i] = uapi.pmu_config.events[i];
+        if (uapi.pmu_config.events[i]) {
+            result.pmuCounters[i] = uapi.pmu_count.events[i];
+        }
+    }
+
+    result.cycleCounter = uapi.pmu_count.cycle_count;
+
+    // The total stage is recorded once per submission, by the caller that first sees the terminal status
+    int64_t startNanos = 0;
+
+    {
+        lock_guard<mutex> guard(resultLock);
+        cachedResult = result;
+
+        if (result.isTerminal()) {
+            startNanos       = submitStartNanos;
+            submitStartNanos = 0;
+        }
+    }
+
+    if (startNanos != 0) {
+        stageEnd(network->getLatencyProfile(), LatencyStage::InferenceTotal, startNanos);
+    }
+
+    return Expected<InferenceResult>(result, result.status);
+}
+
+InferenceStatus Inference::status() const {
+    return result().status;
+}
+
+Expected<InferenceStatus> Inference::tryStatus() const {
+    Expected<InferenceResult> result = tryResult();
+    if (!result) {
+        return Expected<InferenceStatus>::failure(result.error(), result.status());
+    }
+
+    return Expected<InferenceStatus>(result.status(), result.status());
+}
+
+const std::vector<uint32_t> Inference::getPmuCounters() const {
+    return result().pmuCounters;
+}
+
+uint64_t Inference::getCycleCounter() const {
+    return result().cycleCounter;
+}
+
+int Inference::getFd() const {
+    return fd;
+}
+
+const shared_ptr<Network> Inference::getNetwork() const {
+    return network;
+}
+
+vector<shared_ptr<Buffer>> &Inference::getIfmBuffers() {
+    return ifmBuffers;
+}
+
+vector<shared_ptr<Buffer>> &Inference::getOfmBuffers() {
+    return ofmBuffers;
+}
+
+/****************************************************************************
+ * Inference batch
+ ****************************************************************************/
+
+InferenceBatch::InferenceBatch(const vector<shared_ptr<Inference>> &inferences) : inferences(inferences) {}
+
+size_t InferenceBatch::size() const {
+    return inferences.size();
+}
+
+bool InferenceBatch::isSubmitted(size_t index) const {
+    return inferences.at(index) != nullptr;
+}
+
+shared_ptr<Inference> InferenceBatch::at(size_t index) const {
+    return inferences.at(index);
+}
+
+vector<size_t> InferenceBatch::wait(int64_t timeoutNanos) const {
+    vector<Inference *> submitted;
+    vector<size_t> indices;
+
+    for (size_t i = 0; i < inferences.size(); i++) {
+        if (inferences[i]) {
+            submitted.push_back(inferences[i].get());
+            indices.push_back(i);
+        }
+    }
+
+    vector<size_t> completed;
+    for (auto i : Inference::waitAll(submitted, timeoutNanos)) {
+        completed.push_back(indices[i]);
+    }
+
+    return completed;
+}
+
+vector<InferenceStatus> InferenceBatch::status() const {
+    vector<InferenceStatus> statuses;
+
+    for (auto &inference : inferences) {
+        statuses.push_back(inference ? inference->status() : InferenceStatus::ERROR);
+    }
+
+    return statuses;
+}
+
+/****************************************************************************
+ * Completion reactor
+ ****************************************************************************/
+
+CompletionReactor::CompletionReactor(bool background) :
+    epollFd(-1), wakeFd(-1), background(background), stopping(false) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        throw Exception("Failed to create epoll instance");
+    }
+
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeFd < 0) {
+        eclose(epollFd);
+        throw Exception("Failed to create eventfd");
+    }
+
+    struct epoll_event event = {};
+    event.events             = EPOLLIN;
+    event.data.fd            = wakeFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) < 0) {
+        eclose(wakeFd);
+        eclose(epollFd);
+        throw Exception("Failed to register eventfd");
+    }
+
+    if (background) {
+        thread = std::thread(&CompletionReactor::run, this);
+    }
+
+    LOG(Severity::Info) << "CompletionReactor(" << background << "). this=" << this << ", fd=" << epollFd << endl;
+}
+
+CompletionReactor::~CompletionReactor() noexcept(false) {
+    if (thread.joinable()) {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+
+        uint64_t one = 1;
+        if (::write(wakeFd, &one, sizeof(one)) < 0) {
+            LOG(Severity::Error) << "Failed to wake reactor thread" << endl;
+        }
+
+        thread.join();
+    }
+
+    // Entries still registered get their callback here, with the result if the inference has completed
+    vector<Entry> remaining;
+    deque<function<void()>> tasks;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        for (auto &it : entries) {
+            remaining.push_back(std::move(it.second));
+        }
+
+        entries.clear();
+        tasks.swap(posted);
+    }
+
+    for (auto &entry : remaining) {
+        deliver(entry, isCompleted(entry.inference->getFd()));
+    }
+
+    runTasks(tasks);
+
+    eclose(wakeFd);
+    eclose(epollFd);
+
+    LOG(Severity::Info) << "~CompletionReactor(). this=" << this << endl;
+}
+
+void CompletionReactor::post(function<void()> task) {
+    {
+        lock_guard<mutex> guard(lock);
+        posted.push_back(std::move(task));
+    }
+
+    uint64_t one = 1;
+    if (::write(wakeFd, &one, sizeof(one)) < 0) {
+        LOG(Severity::Error) << "Failed to wake reactor thread" << endl;
+    }
+}
+
+void CompletionReactor::submit(const shared_ptr<Inference> &inference, Callback callback) {
+    lock_guard<mutex> guard(lock);
+
+    int fd = inference->getFd();
+    if (entries.count(fd)) {
+        throw Exception("Inference already submitted to reactor");
+    }
+
+    struct epoll_event event = {};
+    event.events             = EPOLLIN | EPOLLERR;
+    event.data.fd            = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        throw Exception("Failed to register inference with reactor");
+    }
+
+    entries[fd] = Entry{inference, std::move(callback)};
+
+    LOG(Severity::Debug) << "CompletionReactor submit. this=" << this << ", fd=" << fd << endl;
+}
+
+size_t CompletionReactor::poll(int64_t timeoutNanos) {
+    if (background) {
+        throw Exception("Reactor is driven by its background thread");
+    }
+
+    // Round up to whole milliseconds, negative timeout waits forever
+    int timeoutMillis = timeoutNanos < 0 ? -1 : static_cast<int>((timeoutNanos + 999999) / 1000000);
+
+    return dispatch(timeoutMillis);
+}
+
+size_t CompletionReactor::getInFlight() const {
+    lock_guard<mutex> guard(lock);
+    return entries.size();
+}
+
+int CompletionReactor::getFd() const {
+    return epollFd;
+}
+
+size_t CompletionReactor::dispatch(int timeoutMillis) {
+    struct epoll_event events[64];
+
+    int count = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), timeoutMillis);
+    if (count < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+
+        throw Exception("Failed to wait for epoll event");
+    }
+
+    // Collect the completed entries and posted tasks first so the callbacks run without the lock held
+    vector<Entry> completed;
+    deque<function<void()>> tasks;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == wakeFd) {
+                uint64_t value;
+                if (::read(wakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    LOG(Severity::Warning) << "Failed to reset reactor eventfd" << endl;
+                }
+
+                continue;
+            }
+
+            auto it = entries.find(fd);
+            if (it == entries.end()) {
+                continue;
+            }
+
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            completed.push_back(std::move(it->second));
+            entries.erase(it);
+        }
+
+        tasks.swap(posted);
+    }
+
+    for (auto &entry : completed) {
+        deliver(entry, true);
+    }
+
+    runTasks(tasks);
+
+    return completed.size();
+}
+
+void CompletionReactor::runTasks(deque<function<void()>> &tasks) {
+    for (auto &task : tasks) {
+        try {
+            task();
+        } catch (std::exception &e) { LOG(Severity::Error) << "Reactor task failed: " << e.what() << endl; }
+    }
+}
+
+void CompletionReactor::deliver(Entry &entry, bool fetch) {
+    Inference &inference = *entry.inference;
+    InferenceResult result(InferenceStatus::ERROR);
+
+    // Every entry gets its callback, a failure to fetch the result is reported as ERROR
+    if (fetch) {
+        try {
+            inference.complete();
+
+            Expected<InferenceResult> fetched = inference.tryResult();
+            if (fetched) {
+                result = fetched.value();
+            } else {
+                result.status = fetched.status();
+            }
+        } catch (std::exception &e) {
+            LOG(Severity::Error) << "Failed to fetch inference result: " << e.what() << endl;
+            result = InferenceResult(InferenceStatus::ERROR);
+        }
+    }
+
+    try {
+        entry.callback(inference, result.status, result.pmuCounters, result.cycleCounter);
+    } catch (std::exception &e) {
+        LOG(Severity::Error) << "Inference completion callback failed: " << e.what() << endl;
+    }
+}
+
+void CompletionReactor::run() {
+    while (true) {
+        {
+            lock_guard<mutex> guard(lock);
+            if (stopping) {
+                break;
+            }
+        }
+
+        try {
+            dispatch(-1);
+        } catch (std::exception &e) {
+            LOG(Severity::Error) << "Reactor failed: " << e.what() << endl;
+
+            // Completions can no longer be observed, so fail the registered entries instead of abandoning them
+            vector<Entry> failed;
+
+            {
+                lock_guard<mutex> guard(lock);
+
+                for (auto &it : entries) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, it.first, nullptr);
+                    failed.push_back(std::move(it.second));
+                }
+
+                entries.clear();
+            }
+
+            for (auto &entry : failed) {
+                deliver(entry, false);
+            }
+
+            // Back off so a persistent epoll failure does not spin the thread
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    }
+}
+
+/****************************************************************************
+ * Inference scheduler
+ ****************************************************************************/
+
+ostream &operator<<(ostream &out, const InferencePriority &priority) {
+    switch (priority) {
+    case InferencePriority::CRITICAL:
+        return out << "critical";
+    case InferencePriority::HIGH:
+        return out << "high";
+    case InferencePriority::NORMAL:
+        return out << "normal";
+    case InferencePriority::LOW:
+        return out << "low";
+    }
+    throw Exception("Unknown inference priority");
+}
+
+InferenceScheduler::Class::Class() :
+    waiting(0), maxQueued(0), submitted(0), rejected(0), dispatched(0), completed(0), failed(0), deadlineMisses(0),
+    promotions(0) {}
+
+InferenceScheduler::InferenceScheduler(size_t maxInFlight, int64_t agingNanos, size_t maxQueued) :
+    maxInFlight(maxInFlight), agingNanos(agingNanos), maxQueued(maxQueued), queued(0), inFlight(0), sequence(0),
+    stopping(false), reactor(new CompletionReactor(true)) {
+    if (maxInFlight == 0) {
+        throw Exception("Scheduler must allow at least one inference in flight");
+    }
+
+    LOG(Severity::Info) << "InferenceScheduler(" << maxInFlight << ", " << agingNanos << ", " << maxQueued
+                        << "). this=" << this << endl;
+}
+
+InferenceScheduler::~InferenceScheduler() noexcept(false) {
+    vector<Job> aborted;
+
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+
+        for (auto &cls : classes) {
+            for (auto &job : cls.queue) {
+                classes[static_cast<size_t>(job.priority)].waiting--;
+                classes[static_cast<size_t>(job.priority)].failed++;
+                aborted.push_back(std::move(job));
+            }
+
+            cls.queue.clear();
+        }
+
+        queued = 0;
+    }
+
+    for (auto &job : aborted) {
+        try {
+            job.callback(nullptr, InferenceStatus::ABORTED);
+        } catch (std::exception &e) {
+            LOG(Severity::Error) << "Inference scheduler callback failed: " << e.what() << endl;
+        }
+    }
+
+    // Jobs already on the device run to completion
+    waitIdle(-1);
+
+    LOG(Severity::Info) << "~InferenceScheduler(). this=" << this << endl;
+}
+
+Expected<void>
+InferenceScheduler::submit(InferencePriority priority, int64_t deadlineNanos, Factory factory, Callback callback) {
+    size_t index = static_cast<size_t>(priority);
+    if (index >= ETHOSU_PRIORITY_COUNT) {
+        return Expected<void>::failure(EINVAL);
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        Class &cls = classes[index];
+
+        if (stopping || (maxQueued != 0 && queued >= maxQueued)) {
+            cls.rejected++;
+            return Expected<void>::failure(EBUSY, InferenceStatus::REJECTED);
+        }
+
+        // Jobs without a deadline sort after all jobs with one
+        int64_t now      = monotonicNanos();
+        int64_t deadline = deadlineNanos < 0 ? numeric_limits<int64_t>::max() : now + deadlineNanos;
+
+        cls.queue.push_back(Job{sequence++, priority, now, now, deadline, std::move(factory), std::move(callback)});
+        cls.submitted++;
+        cls.waiting++;
+        cls.maxQueued = max(cls.maxQueued, cls.waiting);
+        queued++;
+    }
+
+    dispatch();
+
+    return Expected<void>();
+}
+
+bool InferenceScheduler::waitIdle(int64_t timeoutNanos) {
+    unique_lock<mutex> guard(lock);
+    auto isIdle = [this]() { return queued == 0 && inFlight == 0; };
+
+    if (timeoutNanos < 0) {
+        idle.wait(guard, isIdle);
+        return true;
+    }
+
+    return idle.wait_for(guard, chrono::nanoseconds(timeoutNanos), isIdle);
+}
+
+size_t InferenceScheduler::getInFlight() const {
+    lock_guard<mutex> guard(lock);
+    return inFlight;
+}
+
+size_t InferenceScheduler::getQueued() const {
+    lock_guard<mutex> guard(lock);
+    return queued;
+}
+
+vector<InferenceScheduler::ClassStatistics> InferenceScheduler::getStatistics() const {
+    lock_guard<mutex> guard(lock);
+    vector<ClassStatistics> statistics;
+
+    for (size_t i = 0; i < ETHOSU_PRIORITY_COUNT; i++) {
+        const Class &cls = classes[i];
+
+        statistics.push_back(ClassStatistics{static_cast<InferencePriority>(i),
+                                             cls.waiting,
+                                             cls.maxQueued,
+                                             cls.submitted,
+                                             cls.rejected,
+                                             cls.dispatched,
+                                             cls.completed,
+                                             cls.failed,
+                                             cls.deadlineMisses,
+                                             cls.promotions,
+                                             cls.wait.getMean(),
+                                             cls.wait.getPercentile(99),
+                                             cls.wait.getMax(),
+                                             cls.latency.getPercentile(99)});
+    }
+
+    return statistics;
+}
+
+void InferenceScheduler::dispatch() {
+    while (true) {
+        Job job;
+
+        {
+            lock_guard<mutex> guard(lock);
+            if (stopping || inFlight >= maxInFlight || !next(job)) {
+                return;
+            }
+
+            inFlight++;
+        }
+
+        // Create the inference outside of the lock, it issues the kernel request
+        shared_ptr<Inference> inference;
+        try {
+            inference = job.factory();
+        } catch (std::exception &e) {
+            LOG(Severity::Warning) << "Inference scheduler factory failed: " << e.what() << endl;
+        }
+
+        if (!inference) {
+            fail(job, nullptr);
+            continue;
+        }
+
+        try {
+            auto completed = [this, job, inference](Inference &, InferenceStatus status, const vector<uint32_t> &,
+                                                    uint64_t) {
+                finish(job, inference, status);
+                dispatch();
+            };
+
+            reactor->submit(inference, completed);
+        } catch (std::exception &e) {
+            LOG(Severity::Warning) << "Inference scheduler failed to wait for inference: " << e.what() << endl;
+            fail(job, inference);
+        }
+    }
+}
+
+/*
+ * Report a job that could not be started. The callback runs from the reactor
+ * thread like any other completion, never from within submit(), where the
+ * caller may hold a lock that the callback takes.
+ */
+void InferenceScheduler::fail(const Job &job, const shared_ptr<Inference> &inference) {
+    reactor->post([this, job, inference]() {
+        finish(job, inference, InferenceStatus::ERROR);
+        dispatch();
+    });
+}
+
+bool InferenceScheduler::next(Job &job) {
+    if (queued == 0) {
+        return false;
+    }
+
+    const int64_t now = monotonicNanos();
+
+    // Promote jobs that have waited for the aging period, one class at a time
+    for (size_t i = 1; agingNanos > 0 && i < ETHOSU_PRIORITY_COUNT; i++) {
+        deque<Job> &queue = classes[i].queue;
+
+        for (auto it = queue.begin(); it != queue.end();) {
+            if (now - it->promoted < agingNanos) {
+                ++it;
+                continue;
+            }
+
+            it->promoted = now;
+            classes[static_cast<size_t>(it->priority)].promotions++;
+            classes[i - 1].queue.push_back(std::move(*it));
+            it = queue.erase(it);
+        }
+    }
+
+    // Earliest deadline first in the most urgent class with waiting jobs
+    for (size_t i = 0; i < ETHOSU_PRIORITY_COUNT; i++) {
+        Class &cls = classes[i];
+
+        if (cls.queue.empty()) {
+            continue;
+        }
+
+        /*
+         * Promoted jobs go ahead of the jobs submitted to the class, in the order
+         * they were promoted. Ordering them by deadline would let a stream of jobs
+         * with deadlines starve a promoted job without one.
+         */
+        auto earliest = min_element(cls.queue.begin(), cls.queue.end(), [i](const Job &a, const Job &b) {
+            const bool aPromoted = static_cast<size_t>(a.priority) != i;
+            const bool bPromoted = static_cast<size_t>(b.priority) != i;
+
+            if (aPromoted != bPromoted) {
+                return aPromoted;
+            }
+
+            if (aPromoted) {
+                return a.promoted < b.promoted || (a.promoted == b.promoted && a.sequence < b.sequence);
+            }
+
+            return a.deadline < b.deadline || (a.deadline == b.deadline && a.sequence < b.sequence);
+        });
+
+        job = std::move(*earliest);
+        cls.queue.erase(earliest);
+        queued--;
+
+        Class &origin = classes[static_cast<size_t>(job.priority)];
+        origin.waiting--;
+        origin.dispatched++;
+        origin.wait.record(now - job.submitted);
+
+        return true;
+    }
+
+    return false;
+}
+
+void InferenceScheduler::finish(const Job &job, const shared_ptr<Inference> &inference, InferenceStatus status) {
+    const int64_t now = monotonicNanos();
+
+    {
+        lock_guard<mutex> guard(lock);
+        Class &cls = classes[static_cast<size_t>(job.priority)];
+
+        if (status == InferenceStatus::OK) {
+            cls.completed++;
+        } else {
+            cls.failed++;
+        }
+
+        if (now > job.deadline) {
+            cls.deadlineMisses++;
+        }
+
+        cls.latency.record(now - job.submitted);
+    }
+
+    try {
+        job.callback(inference, status);
+    } catch (std::exception &e) { LOG(Severity::Error) << "Inference scheduler callback failed: " << e.what() << endl; }
+
+    {
+        lock_guard<mutex> guard(lock);
+        inFlight--;
+    }
+
+    idle.notify_all();
+}
+
+/****************************************************************************
+ * Watchdog
+ ****************************************************************************/
+
+Watchdog::Watchdog(int64_t tickNanos, size_t wheelSize, int64_t abortTimeoutNanos) :
+    tickNanos(tickNanos), abortTimeoutNanos(abortTimeoutNanos), epoch(monotonicNanos()), wheel(wheelSize), nextId(0),
+    tick(0), nextWake(INT64_MAX), watched(0), expired(0), aborted(0), failed(0), stopping(false) {
+    if (tickNanos <= 0 || wheelSize == 0) {
+        throw Exception("Watchdog tick and wheel size must be positive");
+    }
+
+    thread = std::thread(&Watchdog::run, this);
+
+    LOG(Severity::Info) << "Watchdog(" << tickNanos << ", " << wheelSize << ", " << abortTimeoutNanos
+                        << "). this=" << this << endl;
+}
+
+Watchdog::~Watchdog() noexcept(false) {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+
+    wakeup.notify_all();
+    thread.join();
+
+    LOG(Severity::Info) << "~Watchdog(). this=" << this << endl;
+}
+
+Watchdog &Watchdog::instance() {
+    static Watchdog watchdog;
+    return watchdog;
+}
+
+void Watchdog::watch(const shared_ptr<Inference> &inference, int64_t timeoutNanos, Callback callback) {
+    if (timeoutNanos < 0) {
+        return;
+    }
+
+    const int64_t now = monotonicNanos();
+    vector<Settled> settled;
+    bool earlier;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        settle(inference.get(), true, settled);
+
+        auto previous = active.find(inference.get());
+        if (previous != active.end()) {
+            wheel[previous->second->tick % wheel.size()].erase(previous->second);
+            active.erase(previous);
+        }
+
+        // An empty wheel may have been left behind by the idle thread
+        if (active.empty()) {
+            tick = currentTick(now);
+        }
+
+        // Round up, an inference is never cancelled before its deadline
+        uint64_t due = max(currentTick(now + timeoutNanos + tickNanos - 1), tick + 1);
+
+        list<Timer> &bucket = wheel[due % wheel.size()];
+        bucket.push_back(Timer{nextId++, due, inference.get(), inference, std::move(callback)});
+        active[inference.get()] = prev(bucket.end());
+        watched++;
+
+        // The thread only needs waking if it would otherwise sleep past the new deadline
+        earlier = epoch + static_cast<int64_t>(due) * tickNanos < nextWake;
+    }
+
+    if (earlier) {
+        wakeup.notify_one();
+    }
+
+    notify(settled);
+}
+
+void Watchdog::unwatch(const Inference &inference) {
+    vector<Settled> settled;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        settle(&inference, false, settled);
+
+        auto it = active.find(&inference);
+        if (it != active.end()) {
+            wheel[it->second->tick % wheel.size()].erase(it->second);
+            active.erase(it);
+        }
+    }
+
+    notify(settled);
+}
+
+int64_t Watchdog::getAbortTimeout() const {
+    return abortTimeoutNanos;
+}
+
+Watchdog::Statistics Watchdog::getStatistics() const {
+    lock_guard<mutex> guard(lock);
+
+    return Statistics{watched,
+                      expired,
+                      aborted,
+                      failed,
+                      active.size(),
+                      aborting.size(),
+                      cancelLatency.getMean(),
+                      cancelLatency.getPercentile(99),
+                      cancelLatency.getMax()};
+}
+
+uint64_t Watchdog::currentTick(int64_t now) const {
+    return static_cast<uint64_t>((now - epoch) / tickNanos);
+}
+
+int64_t Watchdog::nextWakeup(int64_t now) const {
+    int64_t wake = aborting.empty() ? INT64_MAX : now + tickNanos;
+
+    /*
+     * The first occupied bucket after the current tick is a lower bound of the
+     * earliest deadline. Its timers may be due on a later lap, which costs at
+     * most one early wakeup per lap.
+     */
+    if (!active.empty()) {
+        for (uint64_t i = 1; i <= wheel.size(); i++) {
+            if (!wheel[(tick + i) % wheel.size()].empty()) {
+                wake = min(wake, epoch + static_cast<int64_t>(tick + i) * tickNanos);
+                break;
+            }
+        }
+    }
+
+    return wake;
+}
+
+void Watchdog::run() {
+    unique_lock<mutex> guard(lock);
+
+    while (!stopping) {
+        if (active.empty() && aborting.empty()) {
+            nextWake = INT64_MAX;
+            wakeup.wait(guard);
+            continue;
+        }
+
+        const int64_t now     = monotonicNanos();
+        const uint64_t target = currentTick(now);
+        vector<Timer> due;
+        vector<Settled> settled;
+
+        while (tick < target && !active.empty()) {
+            // After a long stall one pass over the whole wheel covers every bucket
+            const bool allBuckets = target - tick >= wheel.size();
+            tick                  = allBuckets ? target : tick + 1;
+
+            for (size_t i = 0; i < wheel.size(); i++) {
+                list<Timer> &bucket = allBuckets ? wheel[i] : wheel[tick % wheel.size()];
+
+                // A bucket holds the timers of every lap around the wheel
+                for (auto it = bucket.begin(); it != bucket.end();) {
+                    if (it->tick > tick) {
+                        ++it;
+                        continue;
+                    }
+
+                    active.erase(it->key);
+                    due.push_back(std::move(*it));
+                    it = bucket.erase(it);
+                }
+
+                if (!allBuckets) {
+                    break;
+                }
+            }
+        }
+
+        for (auto &timer : due) {
+            expire(timer, settled);
+        }
+
+        follow(now, settled);
+
+        // Callbacks run, and references are released, without holding the lock
+        if (!due.empty() || !settled.empty()) {
+            guard.unlock();
+            notify(settled);
+            due.clear();
+            settled.clear();
+            guard.lock();
+            continue;
+        }
+
+        nextWake = nextWakeup(now);
+        if (nextWake != INT64_MAX) {
+            wakeup.wait_for(guard, chrono::nanoseconds(nextWake - now));
+        }
+    }
+}
+
+/*
+ * Cancel an expired inference. Called with the lock held, so that unwatch()
+ * either finds the timer or the abort that replaced it.
+ */
+void Watchdog::expire(Timer &timer, vector<Settled> &settled) {
+    shared_ptr<Inference> inference = timer.inference.lock();
+    if (!inference || isCompleted(inference->getFd())) {
+        return;
+    }
+
+    const int64_t start = monotonicNanos();
+    ethosu_uapi_cancel_inference_status uapi;
+
+    expired++;
+
+    int ret = nioctl(inference->getFd(), ETHOSU_IOCTL_INFERENCE_CANCEL, static_cast<void *>(&uapi));
+    if (ret >= 0 && uapi.status == ETHOSU_UAPI_STATUS_OK) {
+        LOG(Severity::Warning) << "Watchdog cancelled inference. inference=" << &*inference << endl;
+
+        aborting.push_back(Abort{start, timer.key, inference, std::move(timer.callback)});
+
+        return;
+    }
+
+    // The cancel request fails if the inference completed in the meantime
+    if (isCompleted(inference->getFd())) {
+        return;
+    }
+
+    LOG(Severity::Error) << "Watchdog failed to cancel inference. inference=" << &*inference << ", ret=" << ret
+                         << endl;
+
+    failed++;
+
+    if (timer.callback) {
+        settled.push_back(Settled{inference, std::move(timer.callback), readStatus(inference->getFd())});
+    }
+}
+
+/*
+ * Poll the inferences being aborted. Called with the lock held.
+ */
+void Watchdog::follow(int64_t now, vector<Settled> &settled) {
+    for (auto it = aborting.begin(); it != aborting.end();) {
+        shared_ptr<Inference> inference = it->inference.lock();
+
+        if (inference && isCompleted(inference->getFd())) {
+            InferenceStatus status = readStatus(inference->getFd());
+
+            cancelLatency.record(monotonicNanos() - it->start);
+            if (status == InferenceStatus::ABORTED) {
+                aborted++;
+            }
+
+            if (it->callback) {
+                settled.push_back(Settled{inference, std::move(it->callback), status});
+            }
+        } else if (inference && now - it->start > abortTimeoutNanos) {
+            LOG(Severity::Error) << "Watchdog timed out waiting for inference to abort. inference=" << &*inference
+                                 << endl;
+
+            failed++;
+
+            if (it->callback) {
+                settled.push_back(Settled{inference, std::move(it->callback), InferenceStatus::ABORTING});
+            }
+        } else if (inference) {
+            ++it;
+            continue;
+        }
+
+        it = aborting.erase(it);
+    }
+}
+
+/*
+ * Settle the aborts of an inference that is unwatched or watched again, so
+ * that the watchdog thread never follows a later run of it. A resubmitted
+ * inference no longer reports on the aborted run, its abort is dropped. Called
+ * with the lock held.
+ */
+void Watchdog::settle(const Inference *key, bool resubmitted, vector<Settled> &settled) {
+    for (auto it = aborting.begin(); it != aborting.end();) {
+        if (it->key != key) {
+            ++it;
+            continue;
+        }
+
+        shared_ptr<Inference> inference = it->inference.lock();
+
+        if (inference && !resubmitted && isCompleted(inference->getFd())) {
+            InferenceStatus status = readStatus(inference->getFd());
+
+            cancelLatency.record(monotonicNanos() - it->start);
+            if (status == InferenceStatus::ABORTED) {
+                aborted++;
+            }
+
+            if (it->callback) {
+                settled.push_back(Settled{inference, std::move(it->callback), status});
+            }
+        } else if (inference && !resubmitted) {
+            LOG(Severity::Error) << "Watchdog unwatched inference before it aborted. inference=" << &*inference
+                                 << endl;
+
+            failed++;
+
+            if (it->callback) {
+                settled.push_back(Settled{inference, std::move(it->callback), InferenceStatus::ABORTING});
+            }
+        }
+
+        it = aborting.erase(it);
+    }
+}
+
+void Watchdog::notify(vector<Settled> &settled) {
+    for (auto &entry : settled) {
+        try {
+            entry.callback(entry.inference, entry.status);
+        } catch (std::exception &e) { LOG(Severity::Error) << "Watchdog callback failed: " << e.what() << endl; }
+    }
+}
+
+namespace {
+/*
+ * Wait for an inference run with a timeout. The watchdog cancels the inference
+ * when the timeout expires, and the wait extends over the abort, so that the
+ * NPU is free again when a timed out invoke returns.
+ */
+Expected<void> waitInvoked(const shared_ptr<Inference> &inference, int64_t timeoutNanos) {
+    Watchdog &watchdog = Watchdog::instance();
+    int64_t waitNanos  = timeoutNanos;
+
+    if (timeoutNanos >= 0) {
+        watchdog.watch(inference, timeoutNanos);
+        waitNanos = timeoutNanos + watchdog.getAbortTimeout();
+    }
+
+    Expected<bool> timedOut = inference->tryWait(waitNanos);
+    watchdog.unwatch(*inference);
+
+    if (!timedOut) {
+        return Expected<void>::failure(timedOut.error(), timedOut.status());
+    }
+
+    if (timedOut.value()) {
+        return Expected<void>::failure(ETIMEDOUT, InferenceStatus::ABORTING);
+    }
+
+    Expected<InferenceStatus> status = inference->tryStatus();
+    if (!status) {
+        return Expected<void>::failure(status.error(), status.status());
+    }
+
+    if (status.value() == InferenceStatus::ABORTED) {
+        return Expected<void>::failure(ETIMEDOUT, InferenceStatus::ABORTED);
+    }
+
+    if (status.value() != InferenceStatus::OK) {
+        return Expected<void>::failure(0, status.value());
+    }
+
+    return Expected<void>();
+}
+} // namespace
+
+/****************************************************************************
+ * Device pool
+ ****************************************************************************/
+
+DevicePool::DevicePool() : DevicePool(discover()) {}
+
+DevicePool::DevicePool(const vector<string> &devices) {
+    if (devices.empty()) {
+        throw Exception("No Ethos-U devices found");
+    }
+
+    for (auto &path : devices) {
+        slots.push_back(Slot{path, unique_ptr<Device>(new Device(path.c_str())), nullptr, 0, 0, 0});
+    }
+
+    LOG(Severity::Info) << "DevicePool(). this=" << this << ", devices=" << slots.size() << endl;
+}
+
+DevicePool::~DevicePool() noexcept(false) {
+    LOG(Severity::Info) << "~DevicePool(). this=" << this << endl;
+}
+
+vector<string> DevicePool::discover(const string &directory) {
+    vector<pair<unsigned long, string>> found;
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        return {};
+    }
+
+    const string prefix = "ethosu";
+    while (struct dirent *entry = readdir(dir)) {
+        const string name(entry->d_name);
+
+        if (name.compare(0, prefix.size(), prefix) != 0 || name.size() == prefix.size()) {
+            continue;
+        }
+
+        const string nr = name.substr(prefix.size());
+        if (nr.find_first_not_of("0123456789") != string::npos) {
+            continue;
+        }
+
+        found.push_back(make_pair(stoul(nr), directory + "/" + name));
+    }
+
+    closedir(dir);
+
+    // Order numerically so that ethosu10 comes after ethosu2
+    sort(found.begin(), found.end());
+
+    vector<string> devices;
+    for (auto &f : found) {
+        devices.push_back(f.second);
+    }
+
+    return devices;
+}
+
+void DevicePool::loadNetwork(const string &model) {
+    ifstream stream(model, ios::binary);
+    if (!stream.is_open()) {
+        throw Exception("Failed to open model file");
+    }
+
+    stream.seekg(0, ios_base::end);
+    size_t size = stream.tellg();
+    stream.seekg(0, ios_base::beg);
+
+    // Read the model once and copy it to a buffer on each device
+    vector<char> data(size);
+    stream.read(data.data(), size);
+    if (!stream) {
+        throw Exception("Failed to read model file");
+    }
+
+    lock_guard<mutex> guard(lock);
+
+    for (auto &slot : slots) {
+        auto buffer = make_shared<Buffer>(*slot.device, size);
+        buffer->resize(size);
+        copy(data.begin(), data.end(), buffer->data());
+        slot.network = make_shared<Network>(*slot.device, buffer);
+    }
+}
+
+void DevicePool::loadNetwork(const unsigned index) {
+    lock_guard<mutex> guard(lock);
+
+    for (auto &slot : slots) {
+        slot.network = make_shared<Network>(*slot.device, index);
+    }
+}
+
+size_t DevicePool::size() const {
+    return slots.size();
+}
+
+const Device &DevicePool::getDevice(size_t index) const {
+    return *slots.at(index).device;
+}
+
+shared_ptr<Network> DevicePool::getNetwork(size_t index) const {
+    lock_guard<mutex> guard(lock);
+    return slots.at(index).network;
+}
+
+size_t DevicePool::select() const {
+    size_t best         = 0;
+    uint64_t bestFinish = UINT64_MAX;
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        // Devices without latency samples are assumed to be fast, so they get probed
+        uint64_t latency = max<uint64_t>(slots[i].averageLatencyNanos, 1);
+        uint64_t finish  = (slots[i].inFlight + 1) * latency;
+
+        if (finish < bestFinish) {
+            best       = i;
+            bestFinish = finish;
+        }
+    }
+
+    return best;
+}
+
+void DevicePool::sweep() {
+    vector<struct pollfd> pfds;
+    vector<decltype(submissions)::iterator> live;
+
+    for (auto it = submissions.begin(); it != submissions.end();) {
+        shared_ptr<Inference> inference = it->first.lock();
+
+        // A destroyed inference can no longer be completed through the pool
+        if (!inference) {
+            slots[it->second.index].inFlight--;
+            it = submissions.erase(it);
+            continue;
+        }
+
+        struct pollfd pfd;
+        pfd.fd      = inference->getFd();
+        pfd.events  = POLLIN | POLLERR;
+        pfd.revents = 0;
+        pfds.push_back(pfd);
+        live.push_back(it++);
+    }
+
+    if (pfds.empty()) {
+        return;
+    }
+
+    struct timespec tmo = {0, 0};
+    if (nppoll(pfds.data(), pfds.size(), &tmo, NULL) <= 0) {
+        return;
+    }
+
+    // Completions the pool was not told about free the device, but give no latency sample
+    for (size_t i = 0; i < pfds.size(); i++) {
+        if (pfds[i].revents) {
+            Slot &slot = slots[live[i]->second.index];
+            slot.inFlight--;
+            slot.completed++;
+            submissions.erase(live[i]);
+        }
+    }
+}
+
+shared_ptr<Inference> DevicePool::submit(const Factory &factory) {
+    size_t index;
+    shared_ptr<Network> network;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        sweep();
+
+        index   = select();
+        network = slots[index].network;
+        if (!network) {
+            throw Exception("No network loaded");
+        }
+
+        // Reserve the slot before the inference is created, which may take a while
+        slots[index].inFlight++;
+    }
+
+    shared_ptr<Inference> inference;
+    try {
+        inference = factory(network);
+    } catch (std::exception &) {
+        lock_guard<mutex> guard(lock);
+        slots[index].inFlight--;
+        throw;
+    }
+
+    lock_guard<mutex> guard(lock);
+
+    // A factory may hand out an inference again, which replaces its previous submission
+    auto it = submissions.find(inference);
+    if (it != submissions.end()) {
+        slots[it->second.index].inFlight--;
+        submissions.erase(it);
+    }
+
+    submissions[inference] = Submission{index, monotonicNanos()};
+
+    LOG(Severity::Debug) << "DevicePool submit. this=" << this << ", device=" << slots[index].path
+                         << ", inference=" << inference.get() << endl;
+
+    return inference;
+}
+
+bool DevicePool::wait(const shared_ptr<Inference> &inference, int64_t timeoutNanos) {
+    bool timedout = inference->wait(timeoutNanos);
+
+    if (!timedout) {
+        complete(inference);
+    }
+
+    return timedout;
+}
+
+void DevicePool::complete(const shared_ptr<Inference> &inference) {
+    lock_guard<mutex> guard(lock);
+
+    auto it = submissions.find(inference);
+    if (it == submissions.end()) {
+        return;
     }
 
-    static const Severity level;
-    const Severity severity;
-};
+    Slot &slot       = slots[it->second.index];
+    uint64_t latency = monotonicNanos() - it->second.start;
 
-const Severity Log::level = Log::getLogLevel();
+    // Exponentially weighted moving average with a weight of 1/8
+    if (slot.completed == 0) {
+        slot.averageLatencyNanos = latency;
+    } else {
+        slot.averageLatencyNanos = (slot.averageLatencyNanos * 7 + latency) / 8;
+    }
 
-} // namespace
+    slot.inFlight--;
+    slot.completed++;
+    submissions.erase(it);
+}
 
-namespace EthosU {
-__attribute__((weak)) int eioctl(int fd, unsigned long cmd, void *data = nullptr) {
-    int ret = ::ioctl(fd, cmd, data);
-    if (ret < 0) {
-        throw EthosU::Exception("IOCTL failed");
-    }
+vector<DevicePool::DeviceStatistics> DevicePool::getStatistics() const {
+    lock_guard<mutex> guard(lock);
+    vector<DeviceStatistics> statistics;
 
-    Log(Severity::Debug) << "ioctl. fd=" << fd << ", cmd=" << setw(8) << setfill('0') << hex << cmd << ", ret=" << ret
-                         << endl;
+    for (auto &slot : slots) {
+        statistics.push_back(DeviceStatistics{slot.path, slot.inFlight, slot.completed, slot.averageLatencyNanos});
+    }
 
-    return ret;
+    return statistics;
 }
 
-__attribute__((weak)) int eopen(const char *pathname, int flags) {
-    int fd = ::open(pathname, flags);
-    if (fd < 0) {
-        throw Exception("Failed to open device");
-    }
+/****************************************************************************
+ * Network cache
+ ****************************************************************************/
 
-    Log(Severity::Debug) << "open. fd=" << fd << ", path='" << pathname << "', flags=" << flags << endl;
+namespace {
+uint64_t fnv1a(const char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
 
-    return fd;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
 }
+} // namespace
 
-__attribute__((weak)) int
-eppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask) {
-    int result = ::ppoll(fds, nfds, tmo_p, sigmask);
-    if (result < 0) {
-        throw Exception("Failed to wait for ppoll event or signal");
-    }
+NetworkCache::NetworkCache() :
+    budget(size_t(DEFAULT_NETWORK_CACHE_SIZE_OF_MB) << 20), bytes(0), hits(0), misses(0), evictions(0) {}
 
-    return result;
+NetworkCache &NetworkCache::instance() {
+    static NetworkCache cache;
+    return cache;
 }
 
-__attribute__((weak)) int eclose(int fd) {
-    Log(Severity::Debug) << "close. fd=" << fd << endl;
+shared_ptr<Device> NetworkCache::getDevice(const string &path) {
+    lock_guard<mutex> guard(lock);
 
-    int result = ::close(fd);
-    if (result < 0) {
-        throw Exception("Failed to close file");
+    shared_ptr<Device> device = devices[path].lock();
+    if (!device) {
+        device        = make_shared<Device>(path.c_str());
+        devices[path] = device;
     }
 
-    return result;
+    return device;
 }
-__attribute((weak)) void *emmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
-    void *ptr = ::mmap(addr, length, prot, flags, fd, offset);
-    if (ptr == MAP_FAILED) {
-        throw Exception("Failed to mmap file");
+
+shared_ptr<Network> NetworkCache::lookup(const string &key) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+        return nullptr;
     }
 
-    Log(Severity::Debug) << "map. fd=" << fd << ", addr=" << setfill('0') << addr << ", length=" << dec << length
-                         << ", ptr=" << hex << ptr << endl;
+    // Move to the front of the LRU list
+    entries.splice(entries.begin(), entries, it->second);
+    hits++;
 
-    return ptr;
+    return it->second->network;
 }
 
-__attribute__((weak)) int emunmap(void *addr, size_t length) {
-    Log(Severity::Debug) << "unmap. addr=" << setfill('0') << addr << ", length=" << dec << length << endl;
+shared_ptr<Network> NetworkCache::getNetwork(const string &devicePath, const string &model) {
+    struct stat st;
+    if (stat(model.c_str(), &st) < 0) {
+        throw Exception("Failed to stat model file");
+    }
 
-    int result = ::munmap(addr, length);
-    if (result < 0) {
-        throw Exception("Failed to munmap file");
+    ostringstream fileKey;
+    fileKey << devicePath << '\0' << model << '\0' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec << '\0'
+            << st.st_size;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        auto file = files.find(fileKey.str());
+        if (file != files.end()) {
+            if (auto network = lookup(file->second)) {
+                return network;
+            }
+        }
     }
 
-    return result;
-}
+    // Read the model outside of the lock, straight into the network buffer
+    shared_ptr<Device> device = getDevice(devicePath);
 
-} // namespace EthosU
+    ifstream stream(model, ios::binary);
+    if (!stream.is_open()) {
+        throw Exception("Failed to open model file");
+    }
 
-namespace EthosU {
+    size_t size = st.st_size;
+    auto buffer = make_shared<Buffer>(*device, size);
+    buffer->resize(size);
+    stream.read(buffer->data(), size);
+    if (!stream) {
+        throw Exception("Failed to read model file");
+    }
 
-/****************************************************************************
- * Exception
- ****************************************************************************/
+    ostringstream contentKey;
+    contentKey << devicePath << '\0' << hex << fnv1a(buffer->data(), size) << '\0' << dec << size;
 
-Exception::Exception(const char *msg) : msg(msg) {}
+    vector<shared_ptr<Network>> evicted;
+    lock_guard<mutex> guard(lock);
 
-Exception::~Exception() throw() {}
+    // The same content may have been loaded through another path. The hash only
+    // selects the candidate, the model is only shared if the bytes are identical.
+    auto cached = index.find(contentKey.str());
+    if (cached != index.end()) {
+        shared_ptr<Buffer> cachedBuffer = cached->second->network->getBuffer();
 
-const char *Exception::what() const throw() {
-    return msg.c_str();
-}
+        if (cachedBuffer && cachedBuffer->size() == size && memcmp(cachedBuffer->data(), buffer->data(), size) == 0) {
+            files[fileKey.str()] = contentKey.str();
+            return lookup(contentKey.str());
+        }
 
-/****************************************************************************
- * Semantic Version
- ****************************************************************************/
+        LOG(Severity::Warning) << "NetworkCache hash collision, not caching. model='" << model << "'" << endl;
+    }
 
-bool SemanticVersion::operator==(const SemanticVersion &other) {
-    return other.major == major && other.minor == minor && other.patch == patch;
-}
+    // The network holds a reference to the device, so keep the device alive with it
+    shared_ptr<Network> network(new Network(*device, buffer), [device](Network *n) {
+        try {
+            delete n;
+        } catch (std::exception &e) { LOG(Severity::Error) << "Failed to free network: " << e.what() << endl; }
+    });
+
+    // A colliding model is handed out without being cached or remembered by path
+    if (cached != index.end()) {
+        misses++;
+        return network;
+    }
 
-bool SemanticVersion::operator<(const SemanticVersion &other) {
-    if (other.major > major)
-        return true;
-    if (other.minor > minor)
-        return true;
-    return other.patch > patch;
+    files[fileKey.str()] = contentKey.str();
+
+    entries.push_front(Entry{contentKey.str(), size, network});
+    index[contentKey.str()] = entries.begin();
+    bytes += size;
+    misses++;
+
+    evict(evicted);
+
+    LOG(Severity::Info) << "NetworkCache insert. model='" << model << "', size=" << size << ", bytes=" << bytes
+                        << endl;
+
+    return network;
 }
 
-bool SemanticVersion::operator<=(const SemanticVersion &other) {
-    return *this < other || *this == other;
+void NetworkCache::evict(vector<shared_ptr<Network>> &evicted) {
+    // Always keep the most recently used network, even if it exceeds the budget
+    while (bytes > budget && entries.size() > 1) {
+        Entry &entry = entries.back();
+
+        bytes -= entry.size;
+        evictions++;
+        index.erase(entry.key);
+        evicted.push_back(entry.network);
+        entries.pop_back();
+    }
+
+    // Forget file keys that refer to evicted content
+    for (auto it = files.begin(); it != files.end();) {
+        if (index.count(it->second)) {
+            ++it;
+        } else {
+            it = files.erase(it);
+        }
+    }
 }
 
-bool SemanticVersion::operator!=(const SemanticVersion &other) {
-    return !(*this == other);
+void NetworkCache::setBudget(size_t _budget) {
+    vector<shared_ptr<Network>> evicted;
+    lock_guard<mutex> guard(lock);
+
+    budget = _budget;
+    evict(evicted);
 }
 
-bool SemanticVersion::operator>(const SemanticVersion &other) {
-    return !(*this <= other);
+size_t NetworkCache::getBudget() const {
+    lock_guard<mutex> guard(lock);
+    return budget;
 }
 
-bool SemanticVersion::operator>=(const SemanticVersion &other) {
-    return !(*this < other);
+NetworkCache::Statistics NetworkCache::getStatistics() const {
+    lock_guard<mutex> guard(lock);
+    return Statistics{hits, misses, evictions, entries.size(), bytes};
 }
 
-ostream &operator<<(ostream &out, const SemanticVersion &v) {
-    return out << "{ major=" << unsigned(v.major) << ", minor=" << unsigned(v.minor) << ", patch=" << unsigned(v.patch)
-               << " }";
+void NetworkCache::clear() {
+    list<Entry> cleared;
+    lock_guard<mutex> guard(lock);
+
+    cleared.swap(entries);
+    index.clear();
+    files.clear();
+    bytes = 0;
 }
 
 /****************************************************************************
- * Device
+ * Interpreter
  ****************************************************************************/
-Device::Device(const char *device) {
-    fd = eopen(device, O_RDWR | O_NONBLOCK);
-    Log(Severity::Info) << "Device(\"" << device << "\"). this=" << this << ", fd=" << fd << endl;
+InterpreterOptions InterpreterOptions::fastStart() {
+    InterpreterOptions options;
+    options.printCapabilities = false;
+    options.parallelLoad      = true;
+    options.arenaAllocation   = ArenaAllocation::BACKGROUND;
+    return options;
 }
 
-Device::~Device() noexcept(false) {
-    eclose(fd);
-    Log(Severity::Info) << "~Device(). this=" << this << endl;
-}
+ostream &operator<<(ostream &out, const InterpreterStartup &startup) {
+    const double ms = 1000000.0;
 
-int Device::ioctl(unsigned long cmd, void *data) const {
-    return eioctl(fd, cmd, data);
-}
+    ios_base::fmtflags flags = out.flags();
+    streamsize precision     = out.precision();
 
-Capabilities Device::capabilities() const {
-    ethosu_uapi_device_capabilities uapi;
-    (void)eioctl(fd, ETHOSU_IOCTL_CAPABILITIES_REQ, static_cast<void *>(&uapi));
+    out << fixed << setprecision(3) << "Startup:" << endl
+        << "\tdevice: " << startup.device / ms << " ms" << endl
+        << "\tcapabilities: " << startup.capabilities / ms << " ms" << endl
+        << "\tnetwork: " << startup.network / ms << " ms" << endl
+        << "\tarena: " << startup.arena / ms << " ms" << endl
+        << "\tconstructor: " << startup.constructor / ms << " ms" << endl;
 
-    Capabilities capabilities(
-        HardwareId(uapi.hw_id.version_status,
-                   SemanticVersion(uapi.hw_id.version_major, uapi.hw_id.version_minor),
-                   SemanticVersion(uapi.hw_id.product_major),
-                   SemanticVersion(uapi.hw_id.arch_major_rev, uapi.hw_id.arch_minor_rev, uapi.hw_id.arch_patch_rev)),
-        HardwareConfiguration(uapi.hw_cfg.macs_per_cc, uapi.hw_cfg.cmd_stream_version, bool(uapi.hw_cfg.custom_dma)),
-        SemanticVersion(uapi.driver_major_rev, uapi.driver_minor_rev, uapi.driver_patch_rev));
-    return capabilities;
+    out.flags(flags);
+    out.precision(precision);
+
+    return out;
 }
 
-/****************************************************************************
- * Buffer
- ****************************************************************************/
+Interpreter::Interpreter(const char *model, const char *_device, int64_t _arenaSizeOfMB) :
+    Interpreter(model, _device, _arenaSizeOfMB, InterpreterOptions()) {}
+
+Interpreter::Interpreter(const char *model,
+                         const char *_device,
+                         int64_t _arenaSizeOfMB,
+                         const InterpreterOptions &_options) :
+    arenaSizeOfMB(_arenaSizeOfMB),
+    enableCycleCounter(false), options(_options), startup() {
+    const int64_t begin = monotonicNanos();
+    const string devicePath(_device);
+    const string modelPath(model);
+
+    int64_t start = begin;
+    device        = NetworkCache::instance().getDevice(devicePath);
+    startup.device = monotonicNanos() - start;
+
+    // Read the model and create the network while the rest of the device is set up
+    auto loadNetwork = [this, devicePath, modelPath]() {
+        int64_t start   = monotonicNanos();
+        auto network    = NetworkCache::instance().getNetwork(devicePath, modelPath);
+        startup.network = monotonicNanos() - start;
+        return network;
+    };
+
+    future<shared_ptr<Network>> loading;
+    if (options.parallelLoad) {
+        loading = async(launch::async, loadNetwork);
+    }
 
-Buffer::Buffer(const Device &device, const size_t capacity) : fd(-1), dataPtr(nullptr), dataCapacity(capacity) {
-    ethosu_uapi_buffer_create uapi = {static_cast<uint32_t>(dataCapacity)};
-    fd                             = device.ioctl(ETHOSU_IOCTL_BUFFER_CREATE, static_cast<void *>(&uapi));
+    if (options.printCapabilities) {
+        start = monotonicNanos();
 
-    void *d;
-    try {
-        d = emmap(nullptr, dataCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    } catch (std::exception &e) {
-        try {
-            eclose(fd);
-        } catch (...) { std::throw_with_nested(e); }
-        throw;
-    }
+        //Send capabilities request
+        Capabilities capabilities = device->capabilities();
 
-    dataPtr = reinterpret_cast<char *>(d);
+        cout << "Capabilities:" << endl
+             << "\tversion_status:" << unsigned(capabilities.hwId.versionStatus) << endl
+             << "\tversion:" << capabilities.hwId.version << endl
+             << "\tproduct:" << capabilities.hwId.product << endl
+             << "\tarchitecture:" << capabilities.hwId.architecture << endl
+             << "\tdriver:" << capabilities.driver << endl
+             << "\tmacs_per_cc:" << unsigned(capabilities.hwCfg.macsPerClockCycle) << endl
+             << "\tcmd_stream_version:" << unsigned(capabilities.hwCfg.cmdStreamVersion) << endl
+             << "\tcustom_dma:" << std::boolalpha << capabilities.hwCfg.customDma << endl;
 
-    Log(Severity::Info) << "Buffer(" << &device << ", " << dec << capacity << "), this=" << this << ", fd=" << fd
-                        << ", dataPtr=" << static_cast<void *>(dataPtr) << endl;
-}
+        startup.capabilities = monotonicNanos() - start;
+    }
 
-Buffer::~Buffer() noexcept(false) {
-    try {
-        emunmap(dataPtr, dataCapacity);
-    } catch (std::exception &e) {
-        try {
-            eclose(fd);
-        } catch (...) { std::throw_with_nested(e); }
-        throw;
+    // Init tensor arena buffer, lazy and background allocation only create the slot
+    SetPipelineDepth(1);
+
+    // Init network, shared with other interpreters loading the same model
+    network = options.parallelLoad ? loading.get() : loadNetwork();
+    if (!network->isVelaModel()) {
+         throw Exception("Only support models compiled by vela.");
     }
 
-    eclose(fd);
+    if (options.arenaAllocation == ArenaAllocation::BACKGROUND) {
+        arenasReady = async(launch::async, [this]() {
+            for (size_t i = 0; i < slots.size(); i++) {
+                int64_t start = monotonicNanos();
+                slots[i].arena = device->getArenaPool().acquire(arenaSizeOfMB << 20);
+                startup.arena += monotonicNanos() - start;
+            }
+        });
+    }
 
-    Log(Severity::Info) << "~Buffer(). this=" << this << endl;
+    startup.constructor = monotonicNanos() - begin;
 }
 
-size_t Buffer::capacity() const {
-    return dataCapacity;
+InterpreterStartup Interpreter::GetStartupTiming() {
+    waitForArenas();
+    return startup;
 }
 
-void Buffer::clear() const {
-    resize(0, 0);
-}
+Buffer &Interpreter::arena(size_t index) {
+    waitForArenas();
 
-char *Buffer::data() const {
-    return dataPtr + offset();
-}
+    Slot &slot = slots.at(index);
+    if (!slot.arena) {
+        int64_t start = monotonicNanos();
+        slot.arena    = device->getArenaPool().acquire(arenaSizeOfMB << 20);
+        startup.arena += monotonicNanos() - start;
+    }
 
-void Buffer::resize(size_t size, size_t offset) const {
-    ethosu_uapi_buffer uapi;
-    uapi.offset = offset;
-    uapi.size   = size;
-    eioctl(fd, ETHOSU_IOCTL_BUFFER_SET, static_cast<void *>(&uapi));
+    return *slot.arena;
 }
 
-size_t Buffer::offset() const {
-    ethosu_uapi_buffer uapi;
-    eioctl(fd, ETHOSU_IOCTL_BUFFER_GET, static_cast<void *>(&uapi));
-    return uapi.offset;
+void Interpreter::waitForArenas() {
+    // Rethrows the exception of a failed background allocation
+    if (arenasReady.valid()) {
+        arenasReady.get();
+    }
 }
 
-size_t Buffer::size() const {
-    ethosu_uapi_buffer uapi;
-    eioctl(fd, ETHOSU_IOCTL_BUFFER_GET, static_cast<void *>(&uapi));
-    return uapi.size;
-}
+void Interpreter::SetPmuCycleCounters(vector<uint8_t> counters, bool cycleCounter) {
+    if (counters.size() != ETHOSU_PMU_EVENT_MAX){
+        throw Exception("PMU event count is invalid.");
+    }
 
-int Buffer::getFd() const {
-    return fd;
+    pmuCounters = counters;
+    enableCycleCounter = cycleCounter;
+
+    for (auto &slot : slots) {
+        slot.pmuConfigChanged = true;
+    }
 }
 
-/****************************************************************************
- * Network
- ****************************************************************************/
+Expected<void> Interpreter::start(size_t index) {
+    Slot &slot = slots[index];
 
-Network::Network(const Device &device, shared_ptr<Buffer> &buffer) : device(device), fd(-1), buffer(buffer) {
-    // Create buffer handle
-    ethosu_uapi_network_create uapi;
-    uapi.type = ETHOSU_UAPI_NETWORK_BUFFER;
-    uapi.fd   = buffer->getFd();
-    fd        = device.ioctl(ETHOSU_IOCTL_NETWORK_CREATE, static_cast<void *>(&uapi));
-    try {
-        collectNetworkInfo();
-    } catch (std::exception &e) {
-        try {
-            eclose(fd);
-        } catch (...) { std::throw_with_nested(e); }
-        throw;
+    // Reuse the prepared inference unless the PMU configuration has changed
+    if (slot.inference && !slot.pmuConfigChanged) {
+        return slot.inference->tryResubmit();
     }
 
-    Log(Severity::Info) << "Network(" << &device << ", " << &*buffer << "), this=" << this << ", fd=" << fd << endl;
-}
+    // A new inference must not share the arena with a run that is still aborting
+    if (slot.inference && !isCompleted(slot.inference->getFd())) {
+        return Expected<void>::failure(EBUSY, InferenceStatus::RUNNING);
+    }
 
-Network::Network(const Device &device, const unsigned index) : device(device), fd(-1) {
-    // Create buffer handle
-    ethosu_uapi_network_create uapi;
-    uapi.type  = ETHOSU_UAPI_NETWORK_INDEX;
-    uapi.index = index;
-    fd         = device.ioctl(ETHOSU_IOCTL_NETWORK_CREATE, static_cast<void *>(&uapi));
     try {
-        collectNetworkInfo();
-    } catch (std::exception &e) {
-        try {
-            eclose(fd);
-        } catch (...) { std::throw_with_nested(e); }
-        throw;
+        arena(index);
+    } catch (Exception &) {
+        return Expected<void>::failure(ENOMEM);
     }
 
-    Log(Severity::Info) << "Network(" << &device << ", " << index << "), this=" << this << ", fd=" << fd << endl;
-}
+    vector<uint32_t> counters(pmuCounters.begin(), pmuCounters.end());
+    Expected<shared_ptr<Inference>> created = Inference::tryCreate(network, slot.arena, counters, enableCycleCounter);
+    if (!created) {
+        return Expected<void>::failure(created.error(), created.status());
+    }
 
-void Network::collectNetworkInfo() {
-    ethosu_uapi_network_info info;
-    ioctl(ETHOSU_IOCTL_NETWORK_INFO, static_cast<void *>(&info));
+    slot.inference        = created.value();
+    slot.pmuConfigChanged = false;
 
-    _isVelaModel = info.is_vela;
+    return Expected<void>();
+}
 
-    for (uint32_t i = 0; i < info.ifm_count; i++) {
-        ifmDims.push_back(info.ifm_size[i]);
-        ifmTypes.push_back(info.ifm_types[i]);
-        ifmDataOffset.push_back(info.ifm_offset[i]);
+void Interpreter::Invoke(int64_t timeoutNanos) {
+    Expected<void> invoked = TryInvoke(timeoutNanos);
+    if (!invoked) {
+        if (invoked.error() == EBUSY && invoked.status() == InferenceStatus::RUNNING) {
+            throw Exception("Previous inference is still running.");
+        }
 
-        std::vector<size_t> shape;
-        for (uint32_t j = 0; j < info.ifm_dims[i]; j++) {
-            shape.push_back(info.ifm_shapes[i][j]);
+        if (invoked.error() == EBUSY) {
+            throw Exception("Slot 0 is in use by the pipeline.");
         }
-        ifmShapes.push_back(shape);
+
+        if (invoked.error() == ETIMEDOUT) {
+            throw Exception("Inference timed out and was cancelled.");
+        }
+
+        throw Exception(errorMessage("Failed to invoke", invoked.error()).c_str());
     }
+}
 
-    for (uint32_t i = 0; i < info.ofm_count; i++) {
-        ofmDims.push_back(info.ofm_size[i]);
-        ofmTypes.push_back(info.ofm_types[i]);
-        ofmDataOffset.push_back(info.ofm_offset[i]);
+Expected<void> Interpreter::TryInvoke(int64_t timeoutNanos) {
+    if (slots[0].state != SlotState::FREE) {
+        return Expected<void>::failure(EBUSY);
+    }
 
-        std::vector<size_t> shape;
-        for (uint32_t j = 0; j < info.ofm_dims[i]; j++) {
-            shape.push_back(info.ofm_shapes[i][j]);
+    Expected<void> started = start(0);
+    if (!started) {
+        return started;
+    }
+
+    inference = slots[0].inference;
+
+    return waitInvoked(inference, timeoutNanos);
+}
+
+void Interpreter::SetPipelineDepth(size_t depth) {
+    if (depth == 0) {
+        throw Exception("Pipeline depth must be at least one.");
+    }
+
+    for (auto &slot : slots) {
+        if (slot.state != SlotState::FREE) {
+            throw Exception("Pipeline slots are in use.");
         }
-        ofmShapes.push_back(shape);
     }
-}
 
-Network::~Network() noexcept(false) {
-    eclose(fd);
-    Log(Severity::Info) << "~Network(). this=" << this << endl;
-}
+    waitForArenas();
 
-int Network::ioctl(unsigned long cmd, void *data) {
-    return eioctl(fd, cmd, data);
+    // Arenas of removed slots are returned to the pool of the device
+    slots.resize(min(depth, slots.size()));
+    while (slots.size() < depth) {
+        slots.push_back(Slot{nullptr, nullptr, SlotState::FREE, true});
+
+        if (options.arenaAllocation == ArenaAllocation::EAGER) {
+            arena(slots.size() - 1);
+        }
+    }
 }
 
-shared_ptr<Buffer> Network::getBuffer() {
-    return buffer;
+size_t Interpreter::GetPipelineDepth() const {
+    return slots.size();
 }
 
-const std::vector<size_t> &Network::getIfmDims() const {
-    return ifmDims;
+size_t Interpreter::BeginFill() {
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].state == SlotState::FREE) {
+            slots[i].state = SlotState::FILLING;
+            return i;
+        }
+    }
+
+    throw Exception("No free pipeline slot, collect a submitted slot first.");
 }
 
-size_t Network::getIfmSize() const {
-    size_t size = 0;
+void Interpreter::Submit(size_t index) {
+    if (slots.at(index).state != SlotState::FILLING) {
+        throw Exception("Pipeline slot is not being filled.");
+    }
 
-    for (auto s : ifmDims) {
-        size += s;
+    Expected<void> started = start(index);
+    if (!started) {
+        throw Exception(errorMessage("Failed to submit inference", started.error()).c_str());
     }
 
-    return size;
+    slots[index].state = SlotState::RUNNING;
+    running.push_back(index);
 }
 
-const std::vector<size_t> &Network::getOfmDims() const {
-    return ofmDims;
-}
+size_t Interpreter::Collect(int64_t timeoutNanos) {
+    if (running.empty()) {
+        throw Exception("No submitted pipeline slot.");
+    }
 
-size_t Network::getOfmSize() const {
-    size_t size = 0;
+    // Slots complete in submission order, so the outputs stay in frame order
+    size_t index = running.front();
+    Slot &slot   = slots[index];
 
-    for (auto s : ofmDims) {
-        size += s;
+    if (slot.inference->wait(timeoutNanos)) {
+        throw Exception("Timed out waiting for pipeline slot.");
     }
 
-    return size;
-}
+    running.pop_front();
+    inference = slot.inference;
 
-size_t Network::getInputCount() const {
-    return ifmTypes.size();
-}
+    if (inference->status() != InferenceStatus::OK) {
+        slot.state = SlotState::FREE;
+        throw Exception("Failed to invoke.");
+    }
 
-size_t Network::getOutputCount() const {
-    return ofmTypes.size();
-}
+    slot.state = SlotState::DRAINING;
 
-int32_t Network::getInputDataOffset(int index){
-    if (index >= ifmDataOffset.size()){
-        throw Exception("Invalid input index or non vela model");
-    }
-    return ifmDataOffset[index];
+    return index;
 }
 
-int32_t Network::getOutputDataOffset(int index){
-    if (index >= ofmDataOffset.size()){
-        throw Exception("Invalid output index or non vela model");
+void Interpreter::Release(size_t index) {
+    if (slots.at(index).state != SlotState::DRAINING) {
+        throw Exception("Pipeline slot has not been collected.");
     }
-    return ofmDataOffset[index];
-}
 
-const std::vector<std::vector<size_t>> &Network::getIfmShapes() const {
-    return ifmShapes;
+    slots[index].state = SlotState::FREE;
 }
 
-const std::vector<std::vector<size_t>> &Network::getOfmShapes() const {
-    return ofmShapes;
+std::vector<uint32_t> Interpreter::GetPmuCounters() {
+    return inference->getPmuCounters();
 }
 
-const std::vector<int> &Network::getIfmTypes() const {
-    return ifmTypes;
+uint64_t Interpreter::GetCycleCounter() {
+    return inference->getCycleCounter();
 }
 
-const std::vector<int> &Network::getOfmTypes() const {
-    return ofmTypes;
+namespace {
+std::vector<TensorInfo> tensorInfo(const vector<int> &types, const vector<vector<size_t>> &shapes, size_t count) {
+    std::vector<TensorInfo> ret;
+
+    for (size_t i = 0; i < count; i++) {
+        ret.push_back(TensorInfo{types[i], shapes[i]});
+    }
+
+    return ret;
 }
+} // namespace
 
-const Device &Network::getDevice() const {
-    return device;
+std::vector<TensorInfo> Interpreter::GetInputInfo() {
+    return tensorInfo(network->getIfmTypes(), network->getIfmShapes(), network->getInputCount());
 }
 
-bool Network::isVelaModel() const {
-    return _isVelaModel;
+std::vector<TensorInfo> Interpreter::GetOutputInfo(){
+    return tensorInfo(network->getOfmTypes(), network->getOfmShapes(), network->getOutputCount());
 }
 
 /****************************************************************************
- * Inference
+ * Interpreter pool
  ****************************************************************************/
 
-ostream &operator<<(ostream &out, const InferenceStatus &status) {
-    switch (status) {
-    case InferenceStatus::OK:
-        return out << "ok";
-    case InferenceStatus::ERROR:
-        return out << "error";
-    case InferenceStatus::RUNNING:
-        return out << "running";
-    case InferenceStatus::REJECTED:
-        return out << "rejected";
-    case InferenceStatus::ABORTED:
-        return out << "aborted";
-    case InferenceStatus::ABORTING:
-        return out << "aborting";
+InterpreterPool::Context::Context(const shared_ptr<Device> &device,
+                                  const shared_ptr<Network> &network,
+                                  const shared_ptr<Buffer> &arena) :
+    device(device),
+    network(network), arena(arena), pmuCounters(ETHOSU_PMU_EVENT_MAX, 0), enableCycleCounter(false),
+    pmuConfigChanged(true) {}
+
+void InterpreterPool::Context::SetPmuCycleCounters(vector<uint8_t> counters, bool cycleCounter) {
+    if (counters.size() != ETHOSU_PMU_EVENT_MAX) {
+        throw Exception("PMU event count is invalid.");
     }
-    throw Exception("Unknown inference status");
+
+    pmuCounters        = counters;
+    enableCycleCounter = cycleCounter;
+    pmuConfigChanged   = true;
 }
 
-Inference::~Inference() noexcept(false) {
-    eclose(fd);
-    Log(Severity::Info) << "~Inference(). this=" << this << endl;
+std::vector<uint32_t> InterpreterPool::Context::GetPmuCounters() {
+    return inference->getPmuCounters();
 }
 
-void Inference::create(std::vector<uint32_t> &counterConfigs, bool cycleCounterEnable = false) {
-    ethosu_uapi_inference_create uapi;
+uint64_t InterpreterPool::Context::GetCycleCounter() {
+    return inference->getCycleCounter();
+}
 
-    if (ifmBuffers.size() > ETHOSU_FD_MAX) {
-        throw Exception("IFM buffer overflow");
-    }
+void InterpreterPool::Context::Invoke(int64_t timeoutNanos) {
+    Expected<void> invoked = TryInvoke(timeoutNanos);
+    if (!invoked) {
+        if (invoked.error() == EBUSY) {
+            throw Exception("Previous inference is still running.");
+        }
 
-    if (ofmBuffers.size() > ETHOSU_FD_MAX) {
-        throw Exception("OFM buffer overflow");
+        if (invoked.error() == ETIMEDOUT) {
+            throw Exception("Inference timed out and was cancelled.");
+        }
+
+        throw Exception(errorMessage("Failed to invoke", invoked.error()).c_str());
     }
+}
 
-    if (counterConfigs.size() != ETHOSU_PMU_EVENT_MAX) {
-        throw Exception("Wrong size of counter configurations");
+Expected<void> InterpreterPool::Context::TryInvoke(int64_t timeoutNanos) {
+    // Reuse the prepared inference unless the PMU configuration has changed
+    if (inference && !pmuConfigChanged) {
+        Expected<void> resubmitted = inference->tryResubmit();
+        if (!resubmitted) {
+            return resubmitted;
+        }
+    } else {
+        // A new inference must not share the arena with a run that is still aborting
+        if (inference && !isCompleted(inference->getFd())) {
+            return Expected<void>::failure(EBUSY, InferenceStatus::RUNNING);
+        }
+
+        vector<uint32_t> counters(pmuCounters.begin(), pmuCounters.end());
+        Expected<shared_ptr<Inference>> created = Inference::tryCreate(network, arena, counters, enableCycleCounter);
+        if (!created) {
+            return Expected<void>::failure(created.error(), created.status());
+        }
+
+        inference        = created.value();
+        pmuConfigChanged = false;
     }
 
-    uapi.ifm_count = 0;
-    uapi.ifm_fd[uapi.ifm_count++] = arenaBuffer->getFd();
-    for (auto it : ifmBuffers) {
-        uapi.ifm_fd[uapi.ifm_count++] = it->getFd();
+    return waitInvoked(inference, timeoutNanos);
+}
+
+struct InterpreterPool::State {
+    mutex lock;
+    condition_variable available;
+    vector<unique_ptr<Context>> idle;
+};
+
+InterpreterPool::InterpreterPool(const char *model, size_t size, const char *_device, int64_t arenaSizeOfMB) :
+    size(size), state(make_shared<State>()) {
+    if (size == 0) {
+        throw Exception("Interpreter pool size must be at least one.");
     }
 
-    uapi.ofm_count = 0;
-    for (auto it : ofmBuffers) {
-        uapi.ofm_fd[uapi.ofm_count++] = it->getFd();
+    // The network, and with it the model buffer, is shared by all contexts
+    device  = NetworkCache::instance().getDevice(_device);
+    network = NetworkCache::instance().getNetwork(_device, model);
+    if (!network->isVelaModel()) {
+        throw Exception("Only support models compiled by vela.");
     }
 
-    for (int i = 0; i < ETHOSU_PMU_EVENT_MAX; i++) {
-        uapi.pmu_config.events[i] = counterConfigs[i];
+    for (size_t i = 0; i < size; i++) {
+        shared_ptr<Buffer> arena = device->getArenaPool().acquire(arenaSizeOfMB << 20);
+        state->idle.emplace_back(new Context(device, network, arena));
     }
 
-    uapi.pmu_config.cycle_count = cycleCounterEnable;
+    LOG(Severity::Info) << "InterpreterPool(\"" << model << "\", " << size << "). this=" << this << endl;
+}
 
-    fd = network->ioctl(ETHOSU_IOCTL_INFERENCE_CREATE, static_cast<void *>(&uapi));
+InterpreterPool::~InterpreterPool() noexcept(false) {
+    // Contexts still checked out are freed when their last reference is dropped
+    vector<unique_ptr<Context>> idle;
 
-    Log(Severity::Info) << "Inference(" << &*network << "), this=" << this << ", fd=" << fd << endl;
-}
+    {
+        lock_guard<mutex> guard(state->lock);
+        idle.swap(state->idle);
+    }
 
-std::vector<uint32_t> Inference::initializeCounterConfig() {
-    return std::vector<uint32_t>(ETHOSU_PMU_EVENT_MAX, 0);
+    LOG(Severity::Info) << "~InterpreterPool(). this=" << this << endl;
 }
 
-uint32_t Inference::getMaxPmuEventCounters() {
-    return ETHOSU_PMU_EVENT_MAX;
-}
+shared_ptr<InterpreterPool::Context> InterpreterPool::Checkout(int64_t timeoutNanos) {
+    unique_ptr<Context> context;
 
-bool Inference::wait(int64_t timeoutNanos) const {
-    struct pollfd pfd;
-    pfd.fd      = fd;
-    pfd.events  = POLLIN | POLLERR;
-    pfd.revents = 0;
+    {
+        unique_lock<mutex> guard(state->lock);
+        State &s   = *state;
+        auto ready = [&s] { return !s.idle.empty(); };
 
-    // if timeout negative wait forever
-    if (timeoutNanos < 0) {
-        return eppoll(&pfd, 1, NULL, NULL);
-    }
+        if (timeoutNanos < 0) {
+            state->available.wait(guard, ready);
+        } else if (!state->available.wait_for(guard, chrono::nanoseconds(timeoutNanos), ready)) {
+            return nullptr;
+        }
 
-    struct timespec tmo_p;
-    int64_t nanosec = 1000000000;
-    tmo_p.tv_sec    = timeoutNanos / nanosec;
-    tmo_p.tv_nsec   = timeoutNanos % nanosec;
+        context = std::move(state->idle.back());
+        state->idle.pop_back();
+    }
 
-    return eppoll(&pfd, 1, &tmo_p, NULL) == 0;
+    weak_ptr<State> weak = state;
+    return shared_ptr<Context>(context.release(), [weak](Context *c) { release(weak, c); });
 }
 
-bool Inference::cancel() const {
-    ethosu_uapi_cancel_inference_status uapi;
-    eioctl(fd, ETHOSU_IOCTL_INFERENCE_CANCEL, static_cast<void *>(&uapi));
-    return uapi.status == ETHOSU_UAPI_STATUS_OK;
+void InterpreterPool::Checkin(shared_ptr<Context> &context) {
+    // Returned to the pool by the deleter once no other reference is left
+    context.reset();
 }
 
-InferenceStatus Inference::status() const {
-    ethosu_uapi_result_status uapi;
+void InterpreterPool::release(const weak_ptr<State> &weak, Context *context) {
+    unique_ptr<Context> owned(context);
 
-    eioctl(fd, ETHOSU_IOCTL_INFERENCE_STATUS, static_cast<void *>(&uapi));
+    if (auto state = weak.lock()) {
+        {
+            lock_guard<mutex> guard(state->lock);
+            state->idle.push_back(std::move(owned));
+        }
 
-    switch (uapi.status) {
-    case ETHOSU_UAPI_STATUS_OK:
-        return InferenceStatus::OK;
-    case ETHOSU_UAPI_STATUS_ERROR:
-        return InferenceStatus::ERROR;
-    case ETHOSU_UAPI_STATUS_RUNNING:
-        return InferenceStatus::RUNNING;
-    case ETHOSU_UAPI_STATUS_REJECTED:
-        return InferenceStatus::REJECTED;
-    case ETHOSU_UAPI_STATUS_ABORTED:
-        return InferenceStatus::ABORTED;
-    case ETHOSU_UAPI_STATUS_ABORTING:
-        return InferenceStatus::ABORTING;
+        state->available.notify_one();
+        return;
     }
 
-    throw Exception("Unknown inference status");
+    // The context is freed outside of the pool. A deleter must not throw.
+    try {
+        owned.reset();
+    } catch (std::exception &e) { LOG(Severity::Error) << "Failed to free interpreter context: " << e.what() << endl; }
 }
 
-const std::vector<uint32_t> Inference::getPmuCounters() const {
-    ethosu_uapi_result_status uapi;
-    std::vector<uint32_t> counterValues = std::vector<uint32_t>(ETHOSU_PMU_EVENT_MAX, 0);
+size_t InterpreterPool::GetSize() const {
+    return size;
+}
 
-    eioctl(fd, ETHOSU_IOCTL_INFERENCE_STATUS, static_cast<void *>(&uapi));
+size_t InterpreterPool::GetAvailable() const {
+    lock_guard<mutex> guard(state->lock);
+    return state->idle.size();
+}
 
-    for (int i = 0; i < ETHOSU_PMU_EVENT_MAX; i++) {
-        if (uapi.pmu_config.events[i]) {
-            counterValues.at(i) = uapi.pmu_count.events[i];
+std::vector<TensorInfo> InterpreterPool::GetInputInfo() {
+    return tensorInfo(network->getIfmTypes(), network->getIfmShapes(), network->getInputCount());
+}
+
+std::vector<TensorInfo> InterpreterPool::GetOutputInfo() {
+    return tensorInfo(network->getOfmTypes(), network->getOfmShapes(), network->getOutputCount());
+}
+
+/****************************************************************************
+ * PMU profiler
+ ****************************************************************************/
+
+PmuProfiler::PmuProfiler(const vector<uint32_t> &_events, size_t repeats) :
+    repeats(repeats), runs(0), cycleSum(0), minCycles(UINT64_MAX), maxCycles(0) {
+    if (repeats == 0) {
+        throw Exception("PMU profiler needs at least one repeat.");
+    }
+
+    // Event zero disables a counter, and every event only needs to be counted once
+    for (auto event : _events) {
+        if (event == 0) {
+            throw Exception("PMU event zero can not be profiled.");
         }
+
+        if (find(events.begin(), events.end(), event) == events.end()) {
+            events.push_back(event);
+        }
+    }
+
+    if (events.empty()) {
+        throw Exception("No PMU events to profile.");
     }
 
-    return counterValues;
+    samples.resize(events.size(), Sample{0, 0, 0.0, 0});
 }
 
-uint64_t Inference::getCycleCounter() const {
-    ethosu_uapi_result_status uapi;
+vector<uint32_t> PmuProfiler::parseEvents(const string &list) {
+    vector<uint32_t> parsed;
+    istringstream stream(list);
+    string item;
 
-    eioctl(fd, ETHOSU_IOCTL_INFERENCE_STATUS, static_cast<void *>(&uapi));
+    while (getline(stream, item, ',')) {
+        if (item.empty()) {
+            continue;
+        }
 
-    return uapi.pmu_count.cycle_count;
-}
+        size_t end = 0;
+        try {
+            parsed.push_back(stoul(item, &end, 0));
+        } catch (std::exception &) { end = 0; }
 
-int Inference::getFd() const {
-    return fd;
-}
+        if (end != item.size()) {
+            throw Exception(("Invalid PMU event '" + item + "'").c_str());
+        }
+    }
 
-const shared_ptr<Network> Inference::getNetwork() const {
-    return network;
+    return parsed;
 }
 
-vector<shared_ptr<Buffer>> &Inference::getIfmBuffers() {
-    return ifmBuffers;
+size_t PmuProfiler::getRunCount() const {
+    size_t groups = (events.size() + ETHOSU_PMU_EVENT_MAX - 1) / ETHOSU_PMU_EVENT_MAX;
+    return groups * repeats;
 }
 
-vector<shared_ptr<Buffer>> &Inference::getOfmBuffers() {
-    return ofmBuffers;
+vector<uint32_t> PmuProfiler::getRunEvents(size_t run) const {
+    size_t groups = (events.size() + ETHOSU_PMU_EVENT_MAX - 1) / ETHOSU_PMU_EVENT_MAX;
+    size_t first  = (run % groups) * ETHOSU_PMU_EVENT_MAX;
+    size_t last   = min(first + ETHOSU_PMU_EVENT_MAX, events.size());
+
+    vector<uint32_t> group(ETHOSU_PMU_EVENT_MAX, 0);
+    copy(events.begin() + first, events.begin() + last, group.begin());
+
+    return group;
 }
 
-/****************************************************************************
- * Interpreter
- ****************************************************************************/
-Interpreter::Interpreter(const char *model, const char *_device, int64_t _arenaSizeOfMB):
-             device(_device), arenaSizeOfMB(_arenaSizeOfMB){
-    //Send capabilities request
-    Capabilities capabilities = device.capabilities();
-
-    cout << "Capabilities:" << endl
-         << "\tversion_status:" << unsigned(capabilities.hwId.versionStatus) << endl
-         << "\tversion:" << capabilities.hwId.version << endl
-         << "\tproduct:" << capabilities.hwId.product << endl
-         << "\tarchitecture:" << capabilities.hwId.architecture << endl
-         << "\tdriver:" << capabilities.driver << endl
-         << "\tmacs_per_cc:" << unsigned(capabilities.hwCfg.macsPerClockCycle) << endl
-         << "\tcmd_stream_version:" << unsigned(capabilities.hwCfg.cmdStreamVersion) << endl
-         << "\tcustom_dma:" << std::boolalpha << capabilities.hwCfg.customDma << endl;
-
-    // Init network
-    ifstream stream(model, ios::binary);
-    if (!stream.is_open()) {
-         throw Exception("Failed to open model file");
+void PmuProfiler::record(size_t run, const vector<uint32_t> &counters, uint64_t cycles) {
+    if (run >= getRunCount()) {
+        throw Exception("PMU profiler run out of range.");
     }
 
-    stream.seekg(0, ios_base::end);
-    size_t size = stream.tellg();
-    stream.seekg(0, ios_base::beg);
+    if (counters.size() < ETHOSU_PMU_EVENT_MAX) {
+        throw Exception("Wrong number of PMU counters.");
+    }
 
-    networkBuffer = make_shared<Buffer>(device, size);
-    networkBuffer->resize(size);
-    stream.read(networkBuffer->data(), size);
-    network = make_shared<Network>(device, networkBuffer);
-    if (!network->isVelaModel()) {
-         throw Exception("Only support models compiled by vela.");
+    size_t first = (run % (getRunCount() / repeats)) * ETHOSU_PMU_EVENT_MAX;
+    size_t last  = min(first + ETHOSU_PMU_EVENT_MAX, events.size());
+
+    for (size_t i = first; i < last; i++) {
+        Sample &sample = samples[i];
+        uint32_t count = counters[i - first];
+
+        sample.runs++;
+        sample.sum += count;
+
+        if (cycles > 0) {
+            sample.perCycleSum += static_cast<double>(count) / cycles;
+            sample.perCycleRuns++;
+        }
     }
 
-    // Init tensor arena buffer
-    size_t arena_buffer_size = arenaSizeOfMB << 20;
-    arenaBuffer = make_shared<Buffer>(device, arena_buffer_size);
-    arenaBuffer->resize(arena_buffer_size);
+    runs++;
+    cycleSum += cycles;
+    minCycles = min(minCycles, cycles);
+    maxCycles = max(maxCycles, cycles);
 }
 
-void Interpreter::SetPmuCycleCounters(vector<uint8_t> counters, bool cycleCounter) {
-    if (counters.size() != ETHOSU_PMU_EVENT_MAX){
-        throw Exception("PMU event count is invalid.");
+PmuProfiler::Report PmuProfiler::getReport() const {
+    Report report;
+    report.groups     = getRunCount() / repeats;
+    report.repeats    = repeats;
+    report.runs       = runs;
+    report.meanCycles = runs == 0 ? 0.0 : static_cast<double>(cycleSum) / runs;
+    report.minCycles  = runs == 0 ? 0 : minCycles;
+    report.maxCycles  = maxCycles;
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const Sample &sample = samples[i];
+
+        EventStatistics statistics;
+        statistics.event      = events[i];
+        statistics.runs       = sample.runs;
+        statistics.mean       = sample.runs == 0 ? 0.0 : static_cast<double>(sample.sum) / sample.runs;
+        statistics.perCycle   = sample.perCycleRuns == 0 ? 0.0 : sample.perCycleSum / sample.perCycleRuns;
+        statistics.normalized = statistics.perCycle * report.meanCycles;
+        report.events.push_back(statistics);
     }
 
-    pmuCounters = counters;
-    enableCycleCounter = cycleCounter;
+    return report;
 }
 
-void Interpreter::Invoke(int64_t timeoutNanos) {
-    inference = make_shared<Inference>(network, arenaBuffer,
-                                pmuCounters, enableCycleCounter);
-    inference->wait(timeoutNanos);
+PmuProfiler::Report PmuProfiler::run(const Runner &runner) {
+    for (size_t i = 0; i < getRunCount(); i++) {
+        InferenceResult result = runner(getRunEvents(i));
+        if (result.status != InferenceStatus::OK) {
+            throw Exception("PMU profiler inference failed.");
+        }
 
-    if (inference->status() != InferenceStatus::OK) {
-        throw Exception("Failed to invoke.");
+        record(i, result.pmuCounters, result.cycleCounter);
     }
-}
 
-std::vector<uint32_t> Interpreter::GetPmuCounters() {
-    return inference->getPmuCounters();
+    return getReport();
 }
 
-uint64_t Interpreter::GetCycleCounter() {
-    return inference->getCycleCounter();
-}
+PmuProfiler::Report PmuProfiler::run(Interpreter &interpreter, int64_t timeoutNanos) {
+    // The interpreter takes 8-bit event numbers
+    for (auto event : events) {
+        if (event > UINT8_MAX) {
+            throw Exception("PMU event out of range for the interpreter.");
+        }
+    }
 
-std::vector<TensorInfo> Interpreter::GetInputInfo() {
-    std::vector<TensorInfo> ret;
-    auto types = network->getIfmTypes();
-    auto shapes = network->getIfmShapes();
+    // The network may use the input tensors as scratch memory, so every run is given the original input
+    const shared_ptr<Network> &network = interpreter.network;
+    vector<vector<char>> inputs;
 
-    for (int i = 0; i < network->getInputCount(); i ++) {
-        ret.push_back(TensorInfo{types[i], shapes[i]});
+    for (size_t i = 0; i < network->getInputCount(); i++) {
+        const char *data = interpreter.typed_input_buffer<char>(i);
+        inputs.push_back(vector<char>(data, data + network->getIfmDims()[i]));
     }
 
-    return ret;
-}
+    return run([&interpreter, &inputs, timeoutNanos](const vector<uint32_t> &group) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            memcpy(interpreter.typed_input_buffer<char>(i), inputs[i].data(), inputs[i].size());
+        }
 
-std::vector<TensorInfo> Interpreter::GetOutputInfo(){
-    std::vector<TensorInfo> ret;
-    auto types = network->getOfmTypes();
-    auto shapes = network->getOfmShapes();
+        interpreter.SetPmuCycleCounters(vector<uint8_t>(group.begin(), group.end()), true);
+        interpreter.Invoke(timeoutNanos);
 
-    for (int i = 0; i < network->getOutputCount(); i ++) {
-        ret.push_back(TensorInfo{types[i], shapes[i]});
+        InferenceResult result(InferenceStatus::OK);
+        result.pmuEvents    = group;
+        result.pmuCounters  = interpreter.GetPmuCounters();
+        result.cycleCounter = interpreter.GetCycleCounter();
+
+        return result;
+    });
+}
+
+ostream &operator<<(ostream &out, const PmuProfiler::Report &report) {
+    ios_base::fmtflags flags = out.flags();
+    streamsize precision     = out.precision();
+
+    out << "PMU profile: " << report.events.size() << " events, " << report.groups << " groups, " << report.repeats
+        << " repeats, " << report.runs << " runs" << endl
+        << "Cycles: mean " << fixed << setprecision(0) << report.meanCycles << ", min " << report.minCycles
+        << ", max " << report.maxCycles << endl
+        << setw(8) << "Event" << setw(8) << "Runs" << setw(16) << "Mean" << setw(14) << "Per cycle" << setw(16)
+        << "Normalized" << endl;
+
+    for (auto &event : report.events) {
+        out << setw(8) << event.event << setw(8) << event.runs << setw(16) << setprecision(1) << event.mean
+            << setw(14) << setprecision(6) << event.perCycle << setw(16) << setprecision(1) << event.normalized
+            << endl;
     }
 
-    return ret;
+    out.flags(flags);
+    out.precision(precision);
+
+    return out;
 }
 
 } // namespace EthosU
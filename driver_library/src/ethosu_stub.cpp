@@ -16,75 +16,665 @@
  * limitations under the License.
  */
 
-#include <uapi/ethosu.h>
+/*
+ * Userspace emulator of the Ethos-U kernel driver and NPU.
+ *
+ * Linking this file overrides the weak open, close and ioctl hooks of the
+ * driver library. Devices, networks and inferences are backed by eventfds and
+ * buffers by memfds, so that ppoll, epoll and mmap work unmodified on the
+ * emulated file descriptors. Inferences are run one at a time in submission
+ * order by a background thread, and complete after a service time drawn from
+ * a configurable distribution.
+ *
+ * The emulator is configured with environment variables:
+ *
+ * ETHOSU_EMU_LATENCY_US  Service time distribution in microseconds, one of
+ *                        'fixed:T', 'uniform:MIN:MAX', 'normal:MEAN:STDDEV',
+ *                        'exponential:MEAN' or 'lognormal:MEDIAN:SIGMA'
+ *                        (default fixed:1000).
+ * ETHOSU_EMU_ABORT_US    Time a cancelled running inference stays ABORTING
+ *                        (default 0).
+ * ETHOSU_EMU_QUEUE_DEPTH Maximum number of queued and running inferences,
+ *                        further inferences are REJECTED (default 0, no limit).
+ * ETHOSU_EMU_REJECT_RATE Probability that an inference is REJECTED (default 0).
+ * ETHOSU_EMU_ERROR_RATE  Probability that an inference fails with ERROR
+ *                        (default 0).
+ * ETHOSU_EMU_CYCLES_PER_US NPU clock in cycles per microsecond (default 1000).
+ * ETHOSU_EMU_SEED        Seed of the random number generator (default 0).
+ * ETHOSU_EMU_IFM         Network inputs as 'type:d0xd1x...' separated by ';'
+ *                        (default uint8:1x224x224x3).
+ * ETHOSU_EMU_OFM         Network outputs (default uint8:1x1001).
+ * ETHOSU_EMU_RESUBMIT    Set to 0 to emulate a kernel without the resubmit
+ *                        ioctl.
+ * ETHOSU_EMU_BATCH       Set to 0 to emulate a kernel without the batch ioctl.
+ */
 
 #include <ethosu.hpp>
-#include <exception>
-#include <iostream>
+#include <uapi/ethosu.h>
 
-#include <fcntl.h>
-#include <poll.h>
-#include <sys/ioctl.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 namespace EthosU {
-int eopen(const char *p, int) {
-    std::cout << "Opened filedescriptor for " << p;
-    return 1;
-}
+namespace {
 
-int eclose(int) {
-    return 0;
+typedef std::chrono::steady_clock Clock;
+
+const char *getEnv(const char *name, const char *fallback) {
+    const char *value = getenv(name);
+    return value != nullptr && *value != '\0' ? value : fallback;
 }
 
-void *emmap(void *, size_t length, int, int, int, off_t) {
-    void *d = malloc(length);
-    return d;
+double getEnvDouble(const char *name, double fallback) {
+    const char *value = getenv(name);
+    return value != nullptr && *value != '\0' ? strtod(value, nullptr) : fallback;
 }
 
-int emunmap(void *addr, size_t) {
-    free(addr);
-    return 0;
+/*
+ * Tensor layout reported by NETWORK_INFO
+ */
+struct Tensor {
+    uint32_t type;
+    uint32_t size;
+    std::vector<uint32_t> shape;
+};
+
+std::vector<Tensor> parseTensors(const std::string &spec) {
+    static const struct {
+        const char *name;
+        uint32_t type;
+        uint32_t elementSize;
+    } types[] = {{"float32", TensorType_FLOAT32, 4}, {"int32", TensorType_INT32, 4}, {"uint8", TensorType_UINT8, 1},
+                 {"int16", TensorType_INT16, 2},     {"int8", TensorType_INT8, 1}};
+
+    std::vector<Tensor> tensors;
+    std::istringstream tensorStream(spec);
+    std::string item;
+
+    while (getline(tensorStream, item, ';') && tensors.size() < ETHOSU_FD_MAX) {
+        size_t colon = item.find(':');
+        if (colon == std::string::npos) {
+            throw Exception("Emulator tensor must be specified as type:shape");
+        }
+
+        Tensor tensor;
+        uint32_t elementSize = 0;
+        std::string name     = item.substr(0, colon);
+
+        for (auto &t : types) {
+            if (name == t.name) {
+                tensor.type = t.type;
+                elementSize = t.elementSize;
+            }
+        }
+
+        if (elementSize == 0) {
+            throw Exception("Unknown emulator tensor type");
+        }
+
+        tensor.size = elementSize;
+        std::istringstream shapeStream(item.substr(colon + 1));
+        std::string dim;
+
+        while (getline(shapeStream, dim, 'x') && tensor.shape.size() < ETHOSU_DIM_MAX) {
+            tensor.shape.push_back(std::stoul(dim));
+            tensor.size *= tensor.shape.back();
+        }
+
+        tensors.push_back(tensor);
+    }
+
+    return tensors;
 }
 
-int eioctl(int, unsigned long cmd, void *) {
-    int result = 0;
-    using namespace EthosU;
-
-    switch (cmd) {
-    case ETHOSU_IOCTL_PING:
-        return result;
-    case ETHOSU_IOCTL_VERSION_REQ:
-        return result;
-    case ETHOSU_IOCTL_CAPABILITIES_REQ:
-        return result;
-    case ETHOSU_IOCTL_BUFFER_CREATE:
-        return result;
-    case ETHOSU_IOCTL_BUFFER_SET:
-        return result;
-    case ETHOSU_IOCTL_BUFFER_GET:
-        return result;
-    case ETHOSU_IOCTL_NETWORK_CREATE:
-        return result;
-    case ETHOSU_IOCTL_INFERENCE_CREATE:
-        return result;
-    case ETHOSU_IOCTL_INFERENCE_STATUS:
-        return result;
-    default:
-        throw EthosU::Exception("Unknown IOCTL");
+/*
+ * Service time distribution
+ */
+class Latency {
+public:
+    Latency(const std::string &spec) : kind(spec.substr(0, spec.find(':'))), a(0), b(0) {
+        std::istringstream stream(spec.substr(std::min(spec.size(), kind.size() + 1)));
+        std::string value;
+
+        if (getline(stream, value, ':')) {
+            a = std::stod(value);
+        }
+
+        if (getline(stream, value, ':')) {
+            b = std::stod(value);
+        }
+
+        if (kind != "fixed" && kind != "uniform" && kind != "normal" && kind != "exponential" &&
+            kind != "lognormal") {
+            throw Exception("Unknown emulator latency distribution");
+        }
+    }
+
+    double sample(std::mt19937_64 &random) const {
+        double us = a;
+
+        if (kind == "uniform") {
+            us = std::uniform_real_distribution<double>(a, std::max(a, b))(random);
+        } else if (kind == "normal") {
+            us = std::normal_distribution<double>(a, b)(random);
+        } else if (kind == "exponential") {
+            us = a > 0 ? std::exponential_distribution<double>(1.0 / a)(random) : 0;
+        } else if (kind == "lognormal") {
+            us = a > 0 ? std::lognormal_distribution<double>(std::log(a), b)(random) : 0;
+        }
+
+        return std::max(us, 0.0);
+    }
+
+private:
+    std::string kind;
+    double a;
+    double b;
+};
+
+struct BufferState {
+    BufferState(uint32_t capacity) : capacity(capacity), offset(0), size(0) {}
+
+    uint32_t capacity;
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct NetworkState {
+    bool isVela;
+};
+
+struct InferenceState {
+    int fd;
+    std::shared_ptr<NetworkState> network;
+    std::vector<std::shared_ptr<BufferState>> ofms;
+    ethosu_uapi_pmu_config pmuConfig;
+    ethosu_uapi_pmu_counts pmuCount;
+    ethosu_uapi_status status;
+};
+
+class Emulator {
+public:
+    static Emulator &instance() {
+        // Never destroyed, file descriptors may be closed during static destruction
+        static Emulator *emulator = new Emulator();
+        return *emulator;
+    }
+
+    int open() {
+        int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fd < 0) {
+            return -errno;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        devices.push_back(fd);
+
+        return fd;
+    }
+
+    void close(int fd) {
+        std::lock_guard<std::mutex> guard(lock);
+
+        devices.erase(std::remove(devices.begin(), devices.end(), fd), devices.end());
+        buffers.erase(fd);
+        networks.erase(fd);
+
+        // A closed inference keeps running like in the kernel, but is no longer signalled
+        auto it = inferences.find(fd);
+        if (it != inferences.end()) {
+            it->second->fd = -1;
+            inferences.erase(it);
+        }
+    }
+
+    int ioctl(int fd, unsigned long cmd, void *data) {
+        std::unique_lock<std::mutex> guard(lock);
+
+        if (std::find(devices.begin(), devices.end(), fd) != devices.end()) {
+            return deviceIoctl(cmd, data);
+        }
+
+        auto buffer = buffers.find(fd);
+        if (buffer != buffers.end()) {
+            return bufferIoctl(*buffer->second, cmd, data);
+        }
+
+        auto network = networks.find(fd);
+        if (network != networks.end()) {
+            return networkIoctl(network->second, cmd, data);
+        }
+
+        auto inference = inferences.find(fd);
+        if (inference != inferences.end()) {
+            return inferenceIoctl(inference->second, cmd, data);
+        }
+
+        return -EBADF;
+    }
+
+private:
+    Emulator() :
+        latency(getEnv("ETHOSU_EMU_LATENCY_US", "fixed:1000")),
+        abortMicros(getEnvDouble("ETHOSU_EMU_ABORT_US", 0)),
+        queueDepth(static_cast<size_t>(getEnvDouble("ETHOSU_EMU_QUEUE_DEPTH", 0))),
+        rejectRate(getEnvDouble("ETHOSU_EMU_REJECT_RATE", 0)), errorRate(getEnvDouble("ETHOSU_EMU_ERROR_RATE", 0)),
+        cyclesPerMicro(getEnvDouble("ETHOSU_EMU_CYCLES_PER_US", 1000)),
+        resubmitSupported(std::string(getEnv("ETHOSU_EMU_RESUBMIT", "1")) != "0"),
+        batchSupported(std::string(getEnv("ETHOSU_EMU_BATCH", "1")) != "0"),
+        ifms(parseTensors(getEnv("ETHOSU_EMU_IFM", "uint8:1x224x224x3"))),
+        ofms(parseTensors(getEnv("ETHOSU_EMU_OFM", "uint8:1x1001"))),
+        random(static_cast<uint64_t>(getEnvDouble("ETHOSU_EMU_SEED", 0))) {
+        std::thread(&Emulator::run, this).detach();
+    }
+
+    int deviceIoctl(unsigned long cmd, void *data) {
+        switch (cmd) {
+        case ETHOSU_IOCTL_PING:
+        case ETHOSU_IOCTL_VERSION_REQ:
+            return 0;
+        case ETHOSU_IOCTL_CAPABILITIES_REQ: {
+            auto uapi = static_cast<ethosu_uapi_device_capabilities *>(data);
+            memset(uapi, 0, sizeof(*uapi));
+
+            // Ethos-U65 with 256 MACs per cycle
+            uapi->hw_id.version_status = 1;
+            uapi->hw_id.version_major  = 1;
+            uapi->hw_id.product_major  = 1;
+            uapi->hw_id.arch_major_rev = 1;
+            uapi->hw_id.arch_patch_rev = 6;
+            uapi->hw_cfg.macs_per_cc   = 8;
+            uapi->hw_cfg.cmd_stream_version = 1;
+
+            return 0;
+        }
+        case ETHOSU_IOCTL_BUFFER_CREATE: {
+            auto uapi = static_cast<ethosu_uapi_buffer_create *>(data);
+            if (uapi->capacity == 0) {
+                return -EINVAL;
+            }
+
+            int fd = memfd_create("ethosu-buffer", MFD_CLOEXEC);
+            if (fd < 0) {
+                return -errno;
+            }
+
+            if (ftruncate(fd, uapi->capacity) < 0) {
+                int error = errno;
+                ::close(fd);
+                return -error;
+            }
+
+            buffers[fd] = std::make_shared<BufferState>(uapi->capacity);
+
+            return fd;
+        }
+        case ETHOSU_IOCTL_NETWORK_CREATE: {
+            auto uapi   = static_cast<ethosu_uapi_network_create *>(data);
+            auto state  = std::make_shared<NetworkState>();
+            state->isVela = true;
+
+            if (uapi->type == ETHOSU_UAPI_NETWORK_BUFFER) {
+                auto buffer = buffers.find(uapi->fd);
+                if (buffer == buffers.end() || buffer->second->size == 0) {
+                    return -EINVAL;
+                }
+
+                // Vela replaces the operators it compiles with the ethos-u custom operator
+                std::vector<char> model(buffer->second->size);
+                if (pread(uapi->fd, model.data(), model.size(), buffer->second->offset) < 0) {
+                    return -errno;
+                }
+
+                const std::string op = "ethos-u";
+                state->isVela = std::search(model.begin(), model.end(), op.begin(), op.end()) != model.end();
+            } else if (uapi->type != ETHOSU_UAPI_NETWORK_INDEX) {
+                return -EINVAL;
+            }
+
+            int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (fd < 0) {
+                return -errno;
+            }
+
+            networks[fd] = state;
+
+            return fd;
+        }
+        default:
+            return -ENOTTY;
+        }
     }
+
+    int bufferIoctl(BufferState &buffer, unsigned long cmd, void *data) {
+        auto uapi = static_cast<ethosu_uapi_buffer *>(data);
+
+        switch (cmd) {
+        case ETHOSU_IOCTL_BUFFER_SET:
+            if (uint64_t(uapi->offset) + uapi->size > buffer.capacity) {
+                return -EINVAL;
+            }
+
+            buffer.offset = uapi->offset;
+            buffer.size   = uapi->size;
+
+            return 0;
+        case ETHOSU_IOCTL_BUFFER_GET:
+            uapi->offset = buffer.offset;
+            uapi->size   = buffer.size;
+
+            return 0;
+        default:
+            return -ENOTTY;
+        }
+    }
+
+    int networkIoctl(const std::shared_ptr<NetworkState> &network, unsigned long cmd, void *data) {
+        switch (cmd) {
+        case ETHOSU_IOCTL_NETWORK_INFO: {
+            auto uapi = static_cast<ethosu_uapi_network_info *>(data);
+            memset(uapi, 0, sizeof(*uapi));
+            strncpy(uapi->desc, "emulator", sizeof(uapi->desc));
+            uapi->is_vela = network->isVela;
+
+            // Inputs are followed by the outputs in the arena
+            uint32_t offset = 0;
+
+            uapi->ifm_count = ifms.size();
+            for (size_t i = 0; i < ifms.size(); i++) {
+                uapi->ifm_size[i]   = ifms[i].size;
+                uapi->ifm_types[i]  = ifms[i].type;
+                uapi->ifm_offset[i] = offset;
+                uapi->ifm_dims[i]   = ifms[i].shape.size();
+                std::copy(ifms[i].shape.begin(), ifms[i].shape.end(), uapi->ifm_shapes[i]);
+                offset += (ifms[i].size + 15) & ~15u;
+            }
+
+            uapi->ofm_count = ofms.size();
+            for (size_t i = 0; i < ofms.size(); i++) {
+                uapi->ofm_size[i]   = ofms[i].size;
+                uapi->ofm_types[i]  = ofms[i].type;
+                uapi->ofm_offset[i] = offset;
+                uapi->ofm_dims[i]   = ofms[i].shape.size();
+                std::copy(ofms[i].shape.begin(), ofms[i].shape.end(), uapi->ofm_shapes[i]);
+                offset += (ofms[i].size + 15) & ~15u;
+            }
+
+            return 0;
+        }
+        case ETHOSU_IOCTL_INFERENCE_CREATE:
+            return createInference(network, *static_cast<ethosu_uapi_inference_create *>(data));
+        case ETHOSU_IOCTL_INFERENCE_BATCH: {
+            if (!batchSupported) {
+                return -ENOTTY;
+            }
+
+            auto uapi     = static_cast<ethosu_uapi_inference_batch *>(data);
+            if (uapi->reserved != 0) {
+                return -EINVAL;
+            }
+
+            auto requests = reinterpret_cast<ethosu_uapi_inference_create *>(uapi->requests);
+            auto fds      = reinterpret_cast<int32_t *>(uapi->fds);
+
+            for (uint32_t i = 0; i < uapi->count; i++) {
+                fds[i] = createInference(network, requests[i]);
+            }
+
+            return 0;
+        }
+        default:
+            return -ENOTTY;
+        }
+    }
+
+    int inferenceIoctl(const std::shared_ptr<InferenceState> &inference, unsigned long cmd, void *data) {
+        switch (cmd) {
+        case ETHOSU_IOCTL_INFERENCE_STATUS: {
+            auto uapi        = static_cast<ethosu_uapi_result_status *>(data);
+            uapi->status     = inference->status;
+            uapi->pmu_config = inference->pmuConfig;
+            uapi->pmu_count  = inference->pmuCount;
+
+            return 0;
+        }
+        case ETHOSU_IOCTL_INFERENCE_CANCEL: {
+            auto uapi = static_cast<ethosu_uapi_cancel_inference_status *>(data);
+            cancel(inference);
+            uapi->status = inference->status == ETHOSU_UAPI_STATUS_ABORTED ||
+                                   inference->status == ETHOSU_UAPI_STATUS_ABORTING
+                               ? ETHOSU_UAPI_STATUS_OK
+                               : ETHOSU_UAPI_STATUS_ERROR;
+
+            return 0;
+        }
+        case ETHOSU_IOCTL_INFERENCE_RESUBMIT: {
+            if (!resubmitSupported) {
+                return -ENOTTY;
+            }
+
+            if (inference->status == ETHOSU_UAPI_STATUS_RUNNING || inference->status == ETHOSU_UAPI_STATUS_ABORTING) {
+                return -EBUSY;
+            }
+
+            // Consume the previous completion so the file descriptor is no longer readable
+            uint64_t count;
+            if (::read(inference->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                return -errno;
+            }
+
+            enqueue(inference);
+
+            return 0;
+        }
+        default:
+            return -ENOTTY;
+        }
+    }
+
+    int createInference(const std::shared_ptr<NetworkState> &network, const ethosu_uapi_inference_create &uapi) {
+        if (uapi.ifm_count > ETHOSU_FD_MAX || uapi.ofm_count > ETHOSU_FD_MAX) {
+            return -EINVAL;
+        }
+
+        auto inference = std::make_shared<InferenceState>();
+        inference->network   = network;
+        inference->pmuConfig = uapi.pmu_config;
+
+        for (uint32_t i = 0; i < uapi.ifm_count; i++) {
+            if (!buffers.count(uapi.ifm_fd[i])) {
+                return -EINVAL;
+            }
+        }
+
+        for (uint32_t i = 0; i < uapi.ofm_count; i++) {
+            auto buffer = buffers.find(uapi.ofm_fd[i]);
+            if (buffer == buffers.end()) {
+                return -EINVAL;
+            }
+
+            inference->ofms.push_back(buffer->second);
+        }
+
+        inference->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (inference->fd < 0) {
+            return -errno;
+        }
+
+        inferences[inference->fd] = inference;
+        enqueue(inference);
+
+        return inference->fd;
+    }
+
+    void enqueue(const std::shared_ptr<InferenceState> &inference) {
+        memset(&inference->pmuCount, 0, sizeof(inference->pmuCount));
+        inference->status = ETHOSU_UAPI_STATUS_RUNNING;
+
+        size_t inFlight = queue.size() + (running ? 1 : 0);
+        if ((queueDepth != 0 && inFlight >= queueDepth) || draw() < rejectRate) {
+            complete(*inference, ETHOSU_UAPI_STATUS_REJECTED);
+            return;
+        }
+
+        queue.push_back(inference);
+        condition.notify_one();
+    }
+
+    void cancel(const std::shared_ptr<InferenceState> &inference) {
+        if (inference->status != ETHOSU_UAPI_STATUS_RUNNING) {
+            return;
+        }
+
+        auto it = std::find(queue.begin(), queue.end(), inference);
+        if (it != queue.end()) {
+            queue.erase(it);
+            complete(*inference, ETHOSU_UAPI_STATUS_ABORTED);
+            return;
+        }
+
+        // The NPU stays busy until the running inference has been aborted
+        inference->status = ETHOSU_UAPI_STATUS_ABORTING;
+        finishTime        = Clock::now() + std::chrono::microseconds(static_cast<int64_t>(abortMicros));
+        condition.notify_one();
+    }
+
+    void complete(InferenceState &inference, ethosu_uapi_status status) {
+        inference.status = status;
+
+        if (inference.fd >= 0) {
+            uint64_t one = 1;
+            if (::write(inference.fd, &one, sizeof(one)) < 0) {
+                inference.status = ETHOSU_UAPI_STATUS_ERROR;
+            }
+        }
+    }
+
+    void finish(InferenceState &inference, double micros) {
+        if (inference.status == ETHOSU_UAPI_STATUS_ABORTING) {
+            complete(inference, ETHOSU_UAPI_STATUS_ABORTED);
+            return;
+        }
+
+        if (draw() < errorRate) {
+            complete(inference, ETHOSU_UAPI_STATUS_ERROR);
+            return;
+        }
+
+        // Event counts are a fixed fraction of the cycle count, different for each event
+        uint64_t cycles = static_cast<uint64_t>(micros * cyclesPerMicro);
+        for (int i = 0; i < ETHOSU_PMU_EVENT_MAX; i++) {
+            uint32_t event = inference.pmuConfig.events[i];
+            inference.pmuCount.events[i] =
+                event != 0 ? static_cast<uint32_t>(cycles * (event % 8 + 1) / 8) : 0;
+        }
+
+        inference.pmuCount.cycle_count = inference.pmuConfig.cycle_count ? cycles : 0;
+
+        // The kernel driver appends the output of the network to the OFM buffers
+        for (size_t i = 0; i < inference.ofms.size(); i++) {
+            BufferState &ofm = *inference.ofms[i];
+            uint32_t size    = i < ofms.size() ? ofms[i].size : 0;
+            ofm.size         = std::min(ofm.size + size, ofm.capacity - ofm.offset);
+        }
+
+        complete(inference, ETHOSU_UAPI_STATUS_OK);
+    }
+
+    double draw() {
+        return std::uniform_real_distribution<double>(0, 1)(random);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        double micros = 0;
+
+        while (true) {
+            if (running && Clock::now() >= finishTime) {
+                finish(*running, micros);
+                running.reset();
+            }
+
+            if (!running && !queue.empty()) {
+                running = queue.front();
+                queue.pop_front();
+
+                micros     = latency.sample(random);
+                finishTime = Clock::now() + std::chrono::nanoseconds(static_cast<int64_t>(micros * 1000));
+            }
+
+            if (running) {
+                condition.wait_until(guard, finishTime);
+            } else {
+                condition.wait(guard);
+            }
+        }
+    }
+
+    const Latency latency;
+    const double abortMicros;
+    const size_t queueDepth;
+    const double rejectRate;
+    const double errorRate;
+    const double cyclesPerMicro;
+    const bool resubmitSupported;
+    const bool batchSupported;
+    const std::vector<Tensor> ifms;
+    const std::vector<Tensor> ofms;
+
+    std::mutex lock;
+    std::condition_variable condition;
+    std::mt19937_64 random;
+    std::vector<int> devices;
+    std::map<int, std::shared_ptr<BufferState>> buffers;
+    std::map<int, std::shared_ptr<NetworkState>> networks;
+    std::map<int, std::shared_ptr<InferenceState>> inferences;
+    std::deque<std::shared_ptr<InferenceState>> queue;
+    std::shared_ptr<InferenceState> running;
+    Clock::time_point finishTime;
+};
+
+} // namespace
+
+int eopen(const char *, int) {
+    int fd = Emulator::instance().open();
+    if (fd < 0) {
+        throw Exception("Failed to open device");
+    }
+
+    return fd;
 }
 
-int eppoll(struct pollfd *, nfds_t, const struct timespec *tmo_p, const sigset_t *) {
-    if (tmo_p == NULL) {
-        // sleep one second
-        usleep(1000000ul);
-    } else {
-        unsigned long t = tmo_p->tv_sec / 2;   // sleep half of the time
-        t               = t * 1000ul * 1000ul; // sec to microsec
-        usleep(t);
+int nclose(int fd) {
+    Emulator::instance().close(fd);
+
+    int result = ::close(fd);
+    if (result < 0) {
+        result = -errno;
     }
-    return 1;
+
+    return result;
+}
+
+int nioctl(int fd, unsigned long cmd, void *data) {
+    return Emulator::instance().ioctl(fd, cmd, data);
 }
 } // namespace EthosU
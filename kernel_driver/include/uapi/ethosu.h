@@ -62,6 +62,15 @@ namespace EthosU {
 						   struct ethosu_uapi_result_status)
 #define ETHOSU_IOCTL_INFERENCE_CANCEL   ETHOSU_IOR(0x32, \
 						   struct ethosu_uapi_cancel_inference_status)
+/*
+ * Queue a completed inference again, reusing the network, IFM/OFM buffers and
+ * PMU configuration it was created with. Issued on the inference file
+ * descriptor, fails with -EBUSY while the inference is still running.
+ */
+#define ETHOSU_IOCTL_INFERENCE_RESUBMIT ETHOSU_IO(0x33)
+/* Takes struct ethosu_uapi_inference_batch, returns the created inference fds in @fds */
+#define ETHOSU_IOCTL_INFERENCE_BATCH    ETHOSU_IOR(0x34, \
+						   struct ethosu_uapi_inference_batch)
 
 /* Maximum number of IFM/OFM file descriptors per network */
 #define ETHOSU_FD_MAX                   16
@@ -257,6 +266,26 @@ struct ethosu_uapi_inference_create {
 	struct ethosu_uapi_pmu_config pmu_config;
 };
 
+/**
+ * struct ethosu_uapi_inference_batch - Create several inferences at once
+ * @count:	Number of inferences in the batch
+ * @reserved:	Must be zero
+ * @requests:	User pointer to an array of @count
+ *		struct ethosu_uapi_inference_create
+ * @fds:	User pointer to an array of @count __s32, receiving the file
+ *		descriptor of each created inference, or a negative error code
+ *		for an inference that could not be created
+ *
+ * Issued on the network file descriptor. All inferences are queued before
+ * the remote CPU is notified.
+ */
+struct ethosu_uapi_inference_batch {
+	__u32 count;
+	__u32 reserved;
+	__u64 requests;
+	__u64 fds;
+};
+
 /**
  * struct ethosu_uapi_result_status - Status of inference
  * @status	Status of run inference.
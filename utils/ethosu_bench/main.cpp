@@ -0,0 +1,531 @@
+/*
+ * Copyright 2020-2022 NXP
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ethosu.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace EthosU;
+
+namespace {
+
+int64_t defaultTimeout       = 60000000000;
+int64_t defaultArenaSizeOfMB = 16;
+size_t defaultWarmup         = 10;
+size_t defaultIterations     = 100;
+
+void help(const string exe) {
+    cerr << "Usage: " << exe << " [ARGS]\n";
+    cerr << "\n";
+    cerr << "Arguments:\n";
+    cerr << "    -h --help          Print this help message.\n";
+    cerr << "    -n --network       File to read network from.\n";
+    cerr << "    --index            Network model index, stored in firmware binary.\n";
+    cerr << "    -i --ifm           Raw file to read the first input tensor from (default zeros).\n";
+    cerr << "    -d --dev           NPU device name (default /dev/ethosu0).\n";
+    cerr << "    -w --warmup        Inferences run before measuring (default " << defaultWarmup << ").\n";
+    cerr << "    -N --iterations    Inferences to measure (default " << defaultIterations << ").\n";
+    cerr << "    -D --duration      Measure for this many seconds instead of a number of iterations.\n";
+    cerr << "    -c --concurrency   Inferences in flight per thread (default 1).\n";
+    cerr << "    -T --threads       Number of submitting threads (default 1).\n";
+    cerr << "    -P --pmu [0.." << ETHOSU_PMU_EVENT_MAX << "] eventid.\n";
+    cerr << "                       PMU counter to enable followed by eventid, can be passed multiple times.\n";
+    cerr << "    -C --cycles        Enable cycle counter for inference.\n";
+    cerr << "    -t --timeout       Timeout in nanoseconds (default " << defaultTimeout << ").\n";
+    cerr << "    -a --arena         TFLite-micro arena memory size (default " << defaultArenaSizeOfMB << "MB).\n";
+    cerr << "    -o --output        File to write the JSON report to (default stdout).\n";
+    cerr << endl;
+}
+
+void rangeCheck(const int i, const int argc, const string arg) {
+    if (i >= argc) {
+        cerr << "Error: Missing argument to '" << arg << "'" << endl;
+        exit(1);
+    }
+}
+
+typedef chrono::steady_clock Clock;
+
+/*
+ * Inferences are numbered in submission order across all threads. The first
+ * ones are warmup runs, and submission stops when the iteration budget or
+ * the duration has been used up. The duration is measured from the first
+ * inference after the warmup.
+ */
+class Schedule {
+public:
+    Schedule(size_t warmup, size_t iterations, double duration) :
+        warmup(warmup), iterations(iterations), duration(duration), next(0), startNanos(0) {}
+
+    bool claim(size_t &ticket) {
+        ticket = next.fetch_add(1);
+
+        if (ticket < warmup) {
+            return true;
+        }
+
+        if (duration > 0) {
+            int64_t now   = chrono::duration_cast<chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+            int64_t start = 0;
+
+            // The first measured claim starts the clock
+            if (startNanos.compare_exchange_strong(start, now)) {
+                start = now;
+            }
+
+            return (now - start) / 1e9 < duration;
+        }
+
+        return ticket < warmup + iterations;
+    }
+
+    bool isWarmup(size_t ticket) const {
+        return ticket < warmup;
+    }
+
+private:
+    const size_t warmup;
+    const size_t iterations;
+    const double duration;
+    atomic<size_t> next;
+    atomic<int64_t> startNanos;
+};
+
+struct Sample {
+    uint64_t latencyNanos;
+    uint64_t cycles;
+    vector<uint32_t> pmuCounters;
+};
+
+struct Results {
+    mutex lock;
+    vector<Sample> samples;
+    size_t failed = 0;
+    Clock::time_point firstMeasured;
+    Clock::time_point lastCompleted;
+    bool measuring = false;
+};
+
+struct Job {
+    shared_ptr<Inference> inference;
+    size_t ticket;
+    Clock::time_point submitted;
+};
+
+shared_ptr<Inference> createInference(const shared_ptr<Network> &network,
+                                      const shared_ptr<Buffer> &arena,
+                                      const vector<uint32_t> &counters,
+                                      bool enableCycleCounter) {
+    Expected<shared_ptr<Inference>> created = Inference::tryCreate(network, arena, counters, enableCycleCounter);
+    if (!created) {
+        throw Exception("Failed to create inference");
+    }
+
+    return created.value();
+}
+
+void worker(const shared_ptr<Network> &network,
+            const vector<char> &input,
+            size_t concurrency,
+            int64_t arenaSizeOfMB,
+            const vector<uint32_t> &counters,
+            bool enableCycleCounter,
+            int64_t timeout,
+            Schedule &schedule,
+            Results &results) {
+    vector<Job> jobs;
+    vector<shared_ptr<Buffer>> arenas;
+
+    // Every job has its own arena holding its input and output tensors
+    for (size_t i = 0; i < concurrency; i++) {
+        shared_ptr<Buffer> arena = network->getDevice().getArenaPool().acquire(arenaSizeOfMB << 20);
+        if (!input.empty() && network->getInputCount() > 0) {
+            size_t size = min(input.size(), network->getIfmDims()[0]);
+            memcpy(arena->data() + network->getInputDataOffset(0), input.data(), size);
+        }
+
+        arenas.push_back(arena);
+    }
+
+    vector<Job *> pending;
+    vector<Inference *> waiting;
+
+    auto submit = [&](Job &job, bool first) -> bool {
+        if (!schedule.claim(job.ticket)) {
+            return false;
+        }
+
+        job.submitted = Clock::now();
+
+        if (first) {
+            job.inference = createInference(network, arenas[&job - &jobs[0]], counters, enableCycleCounter);
+        } else if (!job.inference->tryResubmit()) {
+            throw Exception("Failed to resubmit inference");
+        }
+
+        pending.push_back(&job);
+        return true;
+    };
+
+    jobs.resize(concurrency);
+    for (auto &job : jobs) {
+        if (!submit(job, true)) {
+            break;
+        }
+    }
+
+    while (!pending.empty()) {
+        waiting.clear();
+        for (auto job : pending) {
+            waiting.push_back(job->inference.get());
+        }
+
+        vector<size_t> completed = Inference::waitAny(waiting, timeout);
+        if (completed.empty()) {
+            throw Exception("Inference timed out");
+        }
+
+        Clock::time_point now = Clock::now();
+        vector<Job *> done;
+
+        for (auto i : completed) {
+            done.push_back(pending[i]);
+        }
+
+        for (auto it = completed.rbegin(); it != completed.rend(); ++it) {
+            pending.erase(pending.begin() + *it);
+        }
+
+        for (auto job : done) {
+            InferenceResult result = job->inference->result();
+
+            if (!schedule.isWarmup(job->ticket)) {
+                lock_guard<mutex> guard(results.lock);
+
+                if (!results.measuring) {
+                    results.firstMeasured = job->submitted;
+                    results.measuring     = true;
+                }
+
+                results.firstMeasured = min(results.firstMeasured, job->submitted);
+                results.lastCompleted = max(results.lastCompleted, now);
+
+                if (result.status == InferenceStatus::OK) {
+                    uint64_t latency =
+                        chrono::duration_cast<chrono::nanoseconds>(now - job->submitted).count();
+                    results.samples.push_back(Sample{latency, result.cycleCounter, result.pmuCounters});
+                } else {
+                    results.failed++;
+                }
+            }
+
+            submit(*job, false);
+        }
+    }
+}
+
+uint64_t percentile(const vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.5);
+    return sorted[min(max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+void writeStatistics(ostream &out, const string &indent, vector<uint64_t> values, double scale) {
+    sort(values.begin(), values.end());
+
+    double sum = 0;
+    for (auto v : values) {
+        sum += v;
+    }
+
+    double mean = values.empty() ? 0.0 : sum / values.size();
+
+    out << fixed << setprecision(3) << "{\n"
+        << indent << "  \"min\": " << (values.empty() ? 0 : values.front()) / scale << ",\n"
+        << indent << "  \"mean\": " << mean / scale << ",\n"
+        << indent << "  \"p50\": " << percentile(values, 50) / scale << ",\n"
+        << indent << "  \"p90\": " << percentile(values, 90) / scale << ",\n"
+        << indent << "  \"p99\": " << percentile(values, 99) / scale << ",\n"
+        << indent << "  \"max\": " << (values.empty() ? 0 : values.back()) / scale << "\n"
+        << indent << "}";
+}
+
+string jsonString(const string &s) {
+    string escaped = "\"";
+
+    for (auto c : s) {
+        switch (c) {
+        case '"':
+            escaped += "\\\"";
+            break;
+        case '\\':
+            escaped += "\\\\";
+            break;
+        case '\n':
+            escaped += "\\n";
+            break;
+        case '\r':
+            escaped += "\\r";
+            break;
+        case '\t':
+            escaped += "\\t";
+            break;
+        default:
+            // Remaining control characters must be escaped as code points
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char code[7];
+                snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+                escaped += code;
+            } else {
+                escaped += c;
+            }
+        }
+    }
+
+    return escaped + "\"";
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    const string exe = argv[0];
+    string networkArg;
+    int networkIndex = -1;
+    string ifmArg;
+    string devArg = "/dev/ethosu0";
+    string outputArg;
+    vector<uint32_t> enabledCounters(ETHOSU_PMU_EVENT_MAX);
+    bool enableCycleCounter = false;
+    size_t warmup           = defaultWarmup;
+    size_t iterations       = defaultIterations;
+    double duration         = 0;
+    size_t concurrency      = 1;
+    size_t threads          = 1;
+    int64_t timeout         = defaultTimeout;
+    int64_t arenaSizeOfMB   = defaultArenaSizeOfMB;
+
+    for (int i = 1; i < argc; ++i) {
+        const string arg(argv[i]);
+
+        if (arg == "-h" || arg == "--help") {
+            help(exe);
+            exit(1);
+        } else if (arg == "--network" || arg == "-n") {
+            rangeCheck(++i, argc, arg);
+            networkArg = argv[i];
+        } else if (arg == "--index") {
+            rangeCheck(++i, argc, arg);
+            networkIndex = stoi(argv[i]);
+        } else if (arg == "--ifm" || arg == "-i") {
+            rangeCheck(++i, argc, arg);
+            ifmArg = argv[i];
+        } else if (arg == "--dev" || arg == "-d") {
+            rangeCheck(++i, argc, arg);
+            devArg = argv[i];
+        } else if (arg == "--warmup" || arg == "-w") {
+            rangeCheck(++i, argc, arg);
+            warmup = stoul(argv[i]);
+        } else if (arg == "--iterations" || arg == "-N") {
+            rangeCheck(++i, argc, arg);
+            iterations = stoul(argv[i]);
+        } else if (arg == "--duration" || arg == "-D") {
+            rangeCheck(++i, argc, arg);
+            duration = stod(argv[i]);
+        } else if (arg == "--concurrency" || arg == "-c") {
+            rangeCheck(++i, argc, arg);
+            concurrency = stoul(argv[i]);
+        } else if (arg == "--threads" || arg == "-T") {
+            rangeCheck(++i, argc, arg);
+            threads = stoul(argv[i]);
+        } else if (arg == "--pmu" || arg == "-P") {
+            unsigned pmu = 0, event = 0;
+            rangeCheck(++i, argc, arg);
+            pmu = stoi(argv[i]);
+
+            rangeCheck(++i, argc, arg);
+            event = stoi(argv[i]);
+
+            if (pmu >= enabledCounters.size()) {
+                cerr << "PMU out of bounds!" << endl;
+                help(exe);
+                exit(1);
+            }
+            enabledCounters[pmu] = event;
+        } else if (arg == "--cycles" || arg == "-C") {
+            enableCycleCounter = true;
+        } else if (arg == "--timeout" || arg == "-t") {
+            rangeCheck(++i, argc, arg);
+            timeout = stoll(argv[i]);
+        } else if (arg == "--arena" || arg == "-a") {
+            rangeCheck(++i, argc, arg);
+            arenaSizeOfMB = stoll(argv[i]);
+        } else if (arg == "--output" || arg == "-o") {
+            rangeCheck(++i, argc, arg);
+            outputArg = argv[i];
+        } else {
+            cerr << "Error: Invalid argument '" << arg << "'" << endl;
+            help(exe);
+            exit(1);
+        }
+    }
+
+    if (networkArg.empty() && networkIndex < 0) {
+        cerr << "Error: Missing 'network' argument" << endl;
+        exit(1);
+    }
+
+    if (concurrency == 0 || threads == 0) {
+        cerr << "Error: Concurrency and threads must be at least one" << endl;
+        exit(1);
+    }
+
+    vector<char> input;
+    if (!ifmArg.empty()) {
+        ifstream stream(ifmArg, ios::binary);
+        if (!stream.is_open()) {
+            cerr << "Error: Failed to open '" << ifmArg << "'" << endl;
+            exit(1);
+        }
+
+        input.assign(istreambuf_iterator<char>(stream), istreambuf_iterator<char>());
+    }
+
+    try {
+        shared_ptr<Device> device = NetworkCache::instance().getDevice(devArg);
+        shared_ptr<Network> network;
+
+        if (networkIndex < 0) {
+            network = NetworkCache::instance().getNetwork(devArg, networkArg);
+        } else {
+            network = make_shared<Network>(*device, networkIndex);
+        }
+
+        // Inferences run on an arena only, which holds the input and output tensors of vela models
+        if (!network->isVelaModel()) {
+            cerr << "Error: Only models compiled by vela are supported" << endl;
+            return 1;
+        }
+
+        Schedule schedule(warmup, iterations, duration);
+        Results results;
+        vector<thread> workers;
+        vector<string> errors(threads);
+
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([&, i]() {
+                try {
+                    worker(network, input, concurrency, arenaSizeOfMB, enabledCounters, enableCycleCounter, timeout,
+                           schedule, results);
+                } catch (std::exception &e) { errors[i] = e.what(); }
+            });
+        }
+
+        for (auto &t : workers) {
+            t.join();
+        }
+
+        for (auto &error : errors) {
+            if (!error.empty()) {
+                cerr << "Error: " << error << endl;
+                return 1;
+            }
+        }
+
+        double elapsed = results.measuring
+                             ? chrono::duration<double>(results.lastCompleted - results.firstMeasured).count()
+                             : 0.0;
+        size_t measured = results.samples.size() + results.failed;
+
+        vector<uint64_t> latencies;
+        vector<uint64_t> cycles;
+        for (auto &sample : results.samples) {
+            latencies.push_back(sample.latencyNanos);
+            cycles.push_back(sample.cycles);
+        }
+
+        ofstream file;
+        if (!outputArg.empty()) {
+            file.open(outputArg);
+            if (!file.is_open()) {
+                cerr << "Error: Failed to open '" << outputArg << "'" << endl;
+                return 1;
+            }
+        }
+
+        ostream &out = outputArg.empty() ? cout : file;
+
+        out << "{\n"
+            << "  \"network\": " << jsonString(networkIndex < 0 ? networkArg : to_string(networkIndex)) << ",\n"
+            << "  \"device\": " << jsonString(devArg) << ",\n"
+            << "  \"warmup\": " << warmup << ",\n"
+            << "  \"iterations\": " << (duration > 0 ? 0 : iterations) << ",\n"
+            << "  \"duration_s\": " << duration << ",\n"
+            << "  \"concurrency\": " << concurrency << ",\n"
+            << "  \"threads\": " << threads << ",\n"
+            << "  \"completed\": " << results.samples.size() << ",\n"
+            << "  \"failed\": " << results.failed << ",\n"
+            << "  \"elapsed_s\": " << fixed << setprecision(6) << elapsed << ",\n"
+            << "  \"throughput_ips\": " << setprecision(3) << (elapsed > 0 ? measured / elapsed : 0.0) << ",\n"
+            << "  \"latency_us\": ";
+        writeStatistics(out, "  ", latencies, 1000.0);
+
+        if (enableCycleCounter) {
+            out << ",\n  \"cycles\": ";
+            writeStatistics(out, "  ", cycles, 1.0);
+        }
+
+        // Mean count of every configured PMU event
+        out << ",\n  \"pmu\": [";
+        bool first = true;
+        for (size_t i = 0; i < enabledCounters.size(); i++) {
+            if (enabledCounters[i] == 0) {
+                continue;
+            }
+
+            double sum = 0;
+            for (auto &sample : results.samples) {
+                sum += sample.pmuCounters[i];
+            }
+
+            out << (first ? "\n" : ",\n") << "    { \"event\": " << enabledCounters[i]
+                << ", \"mean\": " << (results.samples.empty() ? 0.0 : sum / results.samples.size()) << " }";
+            first = false;
+        }
+        out << (first ? "]\n" : "\n  ]\n") << "}" << endl;
+    } catch (Exception &e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
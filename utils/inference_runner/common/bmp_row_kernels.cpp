@@ -0,0 +1,229 @@
+/*
+ * Copyright 2020-2022 NXP
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Row kernels converting BMP pixel rows to RGB or gray.
+ *
+ * BMP stores color pixels as BGR or BGRA. Every kernel converts one row of
+ * 'width' pixels and handles the tail of the row with the scalar kernel. The
+ * x86 kernels are compiled with function level target attributes, so that the
+ * best one can be selected at runtime without building the whole application
+ * for a newer instruction set. NEON is part of the AArch64 baseline.
+ */
+
+#include <cstring>
+#include <vector>
+
+#include "pre_post_processing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BMP_KERNELS_X86
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BMP_KERNELS_NEON
+#endif
+
+namespace {
+
+void grayRow(const uint8_t* src, uint8_t* dst, int width)
+{
+    memcpy(dst, src, width);
+}
+
+void bgrRowScalar(const uint8_t* src, uint8_t* dst, int width)
+{
+    for (int i = 0; i < width; i++, src += 3, dst += 3)
+    {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+    }
+}
+
+void bgraRowScalar(const uint8_t* src, uint8_t* dst, int width)
+{
+    for (int i = 0; i < width; i++, src += 4, dst += 3)
+    {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+    }
+}
+
+#ifdef BMP_KERNELS_X86
+
+/*
+ * The 16 byte stores write one byte past the 15 converted bytes, which the
+ * next iteration overwrites. The loops stop while 16 bytes still fit in the
+ * row.
+ */
+__attribute__((target("ssse3")))
+void bgrRowSsse3(const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m128i swap = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    int i = 0;
+
+    for (; i + 6 <= width; i += 5)
+    {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3), _mm_shuffle_epi8(pixels, swap));
+    }
+
+    bgrRowScalar(src + i * 3, dst + i * 3, width - i);
+}
+
+__attribute__((target("ssse3")))
+void bgraRowSsse3(const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    int i = 0;
+
+    for (; i + 6 <= width; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3), _mm_shuffle_epi8(pixels, pack));
+    }
+
+    bgraRowScalar(src + i * 4, dst + i * 3, width - i);
+}
+
+/*
+ * AVX2 shuffles stay within 128-bit lanes, so each lane converts its own five
+ * BGR pixels, or four BGRA pixels that are then packed across the lanes.
+ */
+__attribute__((target("avx2")))
+void bgrRowAvx2(const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m256i swap = _mm256_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15,
+                                          2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    int i = 0;
+
+    for (; i + 11 <= width; i += 10)
+    {
+        __m256i pixels = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3 + 15)), 1);
+        __m256i rgb = _mm256_shuffle_epi8(pixels, swap);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3), _mm256_castsi256_si128(rgb));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3 + 15), _mm256_extracti128_si256(rgb, 1));
+    }
+
+    bgrRowSsse3(src + i * 3, dst + i * 3, width - i);
+}
+
+__attribute__((target("avx2")))
+void bgraRowAvx2(const uint8_t* src, uint8_t* dst, int width)
+{
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    int i = 0;
+
+    for (; i + 11 <= width; i += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+        __m256i rgb = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, pack), join);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 3), rgb);
+    }
+
+    bgraRowSsse3(src + i * 4, dst + i * 3, width - i);
+}
+
+#endif
+
+#ifdef BMP_KERNELS_NEON
+
+void bgrRowNeon(const uint8_t* src, uint8_t* dst, int width)
+{
+    int i = 0;
+
+    for (; i + 16 <= width; i += 16)
+    {
+        uint8x16x3_t bgr = vld3q_u8(src + i * 3);
+        uint8x16x3_t rgb = {{bgr.val[2], bgr.val[1], bgr.val[0]}};
+        vst3q_u8(dst + i * 3, rgb);
+    }
+
+    bgrRowScalar(src + i * 3, dst + i * 3, width - i);
+}
+
+void bgraRowNeon(const uint8_t* src, uint8_t* dst, int width)
+{
+    int i = 0;
+
+    for (; i + 16 <= width; i += 16)
+    {
+        uint8x16x4_t bgra = vld4q_u8(src + i * 4);
+        uint8x16x3_t rgb = {{bgra.val[2], bgra.val[1], bgra.val[0]}};
+        vst3q_u8(dst + i * 3, rgb);
+    }
+
+    bgraRowScalar(src + i * 4, dst + i * 3, width - i);
+}
+
+#endif
+
+const BmpRowKernels scalarKernels = {"scalar", grayRow, bgrRowScalar, bgraRowScalar};
+
+#ifdef BMP_KERNELS_X86
+const BmpRowKernels ssse3Kernels = {"ssse3", grayRow, bgrRowSsse3, bgraRowSsse3};
+const BmpRowKernels avx2Kernels = {"avx2", grayRow, bgrRowAvx2, bgraRowAvx2};
+#endif
+
+#ifdef BMP_KERNELS_NEON
+const BmpRowKernels neonKernels = {"neon", grayRow, bgrRowNeon, bgraRowNeon};
+#endif
+
+} // namespace
+
+std::vector<const BmpRowKernels*> IMAGE_AvailableRowKernels()
+{
+    std::vector<const BmpRowKernels*> kernels;
+
+    // Ordered from the slowest to the fastest
+    kernels.push_back(&scalarKernels);
+
+#ifdef BMP_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        kernels.push_back(&ssse3Kernels);
+    }
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.push_back(&avx2Kernels);
+    }
+#endif
+
+#ifdef BMP_KERNELS_NEON
+    kernels.push_back(&neonKernels);
+#endif
+
+    return kernels;
+}
+
+const BmpRowKernels& IMAGE_SelectRowKernels()
+{
+    static const BmpRowKernels* selected = IMAGE_AvailableRowKernels().back();
+    return *selected;
+}
@@ -17,6 +17,7 @@ limitations under the License.
 /* File modified by NXP. Changes are described in file
    /middleware/eiq/tensorflow-lite/readme.txt in section "Release notes" */
 
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <unistd.h>
@@ -25,140 +26,133 @@ limitations under the License.
 #include <unistd.h>
 
 #include "pre_post_processing.h"
-#include <assert.h>
 
-uint8_t s_buffer[DECODE_BUFFER_SIZE];
-
-int32_t IMAGE_Decode(const uint8_t* srcData, uint8_t* dstData,
-                      int32_t dstWidth, int32_t dstHeight, int32_t dstChannels)
+/* BMP header fields are little endian and not aligned */
+template <class T>
+static T readField(const uint8_t* srcData, size_t offset)
 {
-    const int32_t headerSize =
-        *((const int32_t*)(srcData + 10));
-    const int32_t width = *((const int32_t*)(srcData + 18));
-    const int32_t height = *((const int32_t*)(srcData + 22));
-    const int32_t bpp = *((const int32_t*)(srcData + 28));
-    const int channels = bpp / 8;
+    T value;
+    memcpy(&value, srcData + offset, sizeof(value));
+    return value;
+}
 
-    // there may be padding bytes when the width is not a multiple of 4 bytes
-    // 8 * channels == bits per pixel
-    const int rowSize = (8 * channels * width + 31) / 32 * 4;
+int32_t IMAGE_ParseBmp(const uint8_t* srcData, size_t srcSize, BmpImage& image)
+{
+    if (srcSize < 32 || srcData[0] != 'B' || srcData[1] != 'M')
+    {
+        return -1;
+    }
 
-    // if height is negative, data layout is top down
-    // otherwise, it's bottom up
-    bool topDown = (height < 0);
+    const int32_t headerSize = readField<int32_t>(srcData, 10);
+    const int32_t width = readField<int32_t>(srcData, 18);
+    const int32_t height = readField<int32_t>(srcData, 22);
+    const int16_t bpp = readField<int16_t>(srcData, 28);
 
-    if (width * height * channels > DECODE_BUFFER_SIZE)
+    if (headerSize < 0 || width <= 0 || height == 0 || height == INT32_MIN)
     {
         return -1;
     }
 
-    const uint8_t* bmpPixels = &srcData[headerSize];
-    for (int i = 0; i < height; i++)
+    // 32-bit pixels are decoded to RGB, the alpha channel is dropped
+    switch (bpp)
     {
-        int srcPos;
-        int dstPos;
+        case 8:
+            image.channels = 1;
+            break;
+        case 24:
+        case 32:
+            image.channels = 3;
+            break;
+        default:
+            return -1;
+    }
 
-        for (int j = 0; j < width; j++)
-        {
-            if (!topDown)
-            {
-                srcPos = ((height - 1 - i) * rowSize) + j * channels;
-            }
-            else
-            {
-                srcPos = i * rowSize + j * channels;
-            }
-
-            dstPos = (i * width + j) * channels;
-
-            switch (channels)
-            {
-                case 1:
-                    s_buffer[dstPos] = bmpPixels[srcPos];
-                    break;
-                case 3:
-                    // BGR -> RGB
-                    s_buffer[dstPos] = bmpPixels[srcPos + 2];
-                    s_buffer[dstPos + 1] = bmpPixels[srcPos + 1];
-                    s_buffer[dstPos + 2] = bmpPixels[srcPos];
-                    break;
-                default:
-                    return -1;
-            }
-        }
+    // if height is negative, data layout is top down
+    // otherwise, it's bottom up
+    image.pixels = &srcData[headerSize];
+    image.width = width;
+    image.height = height < 0 ? -height : height;
+    image.bpp = bpp;
+    image.topDown = height < 0;
+
+    // there may be padding bytes when the width is not a multiple of 4 bytes
+    const int64_t rowSize = (int64_t(bpp) * width + 31) / 32 * 4;
+    if (rowSize > INT32_MAX || uint64_t(headerSize) + uint64_t(rowSize) * image.height > srcSize)
+    {
+        return -1;
     }
 
-    assert(channels == dstChannels);
-    IMAGE_Resize(s_buffer, width, height, dstData, dstWidth, dstHeight, channels);
+    image.rowSize = rowSize;
 
     return 0;
 }
 
-/* Simple resize using nearest neighbor */
-void IMAGE_Resize(uint8_t* srcData, int srcWidth, int srcHeight,
-                  uint8_t* dstData, int dstWidth, int dstHeight, int channels)
+void IMAGE_DecodeBmpRow(const BmpImage& image, int row, uint8_t* dstRow, const BmpRowKernels& kernels)
 {
-    double dx = 1.0 * dstWidth / srcWidth;
-    double dy = 1.0 * dstHeight / srcHeight;
+    BmpRowKernel kernel = image.bpp == 8 ? kernels.gray : image.bpp == 24 ? kernels.bgr : kernels.bgra;
+    const int srcRow = image.topDown ? row : image.height - 1 - row;
+
+    kernel(image.pixels + size_t(srcRow) * image.rowSize, dstRow, image.width);
+}
 
-    int step = channels * srcWidth;
-    int scale_step = channels * dstWidth;
+void IMAGE_DecodeBmp(const BmpImage& image, uint8_t* dstData, const BmpRowKernels& kernels)
+{
+    const size_t dstRowSize = size_t(image.width) * image.channels;
 
-    int i, j, k, pre_i, pre_j, after_i, after_j;
-    if (channels == 1)
+    for (int i = 0; i < image.height; i++)
     {
-        for (i = 0; i < dstHeight; i++)
-        {
-            for (j = 0; j < dstWidth; j++)
-            {
-                dstData[(dstHeight - 1 - i) * scale_step + j] = 0;
-            }
-        }
+        IMAGE_DecodeBmpRow(image, i, dstData + i * dstRowSize, kernels);
+    }
+}
 
-        for (i = 0; i < dstHeight; i++)
-        {
-            for (j = 0; j < dstWidth; j++)
-            {
-              after_i = i;
-              after_j = j;
-              pre_i = (int)(after_i / dy + 0);
-              pre_j = (int)(after_j / dx + 0);
-              if (pre_i >= 0 && pre_i < srcHeight && pre_j >= 0 && pre_j < srcWidth)
-              {
-                  dstData[i * scale_step + j] = srcData[pre_i * step + pre_j];
-              }
-            }
-        }
+int32_t IMAGE_DecodeRows(const uint8_t* srcData, size_t srcSize, uint8_t* dstData, size_t dstStride,
+                         int32_t dstWidth, int32_t dstHeight, int32_t dstChannels,
+                         const ResizeOptions& options, const RowConverter& convert, ImageScratch* scratch)
+{
+    static thread_local ImageScratch threadScratch;
+    BmpImage image;
+
+    if (IMAGE_ParseBmp(srcData, srcSize, image) != 0 || image.channels != dstChannels)
+    {
+        return -1;
     }
-    else if (channels == 3)
+
+    if (scratch == nullptr)
     {
-        for (i = 0; i < dstHeight; i++)
-        {
-            for (j = 0; j < dstWidth; j++)
-            {
-                for (k = 0; k < 3; k++)
-                {
-                    dstData[(dstHeight - 1 - i) * scale_step + j * 3 + k] = 0;
-                }
-            }
-        }
-        for (i = 0; i < dstHeight; i++)
+        scratch = &threadScratch;
+    }
+
+    // Source rows are decoded when the resizer first needs them, into a single row
+    const BmpRowKernels& kernels = IMAGE_SelectRowKernels();
+    uint8_t* decoded = scratch->getRow(size_t(image.width) * image.channels);
+    ImageResizer::RowSource source = [&image, decoded, &kernels](int row) {
+        IMAGE_DecodeBmpRow(image, row, decoded, kernels);
+        return decoded;
+    };
+
+    ImageResizer& resizer =
+        scratch->getResizer(image.width, image.height, dstWidth, dstHeight, image.channels, options);
+
+    for (int row = 0; row < dstHeight; row++)
+    {
+        uint8_t* dstRow = dstData + row * dstStride;
+
+        resizer.resizeRow(row, source, dstRow);
+
+        if (convert && convert(dstRow, dstWidth * dstChannels) != 0)
         {
-            for (j = 0; j < dstWidth; j++)
-            {
-                after_i = i;
-                after_j = j;
-                pre_i = (int)(after_i / dy + 0.5);
-                pre_j = (int)(after_j / dx + 0.5);
-                if (pre_i >= 0 && pre_i < srcHeight && pre_j >= 0 && pre_j < srcWidth)
-                {
-                    for (k = 0; k < 3; k++)
-                    {
-                        dstData[i * scale_step + j * 3 + k] = srcData[pre_i * step + pre_j * 3 + k];
-                    }
-                }
-            }
+            return -1;
         }
     }
+
+    return 0;
 }
 
+int32_t IMAGE_Decode(const uint8_t* srcData, uint8_t* dstData,
+                      int32_t dstWidth, int32_t dstHeight, int32_t dstChannels,
+                      const ResizeOptions& options)
+{
+    // The size of the image is not known, only the header is checked against its own sizes
+    return IMAGE_DecodeRows(srcData, SIZE_MAX, dstData, size_t(dstWidth) * dstChannels, dstWidth, dstHeight,
+                            dstChannels, options, RowConverter());
+}
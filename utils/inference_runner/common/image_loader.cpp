@@ -0,0 +1,92 @@
+/*
+ * Copyright 2020-2022 NXP
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pre_post_processing.h"
+
+uint8_t* ImageScratch::getRow(size_t size)
+{
+    if (row.size() < size)
+    {
+        row.resize(size);
+    }
+
+    return row.data();
+}
+
+ImageResizer& ImageScratch::getResizer(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int channels,
+                                       const ResizeOptions& options)
+{
+    if (resizer && resizer->matches(srcWidth, srcHeight, dstWidth, dstHeight, channels, options))
+    {
+        resizer->reset();
+    }
+    else
+    {
+        resizer.reset(new ImageResizer(srcWidth, srcHeight, dstWidth, dstHeight, channels, options));
+    }
+
+    return *resizer;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr)
+    {
+        munmap(data, size);
+    }
+}
+
+int32_t MappedFile::open(const string& filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // The mapping stays valid after the file descriptor is closed
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    if (data != nullptr)
+    {
+        munmap(data, size);
+    }
+
+    data = static_cast<uint8_t*>(mapping);
+    size = st.st_size;
+
+    return 0;
+}
@@ -0,0 +1,406 @@
+/*
+ * Copyright 2020-2022 NXP
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Separable image resize with fixed-point weights.
+ *
+ * Every output coordinate is a weighted sum of source pixels, with weights in
+ * Q12 that add up to 4096. Sampling uses pixel centers, as the half pixel
+ * centers resize in TensorFlow. The horizontal pass rounds the sums of a source
+ * row to Q8 and keeps them as 16-bit values, and the vertical pass blends those
+ * rows into 32-bit Q20 sums before rounding back to 8 bits.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "pre_post_processing.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define WEIGHT_BITS 12
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+namespace {
+
+inline uint16_t toQ8(uint32_t sum)
+{
+    return (sum + (1 << (WEIGHT_BITS - 9))) >> (WEIGHT_BITS - 8);
+}
+
+void resampleGray(const uint8_t* src, uint16_t* dst, int width, const int32_t* first, const int32_t* index,
+                  const uint16_t* weight)
+{
+    for (int x = 0; x < width; x++)
+    {
+        uint32_t sum = 0;
+
+        for (int t = first[x]; t < first[x + 1]; t++)
+        {
+            sum += src[index[t]] * weight[t];
+        }
+
+        dst[x] = toQ8(sum);
+    }
+}
+
+void resampleRgb(const uint8_t* src, uint16_t* dst, int width, const int32_t* first, const int32_t* index,
+                 const uint16_t* weight)
+{
+    for (int x = 0; x < width; x++, dst += 3)
+    {
+        uint32_t r = 0;
+        uint32_t g = 0;
+        uint32_t b = 0;
+
+        for (int t = first[x]; t < first[x + 1]; t++)
+        {
+            const uint8_t* p = src + index[t] * 3;
+            const uint32_t w = weight[t];
+
+            r += p[0] * w;
+            g += p[1] * w;
+            b += p[2] * w;
+        }
+
+        dst[0] = toQ8(r);
+        dst[1] = toQ8(g);
+        dst[2] = toQ8(b);
+    }
+}
+
+void resampleRow(const uint8_t* src, uint16_t* dst, int width, int channels, const int32_t* first,
+                 const int32_t* index, const uint16_t* weight)
+{
+    for (int x = 0; x < width; x++, dst += channels)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            uint32_t sum = 0;
+
+            for (int t = first[x]; t < first[x + 1]; t++)
+            {
+                sum += src[index[t] * channels + c] * weight[t];
+            }
+
+            dst[c] = toQ8(sum);
+        }
+    }
+}
+
+/* Blends 'count' resampled rows of 'size' values into 8-bit pixels */
+void blendRows(const uint16_t* const* rows, const uint16_t* weights, int count, uint8_t* dst, int size)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS + 7));
+
+    for (; i + 8 <= size; i += 8)
+    {
+        __m128i lo = round;
+        __m128i hi = round;
+
+        for (int r = 0; r < count; r++)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[r] + i));
+            const __m128i w = _mm_set1_epi16(weights[r]);
+            const __m128i productLo = _mm_mullo_epi16(v, w);
+            const __m128i productHi = _mm_mulhi_epu16(v, w);
+
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(productLo, productHi));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(productLo, productHi));
+        }
+
+        const __m128i pixels =
+            _mm_packs_epi32(_mm_srli_epi32(lo, WEIGHT_BITS + 8), _mm_srli_epi32(hi, WEIGHT_BITS + 8));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(pixels, pixels));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= size; i += 8)
+    {
+        uint32x4_t lo = vdupq_n_u32(0);
+        uint32x4_t hi = vdupq_n_u32(0);
+
+        for (int r = 0; r < count; r++)
+        {
+            const uint16x8_t v = vld1q_u16(rows[r] + i);
+            lo = vmlal_n_u16(lo, vget_low_u16(v), weights[r]);
+            hi = vmlal_n_u16(hi, vget_high_u16(v), weights[r]);
+        }
+
+        lo = vrshrq_n_u32(lo, WEIGHT_BITS + 8);
+        hi = vrshrq_n_u32(hi, WEIGHT_BITS + 8);
+        vst1_u8(dst + i, vmovn_u16(vcombine_u16(vmovn_u32(lo), vmovn_u32(hi))));
+    }
+#endif
+
+    for (; i < size; i++)
+    {
+        uint32_t sum = 1 << (WEIGHT_BITS + 7);
+
+        for (int r = 0; r < count; r++)
+        {
+            sum += uint32_t(rows[r][i]) * weights[r];
+        }
+
+        dst[i] = sum >> (WEIGHT_BITS + 8);
+    }
+}
+
+} // namespace
+
+ImageResizer::Taps ImageResizer::makeTaps(int srcSize, int dstSize, ResizeMode mode)
+{
+    const double scale = double(srcSize) / dstSize;
+    Taps taps;
+
+    auto add = [&taps](int index, int weight) {
+        if (weight > 0)
+        {
+            taps.index.push_back(index);
+            taps.weight.push_back(weight);
+        }
+    };
+
+    for (int d = 0; d < dstSize; d++)
+    {
+        taps.first.push_back(taps.index.size());
+
+        switch (mode)
+        {
+            case ResizeMode::NEAREST:
+                add(std::min(int((d + 0.5) * scale), srcSize - 1), WEIGHT_ONE);
+                break;
+            case ResizeMode::BILINEAR:
+            {
+                const double center = std::min(std::max((d + 0.5) * scale - 0.5, 0.0), srcSize - 1.0);
+                const int i0 = int(center);
+                const int w1 = std::lround((center - i0) * WEIGHT_ONE);
+
+                add(i0, WEIGHT_ONE - w1);
+                add(std::min(i0 + 1, srcSize - 1), w1);
+                break;
+            }
+            case ResizeMode::AREA:
+            {
+                // Weights are rounded from the accumulated coverage, so that they add up to WEIGHT_ONE
+                const double lo = d * scale;
+                const double hi = std::min((d + 1) * scale, double(srcSize));
+                double covered = 0;
+                int assigned = 0;
+
+                for (int i = int(lo); i < hi; i++)
+                {
+                    covered += std::min(hi, i + 1.0) - std::max(lo, double(i));
+                    const int w = std::lround(covered / (hi - lo) * WEIGHT_ONE) - assigned;
+
+                    add(i, w);
+                    assigned += w;
+                }
+                break;
+            }
+        }
+    }
+
+    taps.first.push_back(taps.index.size());
+
+    return taps;
+}
+
+ImageResizer::ImageResizer(int _srcWidth, int _srcHeight, int _dstWidth, int _dstHeight, int _channels,
+                           const ResizeOptions& _options) :
+    srcWidth(_srcWidth), srcHeight(_srcHeight), dstWidth(_dstWidth), dstHeight(_dstHeight), channels(_channels),
+    options(_options), innerX(0), innerY(0), innerWidth(_dstWidth), innerHeight(_dstHeight), nearestSrcRow(-1)
+{
+    if (options.letterbox)
+    {
+        const double scale = std::min(double(dstWidth) / srcWidth, double(dstHeight) / srcHeight);
+
+        innerWidth = std::min(std::max(int(std::lround(srcWidth * scale)), 1), dstWidth);
+        innerHeight = std::min(std::max(int(std::lround(srcHeight * scale)), 1), dstHeight);
+        innerX = (dstWidth - innerWidth) / 2;
+        innerY = (dstHeight - innerHeight) / 2;
+    }
+
+    xTaps = makeTaps(srcWidth, innerWidth, options.mode);
+    yTaps = makeTaps(srcHeight, innerHeight, options.mode);
+
+    if (options.mode == ResizeMode::NEAREST)
+    {
+        nearestRow.resize(innerWidth * channels);
+        return;
+    }
+
+    // A ring as large as the span of source rows blended into one output row holds all of them
+    size_t rows = 1;
+    size_t taps = 1;
+    for (int y = 0; y < innerHeight; y++)
+    {
+        rows = std::max(rows, size_t(yTaps.index[yTaps.first[y + 1] - 1] - yTaps.index[yTaps.first[y]] + 1));
+        taps = std::max(taps, size_t(yTaps.first[y + 1] - yTaps.first[y]));
+    }
+
+    rowCache.resize(rows * innerWidth * channels);
+    cachedRows.assign(rows, -1);
+    blendSources.resize(taps);
+    blendWeights.resize(taps);
+}
+
+bool ImageResizer::matches(int _srcWidth, int _srcHeight, int _dstWidth, int _dstHeight, int _channels,
+                           const ResizeOptions& _options) const
+{
+    return srcWidth == _srcWidth && srcHeight == _srcHeight && dstWidth == _dstWidth && dstHeight == _dstHeight &&
+           channels == _channels && options.mode == _options.mode && options.letterbox == _options.letterbox &&
+           options.fill == _options.fill;
+}
+
+void ImageResizer::reset()
+{
+    // Rows cached from the previous image
+    cachedRows.assign(cachedRows.size(), -1);
+    nearestSrcRow = -1;
+}
+
+const uint16_t* ImageResizer::resampledRow(int row, const RowSource& source)
+{
+    const size_t slot = row % cachedRows.size();
+    uint16_t* dst = &rowCache[slot * innerWidth * channels];
+
+    if (cachedRows[slot] == row)
+    {
+        return dst;
+    }
+
+    const uint8_t* src = source(row);
+    const int32_t* first = xTaps.first.data();
+    const int32_t* index = xTaps.index.data();
+    const uint16_t* weight = xTaps.weight.data();
+
+    switch (channels)
+    {
+        case 1:
+            resampleGray(src, dst, innerWidth, first, index, weight);
+            break;
+        case 3:
+            resampleRgb(src, dst, innerWidth, first, index, weight);
+            break;
+        default:
+            resampleRow(src, dst, innerWidth, channels, first, index, weight);
+            break;
+    }
+
+    cachedRows[slot] = row;
+
+    return dst;
+}
+
+void ImageResizer::resizeRow(int row, const RowSource& source, uint8_t* dstRow)
+{
+    const int y = row - innerY;
+
+    if (y < 0 || y >= innerHeight)
+    {
+        memset(dstRow, options.fill, dstWidth * channels);
+        return;
+    }
+
+    memset(dstRow, options.fill, innerX * channels);
+    memset(dstRow + (innerX + innerWidth) * channels, options.fill, (dstWidth - innerX - innerWidth) * channels);
+    dstRow += innerX * channels;
+
+    if (options.mode == ResizeMode::NEAREST)
+    {
+        const int srcRow = yTaps.index[y];
+
+        // Upscaling repeats source rows, which are only gathered once
+        if (srcRow != nearestSrcRow)
+        {
+            const uint8_t* src = source(srcRow);
+            uint8_t* dst = nearestRow.data();
+
+            for (int x = 0; x < innerWidth; x++, dst += channels)
+            {
+                memcpy(dst, src + xTaps.index[x] * channels, channels);
+            }
+
+            nearestSrcRow = srcRow;
+        }
+
+        memcpy(dstRow, nearestRow.data(), innerWidth * channels);
+        return;
+    }
+
+    const int count = yTaps.first[y + 1] - yTaps.first[y];
+    for (int t = 0; t < count; t++)
+    {
+        const int tap = yTaps.first[y] + t;
+        blendSources[t] = resampledRow(yTaps.index[tap], source);
+        blendWeights[t] = yTaps.weight[tap];
+    }
+
+    blendRows(blendSources.data(), blendWeights.data(), count, dstRow, innerWidth * channels);
+}
+
+void ImageResizer::resize(const uint8_t* srcData, uint8_t* dstData)
+{
+    const size_t srcStride = size_t(srcWidth) * channels;
+    const size_t dstStride = size_t(dstWidth) * channels;
+    RowSource source = [srcData, srcStride](int row) { return srcData + row * srcStride; };
+
+    for (int row = 0; row < dstHeight; row++)
+    {
+        resizeRow(row, source, dstData + row * dstStride);
+    }
+}
+
+bool IMAGE_ParseResizeMode(const string& name, ResizeMode& mode)
+{
+    if (name == "nearest")
+    {
+        mode = ResizeMode::NEAREST;
+    }
+    else if (name == "bilinear")
+    {
+        mode = ResizeMode::BILINEAR;
+    }
+    else if (name == "area")
+    {
+        mode = ResizeMode::AREA;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/* Resize using nearest neighbor */
+void IMAGE_Resize(uint8_t* srcData, int srcWidth, int srcHeight,
+                  uint8_t* dstData, int dstWidth, int dstHeight, int channels)
+{
+    ImageResizer(srcWidth, srcHeight, dstWidth, dstHeight, channels).resize(srcData, dstData);
+}
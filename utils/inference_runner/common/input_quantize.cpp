@@ -0,0 +1,224 @@
+/*
+ * Copyright 2020-2022 NXP
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Conversion of 8-bit pixels to input tensor values.
+ *
+ * Normalization and quantization fold into one multiply-add per value,
+ * value = pixel * a + b. The vector kernels widen 16 pixels to float, and for
+ * integer tensors round to nearest even and narrow back with saturation, the
+ * same as the scalar code with lrintf. Blocks are converted from the end of
+ * the row towards its start, and each block is loaded before it is stored,
+ * so the destination may overlap the start of the source even when it is
+ * wider.
+ */
+
+#include <cmath>
+
+#include "pre_post_processing.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define QUANTIZE_NEON
+#endif
+
+namespace {
+
+struct Affine {
+    float a;
+    float b;
+};
+
+Affine affine(const InputQuantization& q, bool quantized, int32_t legacyOffset)
+{
+    if (!quantized)
+    {
+        return Affine{1.0f / q.std, -q.mean / q.std};
+    }
+
+    // Without quantization parameters the pixels are only offset into the type range
+    if (q.scale == 0)
+    {
+        return Affine{1.0f, float(legacyOffset)};
+    }
+
+    const float a = 1.0f / (q.std * q.scale);
+    return Affine{a, q.zeroPoint - q.mean * a};
+}
+
+template <class T, int MIN, int MAX>
+void quantizeScalar(const uint8_t* src, T* dst, int size, const Affine& f)
+{
+    for (int i = size - 1; i >= 0; i--)
+    {
+        const long value = lrintf(src[i] * f.a + f.b);
+        dst[i] = value < MIN ? MIN : value > MAX ? MAX : value;
+    }
+}
+
+#if defined(__SSE2__)
+
+/* Widens 16 pixels to four vectors of float and applies value = pixel * a + b */
+inline void widen(__m128i pixels, const Affine& f, __m128 out[4])
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+    const __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+    const __m128 a = _mm_set1_ps(f.a);
+    const __m128 b = _mm_set1_ps(f.b);
+
+    out[0] = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), a), b);
+    out[1] = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), a), b);
+    out[2] = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), a), b);
+    out[3] = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), a), b);
+}
+
+/* Rounds to nearest even and narrows to 16 signed 16-bit values in two vectors */
+inline void narrow(const __m128 in[4], __m128i& lo, __m128i& hi)
+{
+    lo = _mm_packs_epi32(_mm_cvtps_epi32(in[0]), _mm_cvtps_epi32(in[1]));
+    hi = _mm_packs_epi32(_mm_cvtps_epi32(in[2]), _mm_cvtps_epi32(in[3]));
+}
+
+#endif
+
+} // namespace
+
+void IMAGE_ConvertInput(const uint8_t* src, uint8_t* dst, int size, const InputQuantization& q)
+{
+    const Affine f = affine(q, true, 0);
+    int blocks = size / 16;
+
+    quantizeScalar<uint8_t, 0, 255>(src + blocks * 16, dst + blocks * 16, size - blocks * 16, f);
+
+    while (blocks-- > 0)
+    {
+        const int i = blocks * 16;
+#if defined(__SSE2__)
+        __m128 values[4];
+        __m128i lo, hi;
+
+        widen(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), f, values);
+        narrow(values, lo, hi);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+#elif defined(QUANTIZE_NEON)
+        const uint8x16_t pixels = vld1q_u8(src + i);
+        const uint16x8_t lo = vmovl_u8(vget_low_u8(pixels));
+        const uint16x8_t hi = vmovl_u8(vget_high_u8(pixels));
+        int32x4_t v[4];
+
+        v[0] = vcvtnq_s32_f32(vmlaq_n_f32(vdupq_n_f32(f.b), vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), f.a));
+        v[1] = vcvtnq_s32_f32(vmlaq_n_f32(vdupq_n_f32(f.b), vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), f.a));
+        v[2] = vcvtnq_s32_f32(vmlaq_n_f32(vdupq_n_f32(f.b), vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), f.a));
+        v[3] = vcvtnq_s32_f32(vmlaq_n_f32(vdupq_n_f32(f.b), vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), f.a));
+
+        const int16x8_t n0 = vcombine_s16(vqmovn_s32(v[0]), vqmovn_s32(v[1]));
+        const int16x8_t n1 = vcombine_s16(vqmovn_s32(v[2]), vqmovn_s32(v[3]));
+        vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(n0), vqmovun_s16(n1)));
+#else
+        quantizeScalar<uint8_t, 0, 255>(src + i, dst + i, 16, f);
+#endif
+    }
+}
+
+void IMAGE_ConvertInput(const uint8_t* src, int8_t* dst, int size, const InputQuantization& q)
+{
+    const Affine f = affine(q, true, -127);
+    int blocks = size / 16;
+
+    quantizeScalar<int8_t, -128, 127>(src + blocks * 16, dst + blocks * 16, size - blocks * 16, f);
+
+    while (blocks-- > 0)
+    {
+        const int i = blocks * 16;
+#if defined(__SSE2__)
+        __m128 values[4];
+        __m128i lo, hi;
+
+        widen(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), f, values);
+        narrow(values, lo, hi);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi16(lo, hi));
+#elif defined(QUANTIZE_NEON)
+        const uint8x16_t pixels = vld1q_u8(src + i);
+        const uint16x8_t lo = vmovl_u8(vget_low_u8(pixels));
+        const uint16x8_t hi = vmovl_u8(vget_high_u8(pixels));
+        int32x4_t v[4];
+
+        v[0] = vcvtnq_s32_f32(vmlaq_n_f32(vdupq_n_f32(f.b), vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), f.a));
+        v[1] = vcvtnq_s32_f32(vmlaq_n_f32(vdupq_n_f32(f.b), vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), f.a));
+        v[2] = vcvtnq_s32_f32(vmlaq_n_f32(vdupq_n_f32(f.b), vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), f.a));
+        v[3] = vcvtnq_s32_f32(vmlaq_n_f32(vdupq_n_f32(f.b), vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), f.a));
+
+        const int16x8_t n0 = vcombine_s16(vqmovn_s32(v[0]), vqmovn_s32(v[1]));
+        const int16x8_t n1 = vcombine_s16(vqmovn_s32(v[2]), vqmovn_s32(v[3]));
+        vst1q_s8(dst + i, vcombine_s8(vqmovn_s16(n0), vqmovn_s16(n1)));
+#else
+        quantizeScalar<int8_t, -128, 127>(src + i, dst + i, 16, f);
+#endif
+    }
+}
+
+void IMAGE_ConvertInput(const uint8_t* src, float* dst, int size, const InputQuantization& q)
+{
+    const Affine f = affine(q, false, 0);
+    int blocks = size / 16;
+
+    for (int i = size - 1; i >= blocks * 16; i--)
+    {
+        dst[i] = src[i] * f.a + f.b;
+    }
+
+    while (blocks-- > 0)
+    {
+        const int i = blocks * 16;
+#if defined(__SSE2__)
+        __m128 values[4];
+
+        widen(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), f, values);
+        for (int j = 0; j < 4; j++)
+        {
+            _mm_storeu_ps(dst + i + 4 * j, values[j]);
+        }
+#elif defined(QUANTIZE_NEON)
+        const uint8x16_t pixels = vld1q_u8(src + i);
+        const uint16x8_t lo = vmovl_u8(vget_low_u8(pixels));
+        const uint16x8_t hi = vmovl_u8(vget_high_u8(pixels));
+        const float32x4_t b = vdupq_n_f32(f.b);
+        float32x4_t v[4];
+
+        v[0] = vmlaq_n_f32(b, vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), f.a);
+        v[1] = vmlaq_n_f32(b, vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), f.a);
+        v[2] = vmlaq_n_f32(b, vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), f.a);
+        v[3] = vmlaq_n_f32(b, vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), f.a);
+
+        for (int j = 0; j < 4; j++)
+        {
+            vst1q_f32(dst + i + 4 * j, v[j]);
+        }
+#else
+        for (int j = 15; j >= 0; j--)
+        {
+            dst[i + j] = src[i + j] * f.a + f.b;
+        }
+#endif
+    }
+}
@@ -17,76 +17,263 @@
  */
 
 #include <fstream>
+#include <iostream>
 #include <vector>
 #include <tuple>
 #include <queue>
 #include <algorithm>
 #include <cstdint>
+#include <functional>
+#include <memory>
 
 
-#define DECODE_BUFFER_SIZE 1920 * 1080 * 3
+#define MODEL_INPUT_MEAN 127.5f
+#define MODEL_INPUT_STD 127.5f
 
 using namespace std;
 
+/* Sampling used to resize images */
+enum class ResizeMode {
+    NEAREST,
+    BILINEAR,
+    AREA
+};
+
+/*
+ * With letterbox set the image is scaled preserving its aspect ratio, centered,
+ * and the borders are filled with 'fill'.
+ */
+struct ResizeOptions {
+    ResizeOptions(ResizeMode _mode = ResizeMode::NEAREST, bool _letterbox = false, uint8_t _fill = 0) :
+        mode(_mode), letterbox(_letterbox), fill(_fill) {}
+
+    ResizeMode mode;
+    bool letterbox;
+    uint8_t fill;
+};
+
+/*
+ * Resizes 8-bit images one output row at a time.
+ *
+ * The source pixels and fixed-point weights of every output column and row are
+ * computed once by the constructor. Source rows are requested through a
+ * callback, resampled horizontally once, and cached while following output
+ * rows still need them. Rows are best produced in increasing order. A resizer
+ * can be reused for further images of the same size after reset().
+ */
+class ImageResizer {
+public:
+    /* Returns source row 'row', which must stay valid until the next call */
+    typedef std::function<const uint8_t*(int row)> RowSource;
+
+    ImageResizer(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int channels,
+                 const ResizeOptions& options = ResizeOptions());
+
+    bool matches(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int channels,
+                 const ResizeOptions& options) const;
+    void reset();
+    void resizeRow(int row, const RowSource& source, uint8_t* dstRow);
+    void resize(const uint8_t* srcData, uint8_t* dstData);
+
+private:
+    /* Source pixels and Q12 weights of output coordinate i are taps first[i] to first[i + 1] */
+    struct Taps {
+        vector<int32_t> first;
+        vector<int32_t> index;
+        vector<uint16_t> weight;
+    };
+
+    static Taps makeTaps(int srcSize, int dstSize, ResizeMode mode);
+    const uint16_t* resampledRow(int row, const RowSource& source);
+
+    int srcWidth;
+    int srcHeight;
+    int dstWidth;
+    int dstHeight;
+    int channels;
+    ResizeOptions options;
+    int innerX;
+    int innerY;
+    int innerWidth;
+    int innerHeight;
+    Taps xTaps;
+    Taps yTaps;
+    vector<uint16_t> rowCache;
+    vector<int> cachedRows;
+    vector<const uint16_t*> blendSources;
+    vector<uint16_t> blendWeights;
+    vector<uint8_t> nearestRow;
+    int nearestSrcRow;
+};
+
+/* Parses "nearest", "bilinear" or "area" */
+bool IMAGE_ParseResizeMode(const string& name, ResizeMode& mode);
+
 void IMAGE_Resize(uint8_t* srcData, int srcWidth, int srcHeight,
                   uint8_t* dstData, int dstWidth, int dstHeight, int channels);
 
 int32_t IMAGE_Decode(const uint8_t* srcData, uint8_t* dstData,
-                      int32_t dstWidth, int32_t dstHeight, int32_t dstChannels);
+                      int32_t dstWidth, int32_t dstHeight, int32_t dstChannels,
+                      const ResizeOptions& options = ResizeOptions());
+
+/* Converts one row of 'width' BMP pixels to gray or RGB */
+typedef void (*BmpRowKernel)(const uint8_t* src, uint8_t* dst, int width);
+
+/* Row kernels for 8-bit gray, 24-bit BGR and 32-bit BGRA pixels */
+struct BmpRowKernels {
+    const char* name;
+    BmpRowKernel gray;
+    BmpRowKernel bgr;
+    BmpRowKernel bgra;
+};
+
+/* Pixel layout of a BMP image, decoded to 'channels' channels per pixel */
+struct BmpImage {
+    const uint8_t* pixels;
+    int32_t width;
+    int32_t height;
+    int32_t bpp;
+    int32_t channels;
+    int32_t rowSize;
+    bool topDown;
+};
+
+/* Row kernels supported by this CPU, ordered from the slowest to the fastest */
+vector<const BmpRowKernels*> IMAGE_AvailableRowKernels();
 
+/* Fastest row kernels supported by this CPU */
+const BmpRowKernels& IMAGE_SelectRowKernels();
+
+/* Parses the header of the 'srcSize' bytes BMP file at 'srcData', and checks that the pixels fit */
+int32_t IMAGE_ParseBmp(const uint8_t* srcData, size_t srcSize, BmpImage& image);
+
+void IMAGE_DecodeBmpRow(const BmpImage& image, int row, uint8_t* dstRow, const BmpRowKernels& kernels);
+
+void IMAGE_DecodeBmp(const BmpImage& image, uint8_t* dstData, const BmpRowKernels& kernels);
+
+/*
+ * Maps pixels to input tensor values.
+ *
+ * Pixels are normalized to (pixel - mean) / std, and quantized to
+ * normalized / scale + zeroPoint for integer tensors. Scale and zero point come
+ * from the model. A scale of zero means they are unknown, and integer tensors
+ * then get the raw pixels, offset by -127 for int8.
+ */
+struct InputQuantization {
+    InputQuantization(float _mean = MODEL_INPUT_MEAN, float _std = MODEL_INPUT_STD, float _scale = 0,
+                      int32_t _zeroPoint = 0) :
+        mean(_mean), std(_std), scale(_scale), zeroPoint(_zeroPoint) {}
+
+    float mean;
+    float std;
+    float scale;
+    int32_t zeroPoint;
+};
+
+/*
+ * Converts 'size' pixels to input values, overloaded on the tensor type. The
+ * destination may start at the same address as the source.
+ */
+void IMAGE_ConvertInput(const uint8_t* src, uint8_t* dst, int size, const InputQuantization& quantization);
+void IMAGE_ConvertInput(const uint8_t* src, int8_t* dst, int size, const InputQuantization& quantization);
+void IMAGE_ConvertInput(const uint8_t* src, float* dst, int size, const InputQuantization& quantization);
+
+/* Reads the scale and zero point of input tensor 'input' from a TFLite model */
+int32_t MODEL_GetInputQuantization(const uint8_t* model, size_t size, size_t input, InputQuantization& quantization);
+int32_t MODEL_ReadInputQuantization(const string& filename, size_t input, InputQuantization& quantization);
+
+/* Converts the 'size' 8-bit values at the start of a destination row in place */
+typedef std::function<int(uint8_t* row, int size)> RowConverter;
+
+/*
+ * Scratch memory for decoding images.
+ *
+ * Holds the decoded source row and the resizer, which are kept for the next
+ * image so that images of the same size need no allocations and reuse the
+ * resize tables. A scratch must only be used by one thread at a time.
+ */
+class ImageScratch {
+public:
+    ImageScratch() {}
+    ImageScratch(const ImageScratch&) = delete;
+    ImageScratch& operator=(const ImageScratch&) = delete;
+
+    uint8_t* getRow(size_t size);
+    ImageResizer& getResizer(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int channels,
+                             const ResizeOptions& options);
+
+private:
+    vector<uint8_t> row;
+    std::unique_ptr<ImageResizer> resizer;
+};
+
+/* Read only memory mapping of a file */
+class MappedFile {
+public:
+    MappedFile() : data(nullptr), size(0) {}
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    int32_t open(const string& filename);
+    const uint8_t* getData() const { return data; }
+    size_t getSize() const { return size; }
+
+private:
+    uint8_t* data;
+    size_t size;
+};
+
+/*
+ * Decodes, resizes and converts a BMP image in one pass over the output rows.
+ *
+ * Each output row is resized straight into the destination, 'dstStride' bytes
+ * apart, and converted by 'convert' while it is still in the cache. Source rows
+ * are decoded as the resize needs them, so no full size copy of the image is
+ * made. Without a scratch, a scratch owned by the calling thread is used.
+ */
+int32_t IMAGE_DecodeRows(const uint8_t* srcData, size_t srcSize, uint8_t* dstData, size_t dstStride,
+                         int32_t dstWidth, int32_t dstHeight, int32_t dstChannels,
+                         const ResizeOptions& options, const RowConverter& convert,
+                         ImageScratch* scratch = nullptr);
+
+/* Converts 'size' 8-bit pixels at the start of 'data' in place, T selects the conversion at compile time */
 template <class T>
-static int convertInputData(T* data, int size) {
-#define MODEL_INPUT_MEAN 127.5f
-#define MODEL_INPUT_STD 127.5f
-    const std::type_info& type = typeid(T);
-
-    if (type == typeid(uint8_t)) {
-        //no need to convert
-    } else if (type == typeid(int8_t)) {
-        for (int i = size - 1; i >= 0; i --) {
-            reinterpret_cast<int8_t*>(data)[i] =
-                static_cast<int>(data[i]) - 127;
-        }
-    } else if (type == typeid(float)) {
-        for (int i = size - 1; i >= 0; i --) {
-            reinterpret_cast<float*>(data)[i] =
-                (static_cast<int>(data[i]) - MODEL_INPUT_MEAN) / MODEL_INPUT_STD;
-        }
-    } else {
-            cerr << "Unknown input tensor data type" << endl;
-            return -1;
-    }
+static int convertInputData(T* data, int size, const InputQuantization &quantization = InputQuantization()) {
+    IMAGE_ConvertInput(reinterpret_cast<const uint8_t*>(data), data, size, quantization);
     return 0;
 }
 
 template <class T>
-static int getInputFromFile(const string &filename, T* inputData, vector<size_t> shape) {
-    // Open IFM file
-    ifstream stream(filename, ios::binary);
-    if (!stream.is_open()) {
+static int getInputFromFile(const string &filename, T* inputData, vector<size_t> shape,
+                            const ResizeOptions &options = ResizeOptions(),
+                            const InputQuantization &quantization = InputQuantization(),
+                            ImageScratch *scratch = nullptr) {
+    // Map the IFM file, only the pages holding rows read by the resize are loaded
+    MappedFile file;
+    if (file.open(filename) != 0) {
         cerr << "Error: Failed to open '" << filename << "'" << endl;
         return -1;
     }
 
-    // Get IFM file size
-    stream.seekg(0, ios_base::end);
-    size_t size = stream.tellg();
-    stream.seekg(0, ios_base::beg);
+    // Decode into the input tensor, converting every row in place from the 8-bit pixels at its start
+    const int32_t height = shape[1], width = shape[2], channels = shape[3];
+    auto convert = [&quantization](uint8_t* row, int size) {
+        return convertInputData<T>(reinterpret_cast<T*>(row), size, quantization);
+    };
 
-    // Set input buffer
-    char s_buffer[DECODE_BUFFER_SIZE];
-    stream.read(s_buffer, size);
-    if (!stream) {
-        cerr << "Error: Failed to read IFM" << endl;
+    if (IMAGE_DecodeRows(file.getData(), file.getSize(), (uint8_t*)inputData, sizeof(T) * width * channels,
+                         width, height, channels, options, convert, scratch) != 0) {
+        cerr << "Error: Failed to decode '" << filename << "' as a " << channels << " channel BMP image" << endl;
         return -1;
     }
-    IMAGE_Decode((uint8_t*)s_buffer, (uint8_t*)inputData, shape[1], shape[2], shape[3]);
-    return convertInputData<T>(inputData, shape[1] * shape[2] * shape[3]);
+
+    return 0;
 }
 
-typedef std::vector<std::tuple<int, float, std::vector<float>>> InferenceResult;
-static InferenceResult getBoundingBoxes(std::vector<void*>data, size_t numResults = 10) {
-    InferenceResult result;
+typedef std::vector<std::tuple<int, float, std::vector<float>>> PostProcessResult;
+static PostProcessResult getBoundingBoxes(std::vector<void*>data, size_t numResults = 10) {
+    PostProcessResult result;
     auto output_locations = (float*)data[0];
     auto output_classes = (float*)data[1];
     auto output_scores = (float*)data[2];
@@ -111,9 +298,9 @@ static InferenceResult getBoundingBoxes(std::vector<void*>data, size_t numResult
 
 
 template <class T>
-static InferenceResult getTopN(T* data, float threshold, int count, float zp, float scale) {
+static PostProcessResult getTopN(T* data, float threshold, int count, float zp, float scale) {
    // Will contain top N results in ascending order.
-   InferenceResult result;
+   PostProcessResult result;
    std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>,
    std::greater<std::pair<float, int>>> top_result_pq;
 
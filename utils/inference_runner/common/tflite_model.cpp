@@ -0,0 +1,173 @@
+/*
+ * Copyright 2020-2022 NXP
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Reads the input tensor quantization from a TFLite model.
+ *
+ * Only the few tables on the path Model -> subgraphs[0] -> tensors[inputs[i]]
+ * -> quantization are walked, directly on the flatbuffer, so the TFLite schema
+ * is not needed. Every offset is checked against the size of the model.
+ */
+
+#include <cstring>
+
+#include "pre_post_processing.h"
+
+namespace {
+
+/* Field ids in the TFLite schema */
+#define MODEL_SUBGRAPHS 2
+#define SUBGRAPH_TENSORS 0
+#define SUBGRAPH_INPUTS 1
+#define TENSOR_QUANTIZATION 4
+#define QUANTIZATION_SCALE 2
+#define QUANTIZATION_ZERO_POINT 3
+
+class FlatBuffer {
+public:
+    FlatBuffer(const uint8_t* _data, size_t _size) : data(_data), size(_size) {}
+
+    template <class T>
+    bool read(size_t pos, T& value) const
+    {
+        if (pos > size || size - pos < sizeof(T))
+        {
+            return false;
+        }
+
+        memcpy(&value, data + pos, sizeof(T));
+        return true;
+    }
+
+    /* Follows the unsigned offset stored at 'pos' */
+    bool follow(size_t pos, size_t& target) const
+    {
+        uint32_t offset;
+
+        if (!read(pos, offset))
+        {
+            return false;
+        }
+
+        target = pos + offset;
+        return target < size;
+    }
+
+    /* Position of field 'id' of the table at 'table', false if absent */
+    bool field(size_t table, int id, size_t& pos) const
+    {
+        int32_t vtableOffset;
+        uint16_t vtableSize;
+        uint16_t fieldOffset;
+
+        if (!read(table, vtableOffset))
+        {
+            return false;
+        }
+
+        const int64_t vtable = int64_t(table) - vtableOffset;
+        if (vtable < 0 || !read(size_t(vtable), vtableSize) || 4 + 2 * id + 2 > vtableSize ||
+            !read(size_t(vtable) + 4 + 2 * id, fieldOffset) || fieldOffset == 0)
+        {
+            return false;
+        }
+
+        pos = table + fieldOffset;
+        return true;
+    }
+
+    /* Table or vector referenced by field 'id' */
+    bool child(size_t table, int id, size_t& target) const
+    {
+        size_t pos;
+        return field(table, id, pos) && follow(pos, target);
+    }
+
+    /* Element 'index' of the vector at 'vector' */
+    bool element(size_t vector, size_t index, size_t elementSize, size_t& pos) const
+    {
+        uint32_t length;
+
+        if (!read(vector, length) || index >= length)
+        {
+            return false;
+        }
+
+        pos = vector + 4 + index * elementSize;
+        return pos + elementSize <= size;
+    }
+
+private:
+    const uint8_t* data;
+    size_t size;
+};
+
+} // namespace
+
+int32_t MODEL_GetInputQuantization(const uint8_t* model, size_t size, size_t input, InputQuantization& quantization)
+{
+    FlatBuffer fb(model, size);
+    size_t root, subgraphs, subgraph, inputs, pos, tensors, tensor, params;
+    int32_t tensorIndex;
+
+    if (!fb.follow(0, root) || !fb.child(root, MODEL_SUBGRAPHS, subgraphs) ||
+        !fb.element(subgraphs, 0, 4, pos) || !fb.follow(pos, subgraph) ||
+        !fb.child(subgraph, SUBGRAPH_INPUTS, inputs) || !fb.element(inputs, input, 4, pos) ||
+        !fb.read(pos, tensorIndex) || tensorIndex < 0 ||
+        !fb.child(subgraph, SUBGRAPH_TENSORS, tensors) || !fb.element(tensors, tensorIndex, 4, pos) ||
+        !fb.follow(pos, tensor))
+    {
+        return -1;
+    }
+
+    // Float inputs have no quantization parameters
+    size_t scales, zeroPoints;
+    float scale;
+    int64_t zeroPoint = 0;
+
+    if (!fb.child(tensor, TENSOR_QUANTIZATION, params) || !fb.child(params, QUANTIZATION_SCALE, scales) ||
+        !fb.element(scales, 0, 4, pos) || !fb.read(pos, scale))
+    {
+        quantization.scale = 0;
+        quantization.zeroPoint = 0;
+        return 0;
+    }
+
+    if (fb.child(params, QUANTIZATION_ZERO_POINT, zeroPoints) && fb.element(zeroPoints, 0, 8, pos))
+    {
+        fb.read(pos, zeroPoint);
+    }
+
+    quantization.scale = scale;
+    quantization.zeroPoint = zeroPoint;
+
+    return 0;
+}
+
+int32_t MODEL_ReadInputQuantization(const string& filename, size_t input, InputQuantization& quantization)
+{
+    ifstream stream(filename, ios::binary);
+    if (!stream.is_open())
+    {
+        return -1;
+    }
+
+    vector<uint8_t> model((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+
+    return MODEL_GetInputQuantization(model.data(), model.size(), input, quantization);
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright 2020-2022 NXP
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "common/pre_post_processing.h"
+
+using namespace std;
+
+namespace {
+int defaultWidth      = 1920;
+int defaultHeight     = 1080;
+int defaultIterations = 50;
+int defaultResize     = 224;
+int defaultThreads    = max(1u, thread::hardware_concurrency());
+
+void help(const string exe) {
+    cerr << "Usage: " << exe << " [ARGS]\n";
+    cerr << "\n";
+    cerr << "Decodes synthetic BMP images with every row kernel supported by this CPU, and\n";
+    cerr << "resizes them with every resize mode. Compares the fused decode, resize and float\n";
+    cerr << "conversion with separate passes, times the input conversion, and loads images from\n";
+    cerr << "a file on several threads. Reports the cost per source megapixel.\n";
+    cerr << "\n";
+    cerr << "Arguments:\n";
+    cerr << "    -h --help        Print this help message.\n";
+    cerr << "    -W --width       Image width (default " << defaultWidth << ").\n";
+    cerr << "    -H --height      Image height (default " << defaultHeight << ").\n";
+    cerr << "    -N --iterations  Decodes per measurement (default " << defaultIterations << ").\n";
+    cerr << "    -r --resize      Resize output width and height (default " << defaultResize << ").\n";
+    cerr << "    -T --threads     Threads loading images from file (default " << defaultThreads << ").\n";
+    cerr << endl;
+}
+
+void rangeCheck(const int i, const int argc, const string arg) {
+    if (i >= argc) {
+        cerr << "Error: Missing argument to '" << arg << "'" << endl;
+        exit(1);
+    }
+}
+
+void put16(vector<uint8_t> &bmp, size_t offset, uint16_t value) {
+    memcpy(&bmp[offset], &value, sizeof(value));
+}
+
+void put32(vector<uint8_t> &bmp, size_t offset, int32_t value) {
+    memcpy(&bmp[offset], &value, sizeof(value));
+}
+
+// Builds a BMP file with random pixels. The 8-bit palette is left out, which the decoder ignores.
+vector<uint8_t> makeBmp(int width, int height, int bpp, bool topDown, mt19937 &random) {
+    const size_t headerSize = 54;
+    const size_t rowSize    = (bpp * width + 31) / 32 * 4;
+    vector<uint8_t> bmp(headerSize + rowSize * height);
+
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    put32(bmp, 2, bmp.size());
+    put32(bmp, 10, headerSize);
+    put32(bmp, 14, 40);
+    put32(bmp, 18, width);
+    put32(bmp, 22, topDown ? -height : height);
+    put16(bmp, 26, 1);
+    put16(bmp, 28, bpp);
+
+    for (size_t i = headerSize; i < bmp.size(); i++) {
+        bmp[i] = random();
+    }
+
+    return bmp;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    const string exe = argv[0];
+    int width      = defaultWidth;
+    int height     = defaultHeight;
+    int iterations = defaultIterations;
+    int resize     = defaultResize;
+    int threads    = defaultThreads;
+
+    for (int i = 1; i < argc; ++i) {
+        const string arg(argv[i]);
+
+        if (arg == "-h" || arg == "--help") {
+            help(exe);
+            exit(1);
+        } else if (arg == "--width" || arg == "-W") {
+            rangeCheck(++i, argc, arg);
+            width = stoi(argv[i]);
+        } else if (arg == "--height" || arg == "-H") {
+            rangeCheck(++i, argc, arg);
+            height = stoi(argv[i]);
+        } else if (arg == "--iterations" || arg == "-N") {
+            rangeCheck(++i, argc, arg);
+            iterations = stoi(argv[i]);
+        } else if (arg == "--resize" || arg == "-r") {
+            rangeCheck(++i, argc, arg);
+            resize = stoi(argv[i]);
+        } else if (arg == "--threads" || arg == "-T") {
+            rangeCheck(++i, argc, arg);
+            threads = stoi(argv[i]);
+        } else {
+            cerr << "Error: Invalid argument '" << arg << "'" << endl;
+            help(exe);
+            exit(1);
+        }
+    }
+
+    if (width <= 0 || height <= 0 || iterations <= 0 || resize <= 0 || threads <= 0) {
+        cerr << "Error: Width, height, iterations, resize and threads must be positive" << endl;
+        exit(1);
+    }
+
+    const vector<const BmpRowKernels *> kernels = IMAGE_AvailableRowKernels();
+    const double megapixels                     = width * double(height) / 1e6;
+    mt19937 random(1);
+    int status = 0;
+
+    cout << "Image " << width << "x" << height << ", " << iterations << " decodes per measurement" << endl;
+    cout << "Selected row kernels: " << IMAGE_SelectRowKernels().name << endl;
+    cout << endl;
+    cout << left << setw(18) << "format" << setw(10) << "kernels" << right << setw(12) << "us/MP" << setw(12)
+         << "MP/s" << setw(10) << "speedup" << endl;
+
+    for (int bpp : {8, 24, 32}) {
+        for (bool topDown : {false, true}) {
+            vector<uint8_t> bmp = makeBmp(width, height, bpp, topDown, random);
+            BmpImage image;
+
+            if (IMAGE_ParseBmp(bmp.data(), bmp.size(), image) != 0) {
+                cerr << "Error: Failed to parse " << bpp << "-bit BMP" << endl;
+                return 1;
+            }
+
+            vector<uint8_t> reference(size_t(width) * height * image.channels);
+            vector<uint8_t> output(reference.size());
+            double scalarCost = 0;
+
+            IMAGE_DecodeBmp(image, reference.data(), *kernels.front());
+
+            for (const BmpRowKernels *k : kernels) {
+                // Warm up the caches and check the result against the scalar kernels
+                IMAGE_DecodeBmp(image, output.data(), *k);
+                if (output != reference) {
+                    cerr << "Error: " << k->name << " kernels decoded a " << bpp << "-bit BMP incorrectly" << endl;
+                    status = 1;
+                }
+
+                auto start = chrono::steady_clock::now();
+                for (int i = 0; i < iterations; i++) {
+                    IMAGE_DecodeBmp(image, output.data(), *k);
+                }
+                chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+
+                const double cost = elapsed.count() / iterations / megapixels;
+                if (k == kernels.front()) {
+                    scalarCost = cost;
+                }
+
+                const string format = to_string(bpp) + "-bit " + (topDown ? "top-down" : "bottom-up");
+                cout << left << setw(18) << format << setw(10) << k->name << right << fixed << setprecision(1)
+                     << setw(12) << cost << setw(12) << 1e6 / cost << setw(9) << scalarCost / cost << "x" << endl;
+            }
+        }
+    }
+
+    cout << endl;
+    const string resizeTitle = "resize " + to_string(resize) + "x" + to_string(resize);
+    cout << left << setw(18) << resizeTitle << right << setw(10) << "letterbox" << setw(12) << "us/MP" << setw(12)
+         << "MP/s" << endl;
+
+    vector<uint8_t> rgb(size_t(width) * height * 3);
+    vector<uint8_t> resized(size_t(resize) * resize * 3);
+    for (auto &value : rgb) {
+        value = random();
+    }
+
+    const pair<ResizeMode, string> modes[] = {
+        {ResizeMode::NEAREST, "nearest"}, {ResizeMode::BILINEAR, "bilinear"}, {ResizeMode::AREA, "area"}};
+
+    for (auto &mode : modes) {
+        for (bool letterbox : {false, true}) {
+            // The coordinate tables are built once per image size, so they are part of the measurement
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                ImageResizer(width, height, resize, resize, 3, ResizeOptions(mode.first, letterbox))
+                    .resize(rgb.data(), resized.data());
+            }
+            chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+
+            const double cost = elapsed.count() / iterations / megapixels;
+            cout << left << setw(18) << mode.second << right << setw(10) << (letterbox ? "yes" : "no") << fixed
+                 << setprecision(1) << setw(12) << cost << setw(12) << 1e6 / cost << endl;
+        }
+    }
+
+    // Fused row pipeline against decoding, resizing and converting in separate passes
+    cout << endl;
+    cout << left << setw(18) << "float input" << right << setw(10) << "" << setw(12) << "us/MP" << setw(12) << "MP/s"
+         << endl;
+
+    vector<uint8_t> bmp = makeBmp(width, height, 24, false, random);
+    const size_t inputSize = size_t(resize) * resize * 3;
+    vector<float> fused(inputSize);
+    vector<float> separate(inputSize);
+    auto convert = [](uint8_t *row, int size) { return convertInputData<float>(reinterpret_cast<float *>(row), size); };
+
+    for (bool fuse : {false, true}) {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            if (fuse) {
+                IMAGE_DecodeRows(bmp.data(), bmp.size(), reinterpret_cast<uint8_t *>(fused.data()),
+                                 sizeof(float) * resize * 3, resize, resize, 3, ResizeOptions(ResizeMode::BILINEAR),
+                                 convert);
+            } else {
+                BmpImage image;
+                IMAGE_ParseBmp(bmp.data(), bmp.size(), image);
+                IMAGE_DecodeBmp(image, rgb.data(), IMAGE_SelectRowKernels());
+                ImageResizer(width, height, resize, resize, 3, ResizeOptions(ResizeMode::BILINEAR))
+                    .resize(rgb.data(), reinterpret_cast<uint8_t *>(separate.data()));
+                convertInputData<float>(separate.data(), inputSize);
+            }
+        }
+        chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+
+        const double cost = elapsed.count() / iterations / megapixels;
+        cout << left << setw(18) << (fuse ? "fused" : "separate") << right << setw(10) << "" << fixed
+             << setprecision(1) << setw(12) << cost << setw(12) << 1e6 / cost << endl;
+    }
+
+    if (fused != separate) {
+        cerr << "Error: Fused and separate passes produced different input" << endl;
+        status = 1;
+    }
+
+    // Conversion of the source image pixels with typical model quantization
+    cout << endl;
+    cout << left << setw(18) << "convert" << right << setw(10) << "" << setw(12) << "us/MP" << setw(12) << "MP/s"
+         << endl;
+
+    vector<uint8_t> pixels(rgb.size());
+    vector<float> converted(rgb.size());
+    const InputQuantization quantization(MODEL_INPUT_MEAN, MODEL_INPUT_STD, 1 / 128.0f, -1);
+
+    for (const string type : {"uint8", "int8", "float"}) {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            if (type == "uint8") {
+                IMAGE_ConvertInput(rgb.data(), pixels.data(), rgb.size(), quantization);
+            } else if (type == "int8") {
+                IMAGE_ConvertInput(rgb.data(), reinterpret_cast<int8_t *>(pixels.data()), rgb.size(), quantization);
+            } else {
+                IMAGE_ConvertInput(rgb.data(), converted.data(), rgb.size(), quantization);
+            }
+        }
+        chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+
+        const double cost = elapsed.count() / iterations / megapixels;
+        cout << left << setw(18) << type << right << setw(10) << "" << fixed << setprecision(1) << setw(12) << cost
+             << setw(12) << 1e6 / cost << endl;
+    }
+
+    // Concurrent loading from a memory mapped file, each thread with its own input tensor
+    char filename[] = "/tmp/image_decode_bench_XXXXXX";
+    int fd          = mkstemp(filename);
+    if (fd < 0 || write(fd, bmp.data(), bmp.size()) != ssize_t(bmp.size())) {
+        cerr << "Error: Failed to write the BMP file" << endl;
+        return 1;
+    }
+    close(fd);
+
+    cout << endl;
+    cout << left << setw(18) << "load float input" << right << setw(10) << "threads" << setw(12) << "us/MP" << setw(12)
+         << "MP/s" << endl;
+
+    const vector<size_t> shape = {1, size_t(resize), size_t(resize), 3};
+
+    for (int count : {1, threads}) {
+        vector<thread> workers;
+        vector<int> results(count);
+
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < count; t++) {
+            workers.emplace_back([&, t]() {
+                vector<float> input(inputSize);
+                for (int i = 0; i < iterations; i++) {
+                    results[t] |= getInputFromFile<float>(filename, input.data(), shape, ResizeMode::BILINEAR);
+                }
+            });
+        }
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+
+        for (int result : results) {
+            status |= result != 0;
+        }
+
+        // Aggregate cost, the elapsed time divided by all images loaded by all threads
+        const double cost = elapsed.count() / (iterations * count) / megapixels;
+        cout << left << setw(18) << "bilinear" << right << setw(10) << count << fixed << setprecision(1) << setw(12)
+             << cost << setw(12) << 1e6 / cost << endl;
+
+        if (count == threads) {
+            break;
+        }
+    }
+
+    unlink(filename);
+
+    return status;
+}
@@ -20,6 +20,9 @@
 #include <ethosu.hpp>
 #include <uapi/ethosu.h>
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -49,8 +52,16 @@ void help(const string exe) {
     cerr << "    -P --pmu [0.." << Inference::getMaxPmuEventCounters() << "] eventid.\n";
     cerr << "                    PMU counter to enable followed by eventid, can be passed multiple times.\n";
     cerr << "    -C --cycles     Enable cycle counter for inference.\n";
+    cerr << "    --pmu-profile event[,event...]\n";
+    cerr << "                    Profile any number of PMU events, rotating them through the PMU\n";
+    cerr << "                    counters over repeated runs of the first IFM.\n";
+    cerr << "    --pmu-repeat    Number of runs per PMU event group (default 1).\n";
     cerr << "    -t --timeout    Timeout in nanoseconds (default " << defaultTimeout << ").\n";
     cerr << "    -p              Print OFM.\n";
+    cerr << "    --resize        IFM resize mode, nearest, bilinear or area (default nearest).\n";
+    cerr << "    --letterbox     Preserve the IFM aspect ratio when resizing, padding the borders.\n";
+    cerr << "    --mean          IFM normalization mean (default " << MODEL_INPUT_MEAN << ").\n";
+    cerr << "    --std           IFM normalization standard deviation (default " << MODEL_INPUT_STD << ").\n";
     cerr << endl;
 }
 
@@ -72,6 +83,10 @@ int readLabelsFile(const string& file_name, std::vector<string>* result,
   return 0;
 }
 
+int64_t monotonicNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 void rangeCheck(const int i, const int argc, const string arg) {
     if (i >= argc) {
         cerr << "Error: Missing argument to '" << arg << "'" << endl;
@@ -79,6 +94,20 @@ void rangeCheck(const int i, const int argc, const string arg) {
     }
 }
 
+// Parses a positive decimal count, rejecting trailing characters and negative numbers
+bool parseCount(const char *text, size_t &count) {
+    if (!isdigit(static_cast<unsigned char>(text[0]))) {
+        return false;
+    }
+
+    size_t end = 0;
+    try {
+        count = stoul(text, &end);
+    } catch (std::exception &) { return false; }
+
+    return text[end] == '\0' && count > 0;
+}
+
 shared_ptr<Buffer> allocAndFill(Device &device, const string filename) {
     ifstream stream(filename, ios::binary);
     if (!stream.is_open()) {
@@ -101,7 +130,9 @@ shared_ptr<Inference> createInference(Device &device,
                                       shared_ptr<Network> &network,
                                       const string &filename,
                                       const std::vector<uint8_t> &counters,
-                                      bool enableCycleCounter) {
+                                      bool enableCycleCounter,
+                                      const ResizeOptions &resizeOptions,
+                                      const vector<InputQuantization> &quantization) {
     // Create IFM buffers
     vector<shared_ptr<Buffer>> ifm;
     for (int i = 0; i < network->getIfmDims().size(); i ++) {
@@ -113,13 +144,16 @@ shared_ptr<Inference> createInference(Device &device,
         auto inputShape = network->getIfmShapes()[i];
         switch (inputType) {
             case TensorType::TensorType_UINT8:
-                getInputFromFile<uint8_t>(filename, (uint8_t*)buffer->data(), inputShape);
+                getInputFromFile<uint8_t>(filename, (uint8_t*)buffer->data(), inputShape, resizeOptions,
+                                          quantization[i]);
                 break;
             case TensorType::TensorType_INT8:
-                getInputFromFile<int8_t>(filename, (int8_t*)buffer->data(), inputShape);
+                getInputFromFile<int8_t>(filename, (int8_t*)buffer->data(), inputShape, resizeOptions,
+                                         quantization[i]);
                 break;
             case TensorType::TensorType_FLOAT32:
-                getInputFromFile<float>(filename, (float*)buffer->data(), inputShape);
+                getInputFromFile<float>(filename, (float*)buffer->data(), inputShape, resizeOptions,
+                                        quantization[i]);
                 break;
             default:
                 cerr << "Unknown input tensor data type" << endl;
@@ -166,6 +200,11 @@ int main(int argc, char *argv[]) {
     int64_t timeout         = defaultTimeout;
     bool print              = false;
     bool enableCycleCounter = false;
+    vector<uint32_t> profileEvents;
+    size_t profileRepeats   = 1;
+    ResizeOptions resizeOptions;
+    float inputMean         = MODEL_INPUT_MEAN;
+    float inputStd          = MODEL_INPUT_STD;
 
     for (int i = 1; i < argc; ++i) {
         const string arg(argv[i]);
@@ -211,8 +250,38 @@ int main(int argc, char *argv[]) {
             enabledCounters[pmu] = event;
         } else if (arg == "--cycles" || arg == "-C") {
             enableCycleCounter = true;
+        } else if (arg == "--pmu-profile") {
+            rangeCheck(++i, argc, arg);
+            try {
+                profileEvents = PmuProfiler::parseEvents(argv[i]);
+            } catch (std::exception &e) {
+                cerr << "Error: " << e.what() << endl;
+                help(exe);
+                exit(1);
+            }
+        } else if (arg == "--pmu-repeat") {
+            rangeCheck(++i, argc, arg);
+            if (!parseCount(argv[i], profileRepeats)) {
+                cerr << "Error: Invalid argument to '" << arg << "'" << endl;
+                help(exe);
+                exit(1);
+            }
         } else if (arg == "-p") {
             print = true;
+        } else if (arg == "--resize") {
+            rangeCheck(++i, argc, arg);
+            if (!IMAGE_ParseResizeMode(argv[i], resizeOptions.mode)) {
+                cerr << "Error: Invalid resize mode '" << argv[i] << "'" << endl;
+                exit(1);
+            }
+        } else if (arg == "--letterbox") {
+            resizeOptions.letterbox = true;
+        } else if (arg == "--mean") {
+            rangeCheck(++i, argc, arg);
+            inputMean = stof(argv[i]);
+        } else if (arg == "--std") {
+            rangeCheck(++i, argc, arg);
+            inputStd = stof(argv[i]);
         } else {
             cerr << "Error: Invalid argument '" << arg << "'" << endl;
             help(exe);
@@ -274,115 +343,170 @@ int main(int argc, char *argv[]) {
             network = make_shared<Network>(device, networkIndex);
         }
 
+        /* Take the IFM quantization from the model, networks stored in the firmware use the defaults */
+        vector<InputQuantization> quantization(network->getIfmTypes().size(), InputQuantization(inputMean, inputStd));
+        for (size_t i = 0; networkIndex < 0 && i < quantization.size(); i++) {
+            if (MODEL_ReadInputQuantization(networkArg, i, quantization[i]) != 0) {
+                cerr << "Warning: Failed to read the quantization of IFM " << i << " from the model" << endl;
+            }
+        }
+
         /* Create one inference per IFM */
         list<shared_ptr<Inference>> inferences;
         for (auto &filename : ifmArg) {
             cout << "Create inference" << endl;
-            inferences.push_back(createInference(device, network, filename, enabledCounters, enableCycleCounter));
+            inferences.push_back(createInference(
+                device, network, filename, enabledCounters, enableCycleCounter, resizeOptions, quantization));
+        }
+
+        /* Inferences still running at the timeout are cancelled by the watchdog */
+        for (auto &inference : inferences) {
+            Watchdog::instance().watch(inference, timeout);
         }
 
         cout << "Wait for inferences" << endl;
 
-        int ofmIndex = 0;
+        /* Consume the inferences in completion order */
+        vector<Inference *> pending;
+        vector<int> pendingOfmIndex;
         for (auto &inference : inferences) {
-            cout << "Inference status: " << inference->status() << endl;
+            pending.push_back(inference.get());
+            pendingOfmIndex.push_back(pendingOfmIndex.size());
+        }
+
+        /* All inferences share one deadline, covering the timeout and the abort after it */
+        const int64_t deadline = timeout < 0 ? -1 : monotonicNanos() + timeout + Watchdog::instance().getAbortTimeout();
+
+        while (!pending.empty()) {
+            vector<size_t> completed;
+            int64_t remaining = -1;
+
+            if (deadline >= 0) {
+                remaining = max<int64_t>(deadline - monotonicNanos(), 0);
+            }
 
             /* make sure the wait completes ok */
             try {
                 cout << "Wait for inference" << endl;
-                bool timedout = inference->wait(timeout);
-                if (timedout) {
-                    cout << "Inference timed out, cancelling it" << endl;
-                    bool aborted = inference->cancel();
-                    if (!aborted || inference->status() != InferenceStatus::ABORTED) {
-                        cout << "Inference cancellation failed" << endl;
-                    }
+                completed = Inference::waitAny(pending, remaining);
+                if (completed.empty()) {
+                    cout << "Inference cancellation failed" << endl;
+                    exit(1);
                 }
             } catch (std::exception &e) {
                 cout << "Failed to wait for or to cancel inference: " << e.what() << endl;
                 exit(1);
             }
 
-            cout << "Inference status: " << inference->status() << endl;
-
-            if (inference->status() == InferenceStatus::OK) {
-                string ofmFilename = ofmArg + "." + to_string(ofmIndex);
-                ofstream ofmStream(ofmFilename, ios::binary);
-                if (!ofmStream.is_open()) {
-                    cerr << "Error: Failed to open '" << ofmFilename << "'" << endl;
-                    exit(1);
-                }
+            for (auto i : completed) {
+                Inference *inference = pending[i];
+                int ofmIndex         = pendingOfmIndex[i];
 
-                /* The inference completed and has ok status */
-                for (auto &ofmBuffer : inference->getOfmBuffers()) {
-                    cout << "OFM size: " << ofmBuffer->size() << endl;
+                cout << "Inference status: " << inference->status() << endl;
 
-                    if (print) {
-                        cout << "OFM data: " << *ofmBuffer << endl;
+                if (inference->status() == InferenceStatus::OK) {
+                    string ofmFilename = ofmArg + "." + to_string(ofmIndex);
+                    ofstream ofmStream(ofmFilename, ios::binary);
+                    if (!ofmStream.is_open()) {
+                        cerr << "Error: Failed to open '" << ofmFilename << "'" << endl;
+                        exit(1);
                     }
 
-                    ofmStream.write(ofmBuffer->data(), ofmBuffer->size());
-                }
+                    /* The inference completed and has ok status */
+                    for (auto &ofmBuffer : inference->getOfmBuffers()) {
+                        cout << "OFM size: " << ofmBuffer->size() << endl;
 
-                ofmStream.flush();
+                        if (print) {
+                            cout << "OFM data: " << *ofmBuffer << endl;
+                        }
 
-                /* Process the inference result */
-                InferenceResult results;
-                if (inference->getOfmBuffers().size() > 1 ) {
-                    //for ssd model
-                    std::vector<void*> outputData;
-                    for (auto &ofmBuffer : inference->getOfmBuffers()) {
-                        outputData.push_back(ofmBuffer->data());
+                        ofmStream.write(ofmBuffer->data(), ofmBuffer->size());
                     }
-                    results = getBoundingBoxes(outputData, 4);
-                } else {
-                    size_t count = network->getOfmShapes()[0][1];
-                    // for image classification model
-                    auto data = inference->getOfmBuffers()[0]->data();
-                    switch (network->getOfmTypes()[0]) {
-                        case TensorType::TensorType_UINT8:
-                            results = getTopN<uint8_t>((uint8_t*)data, 0.23, count, 0, 255.0);
+
+                    ofmStream.flush();
+
+                    /* Process the inference result */
+                    PostProcessResult results;
+                    if (inference->getOfmBuffers().size() > 1 ) {
+                        //for ssd model
+                        std::vector<void*> outputData;
+                        for (auto &ofmBuffer : inference->getOfmBuffers()) {
+                            outputData.push_back(ofmBuffer->data());
+                        }
+                        results = getBoundingBoxes(outputData, 4);
+                    } else {
+                        size_t count = network->getOfmShapes()[0][1];
+                        // for image classification model
+                        auto data = inference->getOfmBuffers()[0]->data();
+                        switch (network->getOfmTypes()[0]) {
+                            case TensorType::TensorType_UINT8:
+                                results = getTopN<uint8_t>((uint8_t*)data, 0.23, count, 0, 255.0);
+                                break;
+                            case TensorType::TensorType_INT8:
+                                results = getTopN<int8_t>((int8_t*)data, 0.23, count, 128, 255.0);
                             break;
-                        case TensorType::TensorType_INT8:
-                            results = getTopN<int8_t>((int8_t*)data, 0.23, count, 128, 255.0);
-                        break;
-                        case TensorType::TensorType_FLOAT32:
-                            results = getTopN<float>((float*)data, 0.23, count, 0, 1.0);
-                             break;
-                        default:
-                            cerr << "Unknown output tensor data type" << endl;
-                            exit(1);
+                            case TensorType::TensorType_FLOAT32:
+                                results = getTopN<float>((float*)data, 0.23, count, 0, 1.0);
+                                 break;
+                            default:
+                                cerr << "Unknown output tensor data type" << endl;
+                                exit(1);
+                        }
                     }
-                }
-                /* Display the inference results */
-                for (auto result : results) {
-                    cout << "\nDetected: " << labels[std::get<0>(result)] << ", confidence:"
-                         << (int)(std::get<1>(result) * 100) << endl;
-
-                    auto pos = std::get<2>(result);
-                    if(pos.size() != 0) {
-                         cout << "Location: ymin: " << pos[0] << ", xmin " << pos[1]
-                              << ", ymax " << pos[2] << ", xmax " << pos[3] << endl;
+                    /* Display the inference results */
+                    for (auto result : results) {
+                        cout << "\nDetected: " << labels[std::get<0>(result)] << ", confidence:"
+                             << (int)(std::get<1>(result) * 100) << endl;
+
+                        auto pos = std::get<2>(result);
+                        if(pos.size() != 0) {
+                             cout << "Location: ymin: " << pos[0] << ", xmin " << pos[1]
+                                  << ", ymax " << pos[2] << ", xmax " << pos[3] << endl;
+                        }
                     }
-                }
 
 
-                /* Read out PMU counters if configured */
-                if (std::count(enabledCounters.begin(), enabledCounters.end(), 0) <
-                    Inference::getMaxPmuEventCounters()) {
+                    /* Read out PMU counters if configured */
+                    if (std::count(enabledCounters.begin(), enabledCounters.end(), 0) <
+                        Inference::getMaxPmuEventCounters()) {
 
-                    const std::vector<uint32_t> pmus = inference->getPmuCounters();
-                    cout << "PMUs : [";
-                    for (auto p : pmus) {
-                        cout << " " << p;
+                        const std::vector<uint32_t> pmus = inference->getPmuCounters();
+                        cout << "PMUs : [";
+                        for (auto p : pmus) {
+                            cout << " " << p;
+                        }
+                        cout << " ]" << endl;
                     }
-                    cout << " ]" << endl;
+                    if (enableCycleCounter)
+                        cout << "Cycle counter: " << inference->getCycleCounter() << endl;
                 }
-                if (enableCycleCounter)
-                    cout << "Cycle counter: " << inference->getCycleCounter() << endl;
             }
 
-            ofmIndex++;
+            for (auto it = completed.rbegin(); it != completed.rend(); ++it) {
+                pending.erase(pending.begin() + *it);
+                pendingOfmIndex.erase(pendingOfmIndex.begin() + *it);
+            }
+        }
+
+        /* Rerun the first IFM for every PMU event group */
+        if (!profileEvents.empty()) {
+            auto &ifm = inferences.front()->getIfmBuffers();
+            auto &ofm = inferences.front()->getOfmBuffers();
+
+            PmuProfiler profiler(profileEvents, profileRepeats);
+            cout << profiler.run([&](const vector<uint32_t> &events) {
+                for (auto &buffer : ofm) {
+                    buffer->clear();
+                }
+
+                Inference inference(network, ifm.begin(), ifm.end(), ofm.begin(), ofm.end(), events, true);
+                if (inference.wait(timeout)) {
+                    inference.cancel();
+                    throw Exception("PMU profile inference timed out");
+                }
+
+                return inference.result();
+            });
         }
     } catch (Exception &e) {
         cerr << "Error: " << e.what() << endl;
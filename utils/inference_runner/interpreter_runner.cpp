@@ -19,6 +19,7 @@
 
 #include <ethosu.hpp>
 
+#include <cctype>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -47,9 +48,20 @@ void help(const string exe) {
     cerr << "    -P --pmu [0.." << ETHOSU_PMU_EVENT_MAX << "] eventid.\n";
     cerr << "                    PMU counter to enable followed by eventid, can be passed multiple times.\n";
     cerr << "    -C --cycles     Enable cycle counter for inference.\n";
+    cerr << "    --pmu-profile event[,event...]\n";
+    cerr << "                    Profile any number of PMU events, rotating them through the PMU\n";
+    cerr << "                    counters over repeated runs of the first IFM.\n";
+    cerr << "    --pmu-repeat    Number of runs per PMU event group (default 1).\n";
     cerr << "    -t --timeout    Timeout in nanoseconds (default " << defaultTimeout << ").\n";
     cerr << "    -a --arena      TFLite-micro arena memory size (default " << defaultArenaSizeOfMB << "MB).\n";
     cerr << "    -p              Print OFM.\n";
+    cerr << "    --fast-start    Skip the capability dump, load the model in parallel with the device\n";
+    cerr << "                    setup and allocate the arena in the background.\n";
+    cerr << "    --startup       Print the startup timing breakdown.\n";
+    cerr << "    --resize        IFM resize mode, nearest, bilinear or area (default nearest).\n";
+    cerr << "    --letterbox     Preserve the IFM aspect ratio when resizing, padding the borders.\n";
+    cerr << "    --mean          IFM normalization mean (default " << MODEL_INPUT_MEAN << ").\n";
+    cerr << "    --std           IFM normalization standard deviation (default " << MODEL_INPUT_STD << ").\n";
     cerr << endl;
 }
 
@@ -60,6 +72,20 @@ void rangeCheck(const int i, const int argc, const string arg) {
     }
 }
 
+// Parses a positive decimal count, rejecting trailing characters and negative numbers
+bool parseCount(const char *text, size_t &count) {
+    if (!isdigit(static_cast<unsigned char>(text[0]))) {
+        return false;
+    }
+
+    size_t end = 0;
+    try {
+        count = stoul(text, &end);
+    } catch (std::exception &) { return false; }
+
+    return text[end] == '\0' && count > 0;
+}
+
 // Takes a file name, and loads a list of labels from it, one per line, and
 // returns a vector of the strings. It pads with empty strings so the length
 // of the result is a multiple of 16, because our model expects that.
@@ -90,6 +116,13 @@ int main(int argc, char *argv[]) {
     int64_t timeout         = defaultTimeout;
     bool print              = false;
     bool enableCycleCounter = false;
+    bool fastStart          = false;
+    bool printStartup       = false;
+    vector<uint32_t> profileEvents;
+    size_t profileRepeats   = 1;
+    ResizeOptions resizeOptions;
+    float inputMean         = MODEL_INPUT_MEAN;
+    float inputStd          = MODEL_INPUT_STD;
     std::vector<string> labels;
     size_t labelCount;
     int64_t arenaSizeOfMB      = defaultArenaSizeOfMB;
@@ -136,8 +169,42 @@ int main(int argc, char *argv[]) {
             enabledCounters[pmu] = event;
         } else if (arg == "--cycles" || arg == "-C") {
             enableCycleCounter = true;
+        } else if (arg == "--pmu-profile") {
+            rangeCheck(++i, argc, arg);
+            try {
+                profileEvents = PmuProfiler::parseEvents(argv[i]);
+            } catch (std::exception &e) {
+                cerr << "Error: " << e.what() << endl;
+                help(exe);
+                exit(1);
+            }
+        } else if (arg == "--pmu-repeat") {
+            rangeCheck(++i, argc, arg);
+            if (!parseCount(argv[i], profileRepeats)) {
+                cerr << "Error: Invalid argument to '" << arg << "'" << endl;
+                help(exe);
+                exit(1);
+            }
         } else if (arg == "-p") {
             print = true;
+        } else if (arg == "--fast-start") {
+            fastStart = true;
+        } else if (arg == "--startup") {
+            printStartup = true;
+        } else if (arg == "--resize") {
+            rangeCheck(++i, argc, arg);
+            if (!IMAGE_ParseResizeMode(argv[i], resizeOptions.mode)) {
+                cerr << "Error: Invalid resize mode '" << argv[i] << "'" << endl;
+                exit(1);
+            }
+        } else if (arg == "--letterbox") {
+            resizeOptions.letterbox = true;
+        } else if (arg == "--mean") {
+            rangeCheck(++i, argc, arg);
+            inputMean = stof(argv[i]);
+        } else if (arg == "--std") {
+            rangeCheck(++i, argc, arg);
+            inputStd = stof(argv[i]);
         } else {
             cerr << "Error: Invalid argument '" << arg << "'" << endl;
             help(exe);
@@ -161,22 +228,28 @@ int main(int argc, char *argv[]) {
     }
 
     try {
-        auto interpreter = make_unique<Interpreter>(networkArg.c_str(), devArg.c_str(), arenaSizeOfMB);
+        auto options     = fastStart ? InterpreterOptions::fastStart() : InterpreterOptions();
+        auto interpreter = make_unique<Interpreter>(networkArg.c_str(), devArg.c_str(), arenaSizeOfMB, options);
         interpreter->SetPmuCycleCounters(enabledCounters, enableCycleCounter);
 
         auto inputInfo = interpreter->GetInputInfo()[0];
+
+        InputQuantization quantization(inputMean, inputStd);
+        if (MODEL_ReadInputQuantization(networkArg, 0, quantization) != 0) {
+            cerr << "Warning: Failed to read the IFM quantization from the model" << endl;
+        }
         switch (inputInfo.type) {
             case TensorType::TensorType_UINT8:
                 getInputFromFile<uint8_t>(ifmArg.front(),
-                          interpreter->typed_input_buffer<uint8_t>(0), inputInfo.shape);
+                          interpreter->typed_input_buffer<uint8_t>(0), inputInfo.shape, resizeOptions, quantization);
                 break;
             case TensorType::TensorType_INT8:
                 getInputFromFile<int8_t>(ifmArg.front(),
-                          interpreter->typed_input_buffer<int8_t>(0), inputInfo.shape);
+                          interpreter->typed_input_buffer<int8_t>(0), inputInfo.shape, resizeOptions, quantization);
                 break;
             case TensorType::TensorType_FLOAT32:
                 getInputFromFile<float>(ifmArg.front(),
-                          interpreter->typed_input_buffer<float>(0), inputInfo.shape);
+                          interpreter->typed_input_buffer<float>(0), inputInfo.shape, resizeOptions, quantization);
                 break;
             default:
                 cerr << "Unknown input tensor data type" << endl;
@@ -185,8 +258,12 @@ int main(int argc, char *argv[]) {
 
         interpreter->Invoke();
 
+        if (printStartup) {
+            cout << interpreter->GetStartupTiming();
+        }
+
         /* The inference completed and has ok status */
-        InferenceResult results;
+        PostProcessResult results;
         auto outputInfo = interpreter->GetOutputInfo();
         if (outputInfo.size() > 1 ) {
             //for ssd model
@@ -253,6 +330,12 @@ int main(int argc, char *argv[]) {
           }
           if (enableCycleCounter)
               cout << "Cycle counter: " << interpreter->GetCycleCounter() << endl;
+
+          /* Rerun the same input for every PMU event group */
+          if (!profileEvents.empty()) {
+              PmuProfiler profiler(profileEvents, profileRepeats);
+              cout << profiler.run(*interpreter, timeout);
+          }
     } catch (Exception &e) {
         cerr << "Error: " << e.what() << endl;
         return 1;